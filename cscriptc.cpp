@@ -25,6 +25,8 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -32,6 +34,9 @@
 #include <windows.h>
 #define PATH_SEP '\\'
 #else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #define PATH_SEP '/'
 #endif
@@ -116,6 +121,8 @@ struct Config {
     string opt = "O2";            // Optimization level
     bool lto = true;              // Link-time optimization
     bool profile = false;         // PGO two-pass
+    bool profile_sample = false;  // @profile sample: train with the sampling profiler instead of counters
+    string profile_use = "";      // --profile-use: counts or folded stacks from an earlier run
     bool debug = false;           // Include debug symbols
     string out = "a.exe";         // Output filename
     string abi = "";              // ABI compatibility
@@ -133,6 +140,20 @@ struct Config {
     bool emit_llvm = false;       // Emit LLVM IR
     bool warn_as_error = false;   // Treat warnings as errors
     string target = "";           // Target triple
+    set<string> modules;          // Opt-in prelude modules (@use <name>, or implied by syntax)
+    string chan_mode = "mpmc";    // Default chan[T] implementation: spsc|mpmc
+    bool vectorize_hints = false; // Source uses @vectorize (GCC needs the loop vectorizer forced on)
+    string cpu = "";              // Target CPU: "" generic, native, a CPU name and/or +feat,-feat list
+    bool size_report = false;     // --size-report: per-function .text breakdown after the build
+    bool remarks = false;         // --remarks: inline/vectorizer remarks for the final build
+    string remarks_file = "";     // where the compiler writes them (set by the driver)
+    bool bench = false;           // `cscriptc bench`: build the bench blocks with the harness and run them
+    string bench_filter = "";     // --filter: only benches whose name contains this
+    string bench_json = "";       // --json: also write the results here
+    string bench_baseline = "";   // --baseline: earlier results to compare against
+    double bench_threshold = 5.0; // --threshold: allowed median slowdown in percent
+    bool bench_counters = false;  // --counters: hardware counters per bench (perf_event_open)
+    bool auto_fix = false;        // --auto-fix: retry failed C builds with the repairs their errors call for
 };
 
 //============================= String utilities =============================
@@ -152,6 +173,16 @@ static string trim(const string& s) {
     return s.substr(a, b - a + 1);
 }
 
+// s as a C string literal (for #line file names and the like).
+static string c_quote(const string& s) {
+    string q = "\"";
+    for (char c : s) {
+        if (c == '\\' || c == '"') q += '\\';
+        q += c;
+    }
+    return q + "\"";
+}
+
 static vector<string> split(const string& s, char delim) {
     vector<string> result;
     std::istringstream iss(s);
@@ -162,6 +193,141 @@ static vector<string> split(const string& s, char delim) {
     return result;
 }
 
+// Index of the bracket that closes s[open] ('(', '[' or '{'), skipping string
+// and character literals and comments; npos when unbalanced.
+static size_t find_matching(const string& s, size_t open) {
+    const char o = s[open];
+    const char c = (o == '(') ? ')' : (o == '[') ? ']' : '}';
+    int depth = 0;
+    for (size_t i = open; i < s.size(); ++i) {
+        char ch = s[i];
+        if (ch == '"' || ch == '\'') {
+            for (++i; i < s.size() && s[i] != ch; ++i) if (s[i] == '\\') ++i;
+            continue;
+        }
+        if (ch == '/' && i + 1 < s.size() && s[i + 1] == '/') { i = s.find('\n', i); if (i == string::npos) break; continue; }
+        if (ch == '/' && i + 1 < s.size() && s[i + 1] == '*') { i = s.find("*/", i + 2); if (i == string::npos) break; ++i; continue; }
+        if (ch == o) depth++;
+        else if (ch == c && --depth == 0) return i;
+    }
+    return string::npos;
+}
+
+// Split s at top-level occurrences of delim (outside brackets and literals).
+static vector<string> split_top_level(const string& s, const string& delim) {
+    vector<string> parts;
+    int depth = 0;
+    size_t start = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+        char ch = s[i];
+        if (ch == '"' || ch == '\'') {
+            for (++i; i < s.size() && s[i] != ch; ++i) if (s[i] == '\\') ++i;
+            continue;
+        }
+        if (ch == '(' || ch == '[' || ch == '{') depth++;
+        else if (ch == ')' || ch == ']' || ch == '}') depth--;
+        else if (depth == 0 && s.compare(i, delim.size(), delim) == 0) {
+            parts.push_back(s.substr(start, i - start));
+            i += delim.size() - 1;
+            start = i + 1;
+        }
+    }
+    parts.push_back(s.substr(start));
+    return parts;
+}
+
+// First offset at or after i that isn't whitespace or a comment.
+static size_t skip_ws_comments(const string& s, size_t i) {
+    for (;;) {
+        while (i < s.size() && isspace((unsigned char)s[i])) ++i;
+        if (s.compare(i, 2, "//") == 0) { i = s.find('\n', i); if (i == string::npos) return s.size(); continue; }
+        if (s.compare(i, 2, "/*") == 0) { size_t e = s.find("*/", i + 2); i = e == string::npos ? s.size() : e + 2; continue; }
+        return i;
+    }
+}
+
+// code[i] is false where s[i] lies in a string/char literal or a comment, so
+// regex-driven passes can ignore matches there.
+static vector<bool> code_mask(const string& s) {
+    vector<bool> code(s.size(), true);
+    for (size_t i = 0; i < s.size();) {
+        char c = s[i];
+        size_t j = i;
+        if (c == '"' || c == '\'') {
+            for (++j; j < s.size() && s[j] != c; ++j) if (s[j] == '\\') ++j;
+            j = std::min(j + 1, s.size());
+        }
+        else if (s.compare(i, 2, "//") == 0 || s.compare(i, 2, "/*") == 0) j = skip_ws_comments(s, i);
+        else { ++i; continue; }
+        std::fill(code.begin() + static_cast<std::ptrdiff_t>(i), code.begin() + static_cast<std::ptrdiff_t>(j), false);
+        i = j;
+    }
+    return code;
+}
+
+// std::regex_replace limited to matches that start in code (see code_mask).
+static string regex_replace_code(const string& s, const std::regex& re, const string& fmt) {
+    vector<bool> code = code_mask(s);
+    string out;
+    out.reserve(s.size());
+    size_t last = 0;
+    for (std::sregex_iterator it(s.begin(), s.end(), re), e; it != e; ++it) {
+        size_t at = static_cast<size_t>(it->position(0));
+        if (!code[at]) continue;
+        out.append(s, last, at - last);
+        out += it->format(fmt);
+        last = at + static_cast<size_t>(it->length(0));
+    }
+    out.append(s, last, string::npos);
+    return out;
+}
+
+// Identifier-safe spelling of a C type for monomorphized names:
+// "unsigned int" -> "unsigned_int", "struct Msg*" -> "struct_Msg_ptr".
+static string mangle_type(const string& t) {
+    string out;
+    for (char c : trim(t)) {
+        if (isalnum((unsigned char)c) || c == '_') out.push_back(c);
+        else if (c == '*') out += "_ptr";
+        else if (!out.empty() && out.back() != '_') out.push_back('_');
+    }
+    while (!out.empty() && out.back() == '_') out.pop_back();
+    string collapsed;
+    for (char c : out) if (!(c == '_' && !collapsed.empty() && collapsed.back() == '_')) collapsed.push_back(c);
+    return collapsed;
+}
+
+// Offset at which a file-scope declaration can be inserted so that it precedes
+// the top-level construct containing `pos` (after the last ';', '}' or
+// preprocessor line that closes at brace depth 0).
+static size_t toplevel_insert_point(const string& s, size_t pos) {
+    size_t cand = 0;
+    int depth = 0;
+    bool line_start = true;
+    for (size_t i = 0; i < pos && i < s.size(); ++i) {
+        char c = s[i];
+        if (c == '"' || c == '\'') {
+            for (++i; i < s.size() && s[i] != c; ++i) if (s[i] == '\\') ++i;
+            line_start = false;
+            continue;
+        }
+        if (c == '/' && i + 1 < s.size() && s[i + 1] == '/') { while (i + 1 < s.size() && s[i + 1] != '\n') ++i; continue; }
+        if (c == '/' && i + 1 < s.size() && s[i + 1] == '*') { size_t e = s.find("*/", i + 2); i = (e == string::npos) ? s.size() : e + 1; continue; }
+        if (c == '#' && line_start && depth == 0) {
+            size_t e = s.find('\n', i);
+            if (e == string::npos || e >= pos) break;
+            i = e; cand = e + 1;
+            continue;
+        }
+        if (c == '\n') { line_start = true; continue; }
+        if (!isspace((unsigned char)c)) line_start = false;
+        if (c == '{') depth++;
+        else if (c == '}') { if (--depth == 0) cand = i + 1; }
+        else if (c == ';' && depth == 0) cand = i + 1;
+    }
+    return cand;
+}
+
 //============================= File operations =============================
 static string read_file(const string& p) {
     std::ifstream f(p, std::ios::binary);
@@ -169,6 +335,47 @@ static string read_file(const string& p) {
     std::ostringstream ss; ss << f.rdbuf(); return ss.str();
 }
 
+// Read-only view of a whole input file. POSIX maps it, so the source is read
+// straight from the page cache without a private copy; elsewhere (or for
+// files that can't be mapped, e.g. pipes) it falls back to read_file.
+class MappedFile {
+public:
+    explicit MappedFile(const string& p) {
+#if !defined(_WIN32)
+        int fd = ::open(p.c_str(), O_RDONLY);
+        if (fd < 0) throw CompilerError("Cannot open file: " + p);
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* m = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m != MAP_FAILED) {
+                map_ = m;
+                size_ = static_cast<size_t>(st.st_size);
+                madvise(m, size_, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+        if (map_) return;
+#endif
+        fallback_ = read_file(p);
+    }
+    ~MappedFile() {
+#if !defined(_WIN32)
+        if (map_) munmap(map_, size_);
+#endif
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view view() const {
+        return map_ ? std::string_view(static_cast<const char*>(map_), size_) : std::string_view(fallback_);
+    }
+
+private:
+    void* map_ = nullptr;
+    size_t size_ = 0;
+    string fallback_;
+};
+
 static string get_temp_dir() {
     string dir;
 #if defined(_WIN32)
@@ -191,18 +398,112 @@ static string write_temp(const string& base, const string& content) {
     return path;
 }
 
+// Write a translation unit given as consecutive pieces (prelude, modules,
+// lowered body) without first joining them into one string.
+static string write_temp_pieces(const string& base, const vector<std::string_view>& pieces) {
+    string path = get_temp_dir() + base;
+    FILE* f = std::fopen(path.c_str(), "wb");
+    if (!f) throw CompilerError("Cannot create temporary file: " + path);
+    std::setvbuf(f, nullptr, _IOFBF, 1 << 20);
+    bool ok = true;
+    for (auto p : pieces) ok = ok && std::fwrite(p.data(), 1, p.size(), f) == p.size();
+    if (std::fclose(f) != 0 || !ok) throw CompilerError("Cannot write temporary file: " + path);
+    return path;
+}
+
 static bool rm_file(const string& p) {
     return std::remove(p.c_str()) == 0;
 }
 
+//============================= Source lines =============================
+// The lowered body is compiled as `#line 1 CS__SRC` (CS__SRC names the .csc,
+// see main), so body line N is .csc line N. Passes that change the number of
+// lines re-anchor the text after their output with another #line directive:
+// generated helpers go to the virtual file "<cscript-generated>", user code
+// resumes at its own .csc line. line_col_at follows these directives, so
+// errors raised by later passes still report .csc positions.
+struct SourcePos {
+    int line = 1, col = 1;
+    string file = "CS__SRC";   // file token of the last #line seen
+};
+
+// Walks s forward from the last position asked for, so a pass that needs the
+// source line at many increasing offsets scans s once. Positions must not go
+// backwards; s must not change while the cursor is in use.
+struct SourceCursor {
+    const string& s;
+    size_t bol = 0;   // start of the current line
+    SourcePos p;      // line and file at bol
+    explicit SourceCursor(const string& text) : s(text) {}
+
+    SourcePos at(size_t pos) {
+        pos = std::min(pos, s.size());
+        for (;;) {
+            size_t i = s.find('\n', bol);
+            if (i == string::npos || i >= pos) break;
+            size_t prev_bol = bol;
+            bol = i + 1; p.line++;
+            if (s.compare(bol, 6, "#line ") != 0) continue;
+            size_t e = s.find('\n', bol);
+            if (e == string::npos || e >= pos) {
+                // The directive is not complete before pos: it counts as text
+                // here, but a later position may still be re-anchored by it.
+                SourcePos r = p;
+                r.col = int(pos - bol) + 1;
+                bol = prev_bol; p.line--;
+                return r;
+            }
+            std::istringstream d(s.substr(bol + 6, e - bol - 6));
+            int n = 0;
+            string f;
+            if (!(d >> n)) continue;
+            if (d >> f) p.file = f;
+            p.line = n;
+            bol = e + 1;
+        }
+        SourcePos r = p;
+        r.col = int(pos - bol) + 1;
+        return r;
+    }
+};
+
+static SourcePos source_pos_at(const string& s, size_t pos) {
+    return SourceCursor(s).at(pos);
+}
+
 // For error lines
 static pair<int, int> line_col_at(const string& s, size_t pos) {
-    int line = 1, col = 1;
-    for (size_t i = 0; i < pos && i < s.size(); ++i) {
-        if (s[i] == '\n') { line++; col = 1; }
-        else col++;
+    SourcePos p = source_pos_at(s, pos);
+    return { p.line, p.col };
+}
+
+// "#line" that puts the text at pos back on its own source line.
+static string line_resync(SourceCursor& c, size_t pos) {
+    SourcePos p = c.at(pos);
+    return "\n#line " + std::to_string(p.line) + " " + p.file + "\n";
+}
+
+// Compiler-generated declarations inserted (or substituted) at offset at: they
+// get their own virtual file and the text at that offset keeps its line.
+static string generated_lines(SourceCursor& c, size_t at, const string& code) {
+    return "\n#line 1 \"<cscript-generated>\"\n" + code + line_resync(c, at);
+}
+
+// Inserts each (offset, code) pair as generated_lines. Offsets refer to s as
+// given; declarations sharing an offset end up in reverse list order.
+static void insert_generated(string& s, vector<pair<size_t, string>> decls) {
+    std::stable_sort(decls.begin(), decls.end(), [](auto& a, auto& b) { return a.first > b.first; });
+    SourceCursor c(s);
+    string out;
+    out.reserve(s.size());
+    size_t last = 0;
+    for (size_t i = decls.size(); i-- > 0;) {
+        out.append(s, last, decls[i].first - last);
+        out += generated_lines(c, decls[i].first, decls[i].second);
+        last = decls[i].first;
     }
-    return { line, col };
+    out.append(s, last, string::npos);
+    s.swap(out);
 }
 
 //============================= Prelude =============================
@@ -224,13 +525,55 @@ static string prelude(bool hardline) {
         << "  #define unlikely(x) (x)\n"
         << "#endif\n\n";
 
-    // Resource management with defer
-    o << "// ---- Resource management with 'defer' ----\n"
+    // Parameter attributes (@noalias/@restrict, @assume_aligned(N))
+    o << "// ---- Aliasing / alignment promises ----\n"
+        << "#if defined(_MSC_VER)\n"
+        << "  #define CS_RESTRICT __restrict\n"
+        << "  #define CS_ASSUME_ALIGNED(p, n) (p)\n"
+        << "#else\n"
+        << "  #define CS_RESTRICT restrict\n"
+        << "  #define CS_ASSUME_ALIGNED(p, n) __builtin_assume_aligned((p), (n))\n"
+        << "#endif\n\n";
+
+    // Struct layout control (@packed / @aligned(N) / @cacheline)
+    o << "// ---- Layout control ----\n"
+        << "#if defined(__APPLE__) && defined(__aarch64__)\n"
+        << "  #define CS_CACHELINE 128\n"
+        << "#else\n"
+        << "  #define CS_CACHELINE 64\n"
+        << "#endif\n"
+        << "#if defined(_MSC_VER)\n"
+        << "  #define CS_PACKED_BEGIN __pragma(pack(push, 1))\n"
+        << "  #define CS_PACKED_END   __pragma(pack(pop))\n"
+        << "  #define CS_PACKED\n"
+        << "  #define CS_ALIGNAS(n)   __declspec(align(n))\n"
+        << "#else\n"
+        << "  #define CS_PACKED_BEGIN\n"
+        << "  #define CS_PACKED_END\n"
+        << "  #define CS_PACKED       __attribute__((packed))\n"
+        << "  #define CS_ALIGNAS(n)   __attribute__((aligned(n)))\n"
+        << "#endif\n"
+        << "// Member that owns whole cache lines, e.g. per-thread counters: s.hits\n"
+        << "#define CS_PAD_TO_CACHELINE(T, name) union CS_ALIGNAS(CS_CACHELINE) { T name; }\n\n";
+
+    // Per-loop hints behind @unroll(n) / @vectorize
+    o << "// ---- Loop hints ----\n"
+        << "#define CS__PRAGMA(x) _Pragma(#x)\n"
+        << "#if defined(__clang__)\n"
+        << "  #define CS_UNROLL(n)  CS__PRAGMA(clang loop unroll_count(n))\n"
+        << "  #define CS_VECTORIZE  CS__PRAGMA(clang loop vectorize(enable) interleave(enable))\n"
+        << "#elif defined(__GNUC__)\n"
+        << "  #define CS_UNROLL(n)  CS__PRAGMA(GCC unroll n)\n"
+        << "  #define CS_VECTORIZE\n"
+        << "#else\n"
+        << "  #define CS_UNROLL(n)\n"
+        << "  #define CS_VECTORIZE\n"
+        << "#endif\n\n";
+
+    // Token pasting (defer itself is lowered by the front end, see lower_defer)
+    o << "// ---- Token pasting ----\n"
         << "#define CS_CONCAT2(a,b) a##b\n"
-        << "#define CS_CONCAT(a,b)  CS_CONCAT2(a,b)\n"
-        << "#define defer(body) for (int CS_CONCAT(_cs_defer_, __COUNTER__) = 0; \\\n"
-        << "                         CS_CONCAT(_cs_defer_, __COUNTER__) == 0; \\\n"
-        << "                         (void)(body), CS_CONCAT(_cs_defer_, __COUNTER__)=1)\n\n";
+        << "#define CS_CONCAT(a,b)  CS_CONCAT2(a,b)\n\n";
 
     // Exhaustive switch checking
     o << "// ---- Exhaustive switch helpers ----\n"
@@ -254,12 +597,27 @@ static string prelude(bool hardline) {
         << "#define CS_UNSAFE_BEGIN do { CS_PRAGMA_PUSH; CS_PRAGMA_RELAX; } while(0)\n"
         << "#define CS_UNSAFE_END   do { CS_PRAGMA_POP; } while(0)\n\n";
 
+    // Optimization barriers, for bench blocks and hand-written timing loops:
+    // cs_do_not_optimize(x) makes x's value observable so its computation can't
+    // be dropped or hoisted; cs_clobber_memory() makes pending stores observable.
+    o << "// ---- Optimization barriers ----\n"
+        << "#if defined(_MSC_VER)\n"
+        << "  #include <intrin.h>\n"
+        << "  #define cs_do_not_optimize(x) do { volatile __typeof__(x) cs__dno = (x); (void)cs__dno; } while(0)\n"
+        << "  #define cs_clobber_memory()   _ReadWriteBarrier()\n"
+        << "#else\n"
+        << "  #define cs_do_not_optimize(x) do { __typeof__(x) cs__dno = (x); __asm__ __volatile__(\"\" : : \"r\"(&cs__dno) : \"memory\"); } while(0)\n"
+        << "  #define cs_clobber_memory()   __asm__ __volatile__(\"\" : : : \"memory\")\n"
+        << "#endif\n\n";
+
     // Function attributes for PGO
     o << "// ---- Function attributes for PGO ----\n"
         << "#if defined(_MSC_VER)\n"
         << "  #define CS_HOT\n"
+        << "  #define CS_COLD __declspec(noinline)\n"
         << "#else\n"
         << "  #define CS_HOT __attribute__((hot))\n"
+        << "  #define CS_COLD __attribute__((cold, noinline))\n"
         << "#endif\n";
 
     if (hardline) o << "\n#define CS_HARDLINE 1\n";
@@ -318,6 +676,7 @@ static void cs_prof_hit(const char*){ /* no-op in optimized pass */ }
 // ---- Memory management utilities ----
 #ifndef CS_MALLOC
 #define CS_MALLOC malloc
+#define CS__MALLOC_DEFAULT 1
 #endif
 #ifndef CS_FREE
 #define CS_FREE free
@@ -327,197 +686,2602 @@ static void cs_prof_hit(const char*){ /* no-op in optimized pass */ }
 #endif
 
 // ---- Result type for error handling ----
-#define Result(T) struct { T value; bool ok; const char* error; }
-#define Ok(x) (typeof(x)){.value = (x), .ok = true, .error = NULL}
-#define Err(msg) {.ok = false, .error = (msg)}
-#define unwrap(result) ((result).ok ? (result).value : (fprintf(stderr, "Runtime error: %s\n", (result).error), exit(1), (result).value))
-#define try(result) do { if (!(result).ok) return Err((result).error); } while(0)
+// Result(T) is monomorphized by the front end into Result_<T> { T value; const char* error; };
+// error == NULL means ok, so no separate flag is stored; Err(NULL) therefore
+// stores "error" so it can't read back as success.
+static inline const char* cs__err_msg(const char* msg) { return msg ? msg : "error"; }
+#define Ok(x)     { .value = (x), .error = NULL }
+#define Err(msg)  { .error = cs__err_msg(msg) }
+#define is_ok(r)  ((r).error == NULL)
+#define is_err(r) ((r).error != NULL)
+#if defined(_MSC_VER)
+__declspec(noreturn)
+#else
+__attribute__((noreturn, unused))
+#endif
+static CS_COLD void cs__result_fail(const char* error) {
+    fprintf(stderr, "Runtime error: %s\n", error);
+    exit(1);
+}
+#if defined(__GNUC__) || defined(__clang__)
+  #define unwrap(r) __extension__ ({ __typeof__(r) cs__u = (r); if (unlikely(cs__u.error != NULL)) cs__result_fail(cs__u.error); cs__u.value; })
+  #define CS_TRY(R, x) __extension__ ({ __typeof__(x) cs__t = (x); if (unlikely(cs__t.error != NULL)) { R cs__e = Err(cs__t.error); return cs__e; } cs__t.value; })
+#else
+  #define unwrap(r) (unlikely((r).error != NULL) ? (cs__result_fail((r).error), (r).value) : (r).value)
+  /* try() returns from the middle of an expression, which needs GNU statement
+     expressions; under cl it stops the build at the try() with this name. */
+  #define CS_TRY(R, x) CS_TRY_needs_gcc_or_clang__use_is_err_and_return_instead
+#endif
 )";
 
-    // Add to the prelude function
-    o << "// ---- Capsule safety system ----\n"
-        << "#ifdef CAPSULE_GUARD\n"
-        << "  static volatile unsigned long long cs__mutations = 0;\n"
-        << "  #define CS_MUT_NOTE()          do { cs__mutations++; } while(0)\n"
-        << "  #define CS_MUT_STORE(dst,val)  do { (dst)=(val); cs__mutations++; } while(0)\n"
-        << "  #define CS_MUT_MEMCPY(d,s,n)   do { memcpy((d),(s),(n)); cs__mutations++; } while(0)\n"
-        << "  #define CS_GLYPH(sym)          \"[\" sym \"]\" \n"
-        << "  static unsigned long long cs_mutation_count(void) { return cs__mutations; }\n"
-        << "#else\n"
+    // Capsule safety system (--capsule / @muttrack): mutation counting. Each
+    // thread bumps its own cache-line slot with a relaxed load+store (no locked
+    // RMW, no sharing); cs_mutation_count() sums the slots when asked. Slots
+    // outlive their threads so the total never goes backwards. CS_MUT_SITES adds
+    // a per-call-site breakdown (shared atomic per site), printed at exit.
+    o << R"(// ---- Capsule safety system ----
+#if defined(CS_CAPSULE) && !defined(CAPSULE_GUARD)
+  #define CAPSULE_GUARD 1
+#endif
+#ifdef CAPSULE_GUARD
+#include <stdatomic.h>
+typedef struct cs__mut_slot { _Alignas(64) atomic_ullong n; struct cs__mut_slot* next; } cs__mut_slot;
+static _Atomic(cs__mut_slot*) cs__mut_slots = NULL;
+static _Thread_local cs__mut_slot* cs__mut_mine = NULL;
+
+static cs__mut_slot* cs__mut_register(void) {
+    cs__mut_slot* s = (cs__mut_slot*)aligned_alloc(64, sizeof(cs__mut_slot));
+    if (!s) { fprintf(stderr, "[C-Script capsule] mutation counter allocation failed\n"); abort(); }
+    atomic_init(&s->n, 0);
+    cs__mut_slot* h = atomic_load_explicit(&cs__mut_slots, memory_order_relaxed);
+    do s->next = h; while (!atomic_compare_exchange_weak_explicit(&cs__mut_slots, &h, s, memory_order_release, memory_order_relaxed));
+    return cs__mut_mine = s;
+}
+
+static inline void cs__mut_bump(void) {
+    cs__mut_slot* s = cs__mut_mine;
+    if (unlikely(!s)) s = cs__mut_register();
+    atomic_store_explicit(&s->n, atomic_load_explicit(&s->n, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+static inline unsigned long long cs_mutation_count(void) {
+    unsigned long long t = 0;
+    for (cs__mut_slot* s = atomic_load_explicit(&cs__mut_slots, memory_order_acquire); s; s = s->next)
+        t += atomic_load_explicit(&s->n, memory_order_relaxed);
+    return t;
+}
+
+#ifdef CS_MUT_SITES
+typedef struct cs__mut_site { const char* file; int line; atomic_ullong n; atomic_int linked; struct cs__mut_site* next; } cs__mut_site;
+static _Atomic(cs__mut_site*) cs__mut_sites = NULL;
+
+static inline void cs__mut_site_link(cs__mut_site* s) {
+    int expect = 0;
+    if (!atomic_compare_exchange_strong(&s->linked, &expect, 1)) return;
+    cs__mut_site* h = atomic_load_explicit(&cs__mut_sites, memory_order_relaxed);
+    do s->next = h; while (!atomic_compare_exchange_weak_explicit(&cs__mut_sites, &h, s, memory_order_release, memory_order_relaxed));
+}
+
+static int cs__mut_site_cmp(const void* a, const void* b) {
+    unsigned long long x = atomic_load(&(*(cs__mut_site* const*)a)->n), y = atomic_load(&(*(cs__mut_site* const*)b)->n);
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Total plus the busiest sites, most mutations first. */
+static void cs_mutation_report(FILE* f) {
+    size_t n = 0;
+    for (cs__mut_site* s = atomic_load(&cs__mut_sites); s; s = s->next) n++;
+    cs__mut_site** v = (cs__mut_site**)malloc((n ? n : 1) * sizeof(cs__mut_site*));
+    if (!v) return;
+    n = 0;
+    for (cs__mut_site* s = atomic_load(&cs__mut_sites); s; s = s->next) v[n++] = s;
+    qsort(v, n, sizeof(cs__mut_site*), cs__mut_site_cmp);
+    fprintf(f, "[C-Script capsule] %llu mutations, %zu sites\n", cs_mutation_count(), n);
+    for (size_t i = 0; i < n && i < 32; ++i) fprintf(f, "  %s:%d  %llu\n", v[i]->file, v[i]->line, (unsigned long long)atomic_load(&v[i]->n));
+    free(v);
+}
+
+static void cs__mut_report_at_exit(void) { cs_mutation_report(stderr); }
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((constructor))
+#endif
+static void cs__mut_ctor(void) { atexit(cs__mut_report_at_exit); }
+
+  #define CS__MUT_HIT() do { static cs__mut_site cs__site = { __FILE__, __LINE__, 0, 0, NULL }; \
+      if (unlikely(!atomic_load_explicit(&cs__site.linked, memory_order_relaxed))) cs__mut_site_link(&cs__site); \
+      atomic_fetch_add_explicit(&cs__site.n, 1, memory_order_relaxed); cs__mut_bump(); } while(0)
+#else
+  #define CS__MUT_HIT() cs__mut_bump()
+  static inline void cs_mutation_report(FILE* f) { fprintf(f, "[C-Script capsule] %llu mutations\n", cs_mutation_count()); }
+#endif
+  #define CS_MUT_NOTE()          do { CS__MUT_HIT(); } while(0)
+  #define CS_MUT_STORE(dst,val)  do { (dst)=(val); CS__MUT_HIT(); } while(0)
+  #define CS_MUT_MEMCPY(d,s,n)   do { memcpy((d),(s),(n)); CS__MUT_HIT(); } while(0)
+  #define CS_GLYPH(sym)          "[" sym "]"
+)";
+    o << "#else\n"
         << "  #define CS_MUT_NOTE()          do { } while(0)\n"
         << "  #define CS_MUT_STORE(dst,val)  do { (dst)=(val); } while(0)\n"
         << "  #define CS_MUT_MEMCPY(d,s,n)   memcpy((d),(s),(n))\n"
         << "  #define CS_GLYPH(sym)          \"\"\n"
+        << "  #define cs_mutation_count()    0ULL\n"
+        << "  #define cs_mutation_report(f)  ((void)(f))\n"
         << "#endif\n\n";
 
     return o.str();
 }
 
-//============================= Directives & body =============================
-static void parse_directives_and_collect(const string& in, Config& cfg, vector<string>& body) {
-    std::istringstream ss(in);
-    string line;
-    while (std::getline(ss, line)) {
-        string t = trim(line);
-        if (starts_with(t, "@")) {
-            std::istringstream ls(t.substr(1));
-            string name; ls >> name;
-            if (name == "hardline") {
-                string v; ls >> v;
-                cfg.hardline = (v != "off");
-            }
-            else if (name == "softline") {
-                string v; ls >> v;
-                cfg.softline = (v != "off");
-            }
-            else if (name == "opt") {
-                string v; ls >> v;
-                cfg.opt = v;
-            }
-            else if (name == "lto") {
-                string v; ls >> v;
-                cfg.lto = (v != "off");
-            }
-            else if (name == "profile") {
-                string v; ls >> v;
-                cfg.profile = (v != "off");
-            }
-            else if (name == "debug") {
-                string v; ls >> v;
-                cfg.debug = (v != "off");
-            }
-            else if (name == "out") {
-                string v; ls >> std::quoted(v);
-                cfg.out = v;
-            }
-            else if (name == "abi") {
-                string v; ls >> std::quoted(v);
-                cfg.abi = v;
-            }
-            else if (name == "define") {
-                string v; ls >> v;
-                cfg.defines.push_back(v);
-            }
-            else if (name == "inc") {
-                string v; ls >> std::quoted(v);
-                cfg.incs.push_back(v);
-            }
-            else if (name == "libpath") {
-                string v; ls >> std::quoted(v);
-                cfg.libpaths.push_back(v);
-            }
-            else if (name == "link") {
-                string v; ls >> std::quoted(v);
-                cfg.links.push_back(v);
-            }
-            else if (name == "target") {
-                string v; ls >> std::quoted(v);
-                cfg.target = v;
-            }
-            else {
-                std::cerr << "warning: unknown directive @" << name << "\n";
-            }
-            continue;
+// ---- @use threads: work-stealing task pool behind spawn/join/parallel_for ----
+// Fixed pool of workers, each owning a Chase-Lev deque (Le et al., PPoPP'13
+// orderings). Workers pop their own deque LIFO and steal FIFO from random
+// victims; threads outside the pool submit through a locked injector queue.
+// join() helps by running queued tasks instead of blocking.
+static string prelude_threads() {
+    return R"CS(
+// ---- Task runtime (spawn / join / parallel_for) ----
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+typedef void* (*cs_task_fn)(void*);
+typedef void (*cs_range_fn)(void* ctx, long lo, long hi);
+typedef struct cs_task { cs_task_fn fn; void* arg; void* result; atomic_int done; int heap; } cs_task;
+
+typedef struct cs__ring { long cap; struct cs__ring* prev; _Atomic(cs_task*) buf[]; } cs__ring;
+typedef struct cs__deque { atomic_long top; char _pad0[64 - sizeof(atomic_long)]; atomic_long bottom; _Atomic(cs__ring*) ring; char _pad1[64]; } cs__deque;
+
+static cs__deque* cs__pool_q = NULL;
+static int cs__pool_n = 0;
+static pthread_once_t cs__pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t cs__pool_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cs__pool_cv = PTHREAD_COND_INITIALIZER;
+static atomic_long cs__pool_pending = 0;
+static atomic_int cs__pool_sleepers = 0;
+static cs_task** cs__inj_buf = NULL;
+static size_t cs__inj_head = 0, cs__inj_cap = 0;
+static atomic_size_t cs__inj_len = 0;  // written under cs__pool_mu, peeked without it
+static _Thread_local int cs__worker_id = -1;
+static _Thread_local unsigned cs__steal_seed = 0;
+
+static cs__ring* cs__ring_new(long cap, cs__ring* prev) {
+    cs__ring* r = (cs__ring*)calloc(1, sizeof(cs__ring) + (size_t)cap * sizeof(_Atomic(cs_task*)));
+    if (!r) { fprintf(stderr, "[C-Script] task deque allocation failed\n"); abort(); }
+    r->cap = cap; r->prev = prev;
+    return r;
+}
+
+// Owner only.
+static void cs__deque_push(cs__deque* d, cs_task* t) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&d->top, memory_order_acquire);
+    cs__ring* r = atomic_load_explicit(&d->ring, memory_order_relaxed);
+    if (b - top > r->cap - 1) {
+        cs__ring* g = cs__ring_new(r->cap * 2, r);
+        for (long i = top; i < b; ++i)
+            atomic_store_explicit(&g->buf[i & (g->cap - 1)], atomic_load_explicit(&r->buf[i & (r->cap - 1)], memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&d->ring, g, memory_order_release);
+        r = g;
+    }
+    atomic_store_explicit(&r->buf[b & (r->cap - 1)], t, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+// Owner only.
+static cs_task* cs__deque_take(cs__deque* d) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    cs__ring* r = atomic_load_explicit(&d->ring, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    cs_task* x = NULL;
+    if (t <= b) {
+        x = atomic_load_explicit(&r->buf[b & (r->cap - 1)], memory_order_relaxed);
+        if (t == b) {
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) x = NULL;
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
         }
-        body.push_back(line);
+    } else {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
     }
+    return x;
 }
 
-//============================= enum! parsing + emission =============================
-struct EnumInfo {
-    set<string> members;
-    bool is_flags = false;
-};
+// Any thread.
+static cs_task* cs__deque_steal(cs__deque* d) {
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) return NULL;
+    cs__ring* r = atomic_load_explicit(&d->ring, memory_order_acquire);
+    cs_task* x = atomic_load_explicit(&r->buf[t & (r->cap - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) return NULL;
+    return x;
+}
 
-static string lower_enum_bang_and_collect(const string& in, map<string, EnumInfo>& enums) {
-    using namespace cs_regex_wrap;
+static void cs__inj_push(cs_task* t) {
+    pthread_mutex_lock(&cs__pool_mu);
+    size_t len = atomic_load_explicit(&cs__inj_len, memory_order_relaxed);
+    if (len == cs__inj_cap) {
+        size_t ncap = cs__inj_cap ? cs__inj_cap * 2 : 64;
+        cs_task** nb = (cs_task**)malloc(ncap * sizeof(cs_task*));
+        if (!nb) { fprintf(stderr, "[C-Script] task queue allocation failed\n"); abort(); }
+        for (size_t i = 0; i < len; ++i) nb[i] = cs__inj_buf[(cs__inj_head + i) % cs__inj_cap];
+        free(cs__inj_buf); cs__inj_buf = nb; cs__inj_cap = ncap; cs__inj_head = 0;
+    }
+    cs__inj_buf[(cs__inj_head + len) % cs__inj_cap] = t;
+    atomic_store_explicit(&cs__inj_len, len + 1, memory_order_relaxed);
+    pthread_mutex_unlock(&cs__pool_mu);
+}
 
-    string s = in;
-    // Match standard enum! and enum_flags!
-    std::regex re_standard(R"(enum!\s+([A-Za-z_]\w*)\s*\{([^}]*)\})");
-    std::regex re_flags(R"(enum_flags!\s+([A-Za-z_]\w*)\s*\{([^}]*)\})");
+static cs_task* cs__inj_pop(void) {
+    cs_task* t = NULL;
+    pthread_mutex_lock(&cs__pool_mu);
+    size_t len = atomic_load_explicit(&cs__inj_len, memory_order_relaxed);
+    if (len) {
+        t = cs__inj_buf[cs__inj_head];
+        cs__inj_head = (cs__inj_head + 1) % cs__inj_cap;
+        atomic_store_explicit(&cs__inj_len, len - 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&cs__pool_mu);
+    return t;
+}
 
-    cmatch m;
-    string out;
-    out.reserve(s.size() * 12 / 10);
-    size_t pos = 0;
-
-    auto split_enums = [](string body) -> vector<string> {
-        vector<string> names;
-        string token;
-        auto flush = [&]() {
-            string t = trim(token);
-            if (!t.empty()) {
-                size_t eq = t.find('=');
-                string ident = trim(eq == string::npos ? t : t.substr(0, eq));
-                if (!ident.empty()) names.push_back(ident);
-            }
-            token.clear();
-            };
-        for (char c : body) {
-            if (c == ',') flush();
-            else token.push_back(c);
-        }
-        flush();
-        return names;
-        };
+static cs_task* cs__find_task(void) {
+    cs_task* t = NULL;
+    int self = cs__worker_id;
+    if (self >= 0 && (t = cs__deque_take(&cs__pool_q[self]))) return t;
+    if (atomic_load_explicit(&cs__pool_pending, memory_order_relaxed) <= 0) return NULL;
+    if (atomic_load_explicit(&cs__inj_len, memory_order_relaxed) && (t = cs__inj_pop())) return t;
+    if (!cs__steal_seed) cs__steal_seed = (unsigned)(uintptr_t)&t | 1u;
+    for (int k = 0; k < cs__pool_n; ++k) {
+        cs__steal_seed = cs__steal_seed * 1103515245u + 12345u;
+        int v = (int)((cs__steal_seed >> 8) % (unsigned)cs__pool_n);
+        if (v != self && (t = cs__deque_steal(&cs__pool_q[v]))) return t;
+    }
+    return NULL;
+}
 
-    // Process standard enums
-    while (search_from(s, pos, m, re_standard)) {
-        append_prefix(out, s, pos - (m.length(0) ? m.length(0) : 0), m);
+static void cs__run_task(cs_task* t) {
+    atomic_fetch_sub_explicit(&cs__pool_pending, 1, memory_order_relaxed);
+    t->result = t->fn(t->arg);
+    atomic_store_explicit(&t->done, 1, memory_order_release);
+}
 
-        string name = m[1].str();
-        string body = m[2].str();
-        vector<string> items = split_enums(body);
-        EnumInfo info;
-        info.is_flags = false;
-        for (auto& id : items) info.members.insert(id);
-        enums[name] = info;
+static void* cs__worker_main(void* arg) {
+    cs__worker_id = (int)(intptr_t)arg;
+#ifdef CS__SAMPLE_ON
+    cs_sample_thread_start();
+#endif
+    for (;;) {
+        cs_task* t = NULL;
+        for (int spin = 0; spin < 256 && !(t = cs__find_task()); ++spin) sched_yield();
+        if (t) { cs__run_task(t); continue; }
+        pthread_mutex_lock(&cs__pool_mu);
+        atomic_fetch_add(&cs__pool_sleepers, 1);
+        while (atomic_load(&cs__pool_pending) <= 0) pthread_cond_wait(&cs__pool_cv, &cs__pool_mu);
+        atomic_fetch_sub(&cs__pool_sleepers, 1);
+        pthread_mutex_unlock(&cs__pool_mu);
+    }
+    return NULL;
+}
 
-        // Emit real C typedef enum + validators
-        out += "typedef enum " + name + " { " + body + " } " + name + ";\n";
-        out += "static inline int cs__enum_is_valid_" + name + "(int v){ switch((" + name + ")v){ ";
-        for (auto& e : info.members) out += "case " + e + ": ";
-        out += "return 1; default: return 0; } }\n";
-        out += "static inline void cs__enum_assert_" + name + "(int v){\n"
-            "#if defined(CS_HARDLINE)\n"
-            "  if(!cs__enum_is_valid_" + name + "(v)){\n"
-            "    fprintf(stderr,\"[C-Script hardline] Non-exhaustive switch for enum " + name + " (value %d)\\n\", v);\n"
-            "    abort();\n"
-            "  }\n"
-            "#else\n"
-            "  (void)v;\n"
-            "#endif\n"
-            "}\n";
+static void cs__pool_start(void) {
+    const char* env = getenv("CS_WORKERS");
+    long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > 256) n = 256;
+    cs__pool_n = (int)n;
+    cs__pool_q = (cs__deque*)calloc((size_t)n, sizeof(cs__deque));
+    if (!cs__pool_q) { fprintf(stderr, "[C-Script] task pool allocation failed\n"); abort(); }
+    for (int i = 0; i < cs__pool_n; ++i) atomic_store(&cs__pool_q[i].ring, cs__ring_new(256, NULL));
+    for (int i = 0; i < cs__pool_n; ++i) {
+        pthread_t th;
+        if (pthread_create(&th, NULL, cs__worker_main, (void*)(intptr_t)i) != 0) { fprintf(stderr, "[C-Script] cannot start worker thread\n"); abort(); }
+        pthread_detach(th);
     }
+}
 
-    // Reset position to search for flag enums
-    pos = 0;
-    string s2 = out;
-    out.clear();
-    out.reserve(s2.size() * 12 / 10);
+static void cs__spawn_in(cs_task* t, cs_task_fn fn, void* arg) {
+    pthread_once(&cs__pool_once, cs__pool_start);
+    t->fn = fn; t->arg = arg; t->result = NULL;
+    atomic_init(&t->done, 0);
+    if (cs__worker_id >= 0) cs__deque_push(&cs__pool_q[cs__worker_id], t);
+    else cs__inj_push(t);
+    // seq_cst pair with the sleeper's (sleepers++, pending check) under the lock
+    atomic_fetch_add(&cs__pool_pending, 1);
+    if (atomic_load(&cs__pool_sleepers) > 0) {
+        pthread_mutex_lock(&cs__pool_mu);
+        pthread_cond_signal(&cs__pool_cv);
+        pthread_mutex_unlock(&cs__pool_mu);
+    }
+}
 
-    // Process flag enums (bitfield enums)
-    while (search_from(s2, pos, m, re_flags)) {
-        append_prefix(out, s2, pos - (m.length(0) ? m.length(0) : 0), m);
+static void cs__wait(cs_task* t) {
+    while (!atomic_load_explicit(&t->done, memory_order_acquire)) {
+        cs_task* other = cs__find_task();
+        if (other) cs__run_task(other);
+        else sched_yield();
+    }
+}
 
-        string name = m[1].str();
-        string body = m[2].str();
-        vector<string> items = split_enums(body);
-        EnumInfo info;
-        info.is_flags = true;
-        for (auto& id : items) info.members.insert(id);
-        enums[name] = info;
+static inline cs_task* cs_spawn(cs_task_fn fn, void* arg) {
+    cs_task* t = (cs_task*)malloc(sizeof(cs_task));
+    if (!t) { fprintf(stderr, "[C-Script] spawn: out of memory\n"); abort(); }
+    t->heap = 1;
+    cs__spawn_in(t, fn, arg);
+    return t;
+}
 
-        // Emit flag enum as C typedef with bitwise operations helpers
-        out += "typedef enum " + name + " { " + body + " } " + name + ";\n";
-        out += "static inline " + name + " " + name + "_combine(" + name + " a, " + name + " b) { return (" + name + ")(a | b); }\n";
-        out += "static inline bool " + name + "_has(" + name + " flags, " + name + " flag) { return (flags & flag) == flag; }\n";
+static inline void* cs_join(cs_task* t) {
+    cs__wait(t);
+    void* r = t->result;
+    if (t->heap) free(t);
+    return r;
+}
+
+typedef struct { long lo, hi, grain; cs_range_fn fn; void* ctx; } cs__range;
+
+static void* cs__range_task(void* p) {
+    cs__range* r = (cs__range*)p;
+    if (r->hi - r->lo > r->grain) {
+        long mid = r->lo + (r->hi - r->lo) / 2;
+        cs__range right = { mid, r->hi, r->grain, r->fn, r->ctx };
+        cs__range left = { r->lo, mid, r->grain, r->fn, r->ctx };
+        cs_task t;
+        t.heap = 0;
+        cs__spawn_in(&t, cs__range_task, &right);
+        cs__range_task(&left);
+        cs__wait(&t);
+    } else if (r->lo < r->hi) {
+        r->fn(r->ctx, r->lo, r->hi);
     }
+    return NULL;
+}
 
-    // Append tail
-    out.append(s2, pos, string::npos);
-    return out;
+// Split [lo, hi) into chunks of at most `grain` iterations (0 = auto) and
+// run fn(ctx, chunk_lo, chunk_hi) across the pool; returns when all are done.
+static inline void cs_parallel_for(long lo, long hi, long grain, cs_range_fn fn, void* ctx) {
+    pthread_once(&cs__pool_once, cs__pool_start);
+    if (grain <= 0) { grain = (hi - lo) / ((long)cs__pool_n * 8); if (grain < 1) grain = 1; }
+    cs__range r = { lo, hi, grain, fn, ctx };
+    cs__range_task(&r);
+}
+)CS";
+}
+
+// ---- chan[T] support shared by every monomorphized channel ----
+static string prelude_chan() {
+    return R"CS(
+// ---- Channels (chan[T]) ----
+#include <stdatomic.h>
+#include <sched.h>
+#define CS_CHAN_LINE 64
+#if defined(__x86_64__) || defined(__i386__)
+  #define cs__cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+  #define cs__cpu_relax() __asm__ __volatile__("yield")
+#else
+  #define cs__cpu_relax() do { } while(0)
+#endif
+static inline size_t cs__chan_pow2(size_t n) { size_t c = 2; while (c < n) c <<= 1; return c; }
+static inline void cs__chan_backoff(unsigned* spins) { if (++*spins < 64) cs__cpu_relax(); else sched_yield(); }
+)CS";
+}
+
+// ---- @use arena: bump arenas, size-class pools, scoped CS_MALLOC routing ----
+// Inside an @arena block CS_MALLOC bump-allocates from that arena (per thread,
+// nested blocks stack) and CS_FREE of arena memory is a no-op; everything is
+// released at block exit. Outside any block CS_MALLOC is plain malloc. User
+// overrides of CS_MALLOC/CS_FREE/CS_REALLOC are left alone.
+static string prelude_arena() {
+    return R"CS(
+// ---- Arena + pool allocators ----
+#define CS_ARENA_ALIGN 16
+#define CS_ARENA_MIN_CHUNK 4096
+#define CS__ARENA_ON 1
+typedef struct cs_arena_chunk { struct cs_arena_chunk* next; char* end; char* used; _Alignas(CS_ARENA_ALIGN) char data[]; } cs_arena_chunk;
+typedef struct cs_arena {
+    cs_arena_chunk* head;
+    char* cur; char* end; char* last;   // bump window + most recent block (for in-place realloc)
+    size_t chunk;                        // next chunk size
+    struct cs_arena* prev;               // enclosing arena on this thread
+} cs_arena;
+
+static _Thread_local cs_arena* cs__arena_cur = NULL;
+static void (*cs__arena_release_hook)(cs_arena* a) = NULL;   // set by @memstats
+
+static inline void cs_arena_init(cs_arena* a, size_t chunk) {
+    a->head = NULL; a->cur = a->end = a->last = NULL;
+    a->chunk = chunk < CS_ARENA_MIN_CHUNK ? 64 * 1024 : chunk;
+    a->prev = NULL;
+}
+
+static void* cs__arena_grow(cs_arena* a, size_t n) {
+    size_t need = n + CS_ARENA_ALIGN;
+    size_t sz = a->chunk > need ? a->chunk : need;
+    cs_arena_chunk* c = (cs_arena_chunk*)malloc(sizeof(cs_arena_chunk) + sz);
+    if (!c) return NULL;
+    if (a->head) a->head->used = a->cur;
+    c->next = a->head; c->end = c->data + sz; c->used = c->data; a->head = c;
+    a->cur = c->data; a->end = c->end;
+    if (a->chunk < (size_t)16 * 1024 * 1024) a->chunk *= 2;
+    return c;
+}
+
+// Each block sits behind a CS_ARENA_ALIGN-byte header holding its requested
+// size, so cs_realloc copies exactly the bytes the caller owned.
+#define CS__ARENA_SIZE(p) (((size_t*)(p))[-1])
+#define CS__ARENA_ROUND(n) ((n) ? ((n) + (CS_ARENA_ALIGN - 1)) & ~(size_t)(CS_ARENA_ALIGN - 1) : (size_t)CS_ARENA_ALIGN)
+
+static inline void* cs_arena_alloc(cs_arena* a, size_t n) {
+    size_t rounded = CS__ARENA_ROUND(n);
+    if ((size_t)(a->end - a->cur) < CS_ARENA_ALIGN + rounded && !cs__arena_grow(a, CS_ARENA_ALIGN + rounded)) return NULL;
+    a->last = a->cur + CS_ARENA_ALIGN;
+    a->cur = a->last + rounded;
+    CS__ARENA_SIZE(a->last) = n;
+    return a->last;
+}
+
+static inline int cs_arena_owns(const cs_arena* a, const void* p) {
+    const char* q = (const char*)p;
+    for (const cs_arena_chunk* c = a->head; c; c = c->next)
+        if (q >= c->data && q < c->end) return 1;
+    return 0;
+}
+
+// Calls fn(block, size) for every block still in the arena, newest chunk first.
+static inline void cs__arena_each(cs_arena* a, void (*fn)(void* block, size_t n)) {
+    for (cs_arena_chunk* c = a->head; c; c = c->next) {
+        char* used = c == a->head ? a->cur : c->used;
+        for (char* p = c->data; p < used;) {
+            char* b = p + CS_ARENA_ALIGN;
+            size_t n = CS__ARENA_SIZE(b);
+            fn(b, n);
+            p = b + CS__ARENA_ROUND(n);
+        }
+    }
+}
+
+static inline void cs_arena_release(cs_arena* a) {
+    if (cs__arena_release_hook) cs__arena_release_hook(a);
+    cs_arena_chunk* c = a->head;
+    while (c) { cs_arena_chunk* n = c->next; free(c); c = n; }
+    a->head = NULL; a->cur = a->end = a->last = NULL;
+}
+
+static inline void cs_arena_push(cs_arena* a) { a->prev = cs__arena_cur; cs__arena_cur = a; }
+static inline void cs_arena_pop(cs_arena* a) { cs__arena_cur = a->prev; }
+
+static inline cs_arena* cs__arena_owner(const void* p) {
+    for (cs_arena* a = cs__arena_cur; a; a = a->prev) if (cs_arena_owns(a, p)) return a;
+    return NULL;
+}
+
+static inline void* cs_alloc(size_t n) {
+    cs_arena* a = cs__arena_cur;
+    return a ? cs_arena_alloc(a, n) : malloc(n);
+}
+
+static inline void cs_free(void* p) {
+    if (!p) return;
+    if (cs__arena_cur && cs__arena_owner(p)) return;   // released with its arena
+    free(p);
+}
+
+static inline void* cs_realloc(void* p, size_t n) {
+    if (!p) return cs_alloc(n);
+    cs_arena* a = cs__arena_cur ? cs__arena_owner(p) : NULL;
+    if (!a) return realloc(p, n);
+    size_t rounded = CS__ARENA_ROUND(n);
+    if ((char*)p == a->last && (size_t)(a->end - a->last) >= rounded) { a->cur = a->last + rounded; CS__ARENA_SIZE(p) = n; return p; }
+    size_t old = CS__ARENA_SIZE(p);
+    void* q = cs_arena_alloc(a, n);
+    if (q) memcpy(q, p, n < old ? n : old);
+    return q;
+}
+
+// Size-class pool: 16..2048-byte classes carved from 64 KiB slabs, sized free,
+// single-threaded (keep one per thread). Larger requests go to malloc.
+#define CS_POOL_CLASSES 8
+#define CS_POOL_SLAB (64 * 1024)
+typedef struct cs_pool_slab { struct cs_pool_slab* next; } cs_pool_slab;
+typedef struct cs_pool { void* free_list[CS_POOL_CLASSES]; cs_pool_slab* slabs; } cs_pool;
+
+static inline void cs_pool_init(cs_pool* p) { memset(p, 0, sizeof *p); }
+
+static inline int cs__pool_class(size_t n) {
+    int k = 0; size_t sz = 16;
+    while (sz < n) { sz <<= 1; ++k; }
+    return k;
+}
+
+static inline void* cs_pool_alloc(cs_pool* p, size_t n) {
+    if (n > ((size_t)16 << (CS_POOL_CLASSES - 1))) return malloc(n);
+    int k = cs__pool_class(n);
+    void* b = p->free_list[k];
+    if (b) { p->free_list[k] = *(void**)b; return b; }
+    size_t sz = (size_t)16 << k;
+    cs_pool_slab* slab = (cs_pool_slab*)malloc(CS_POOL_SLAB);
+    if (!slab) return NULL;
+    slab->next = p->slabs; p->slabs = slab;
+    char* base = (char*)slab + CS_ARENA_ALIGN;
+    size_t count = (CS_POOL_SLAB - CS_ARENA_ALIGN) / sz;
+    for (size_t i = 1; i + 1 < count; ++i) *(void**)(base + i * sz) = base + (i + 1) * sz;
+    *(void**)(base + (count - 1) * sz) = NULL;
+    p->free_list[k] = count > 1 ? base + sz : NULL;
+    return base;
+}
+
+static inline void cs_pool_free(cs_pool* p, void* b, size_t n) {
+    if (!b) return;
+    if (n > ((size_t)16 << (CS_POOL_CLASSES - 1))) { free(b); return; }
+    int k = cs__pool_class(n);
+    *(void**)b = p->free_list[k];
+    p->free_list[k] = b;
+}
+
+static inline void cs_pool_release(cs_pool* p) {
+    cs_pool_slab* s = p->slabs;
+    while (s) { cs_pool_slab* n = s->next; free(s); s = n; }
+    memset(p, 0, sizeof *p);
+}
+
+#ifdef CS__MALLOC_DEFAULT
+  #undef CS_MALLOC
+  #undef CS_FREE
+  #undef CS_REALLOC
+  #define CS_MALLOC  cs_alloc
+  #define CS_FREE    cs_free
+  #define CS_REALLOC cs_realloc
+#endif
+)CS";
+}
+
+// ---- @memstats on: counting wrappers around CS_MALLOC/CS_FREE/CS_REALLOC ----
+// Wraps whatever the macros resolve to at this point (malloc, the arena
+// router or a user override), so it composes with @arena. Each block carries
+// a 16-byte header with its size and call site; totals, per-site counts and a
+// log2 size histogram are dumped at exit like the profiler table.
+static string prelude_memstats() {
+    return R"CS(
+// ---- Allocation statistics (@memstats) ----
+#include <stdatomic.h>
+static inline void* cs__ms_raw_malloc(size_t n) { return CS_MALLOC(n); }
+static inline void cs__ms_raw_free(void* p) { CS_FREE(p); }
+static inline void* cs__ms_raw_realloc(void* p, size_t n) { return CS_REALLOC(p, n); }
+
+#define CS_MS_MAGIC 0xC5A110C5u
+#define CS_MS_SITES 4096
+typedef struct { size_t size; unsigned site; unsigned magic; } cs__ms_hdr;
+typedef struct {
+    const char* file; int line;
+    unsigned long long allocs, frees, reallocs, bytes, live_blocks, live_bytes;
+} cs__ms_site;
+
+static cs__ms_site cs__ms_sites[CS_MS_SITES];
+static unsigned long long cs__ms_hist[64];
+static unsigned long long cs__ms_allocs = 0, cs__ms_frees = 0, cs__ms_live = 0, cs__ms_peak = 0, cs__ms_live_blocks = 0;
+static atomic_flag cs__ms_lock = ATOMIC_FLAG_INIT;
+
+static inline void cs__ms_acquire(void) { while (atomic_flag_test_and_set_explicit(&cs__ms_lock, memory_order_acquire)) { } }
+static inline void cs__ms_release(void) { atomic_flag_clear_explicit(&cs__ms_lock, memory_order_release); }
+
+// Open-addressed on (file pointer, line); slot 0 collects overflow.
+static unsigned cs__ms_site_of(const char* file, int line) {
+    uintptr_t h = ((uintptr_t)file >> 3) * 31u + (uintptr_t)(unsigned)line;
+    for (unsigned probe = 0; probe < CS_MS_SITES; ++probe) {
+        unsigned i = 1u + (unsigned)((h + probe) % (CS_MS_SITES - 1));
+        cs__ms_site* s = &cs__ms_sites[i];
+        if (s->file == file && s->line == line) return i;
+        if (!s->file) { s->file = file; s->line = line; return i; }
+    }
+    cs__ms_sites[0].file = "<other>";
+    return 0;
+}
+
+static inline unsigned cs__ms_bucket(size_t n) { unsigned b = 0; while (n > 1) { n >>= 1; ++b; } return b; }
+
+static void cs__ms_note_alloc(cs__ms_hdr* h, size_t n, const char* file, int line, int is_realloc) {
+    cs__ms_site* s = &cs__ms_sites[cs__ms_site_of(file, line)];
+    h->size = n; h->site = (unsigned)(s - cs__ms_sites); h->magic = CS_MS_MAGIC;
+    if (is_realloc) s->reallocs++; else { s->allocs++; cs__ms_allocs++; }
+    s->bytes += n; s->live_blocks++; s->live_bytes += n;
+    cs__ms_hist[cs__ms_bucket(n)]++;
+    cs__ms_live += n; cs__ms_live_blocks++;
+    if (cs__ms_live > cs__ms_peak) cs__ms_peak = cs__ms_live;
+}
+
+static void cs__ms_note_free(cs__ms_hdr* h, int is_realloc) {
+    cs__ms_site* s = &cs__ms_sites[h->site];
+    if (!is_realloc) { s->frees++; cs__ms_frees++; }
+    s->live_blocks--; s->live_bytes -= h->size;
+    cs__ms_live -= h->size; cs__ms_live_blocks--;
+}
+
+static inline void* cs__ms_malloc(size_t n, const char* file, int line) {
+    cs__ms_hdr* h = (cs__ms_hdr*)cs__ms_raw_malloc(sizeof(cs__ms_hdr) + n);
+    if (!h) return NULL;
+    cs__ms_acquire(); cs__ms_note_alloc(h, n, file, line, 0); cs__ms_release();
+    return h + 1;
+}
+
+static inline void cs__ms_free(void* p, const char* file, int line) {
+    if (!p) return;
+    cs__ms_hdr* h = (cs__ms_hdr*)p - 1;
+    if (h->magic != CS_MS_MAGIC) {
+        fprintf(stderr, "[C-Script memstats] %s:%d: CS_FREE of a block not from CS_MALLOC\n", file, line);
+        abort();
+    }
+    cs__ms_acquire(); cs__ms_note_free(h, 0); cs__ms_release();
+    h->magic = 0;
+    cs__ms_raw_free(h);
+}
+
+static inline void* cs__ms_realloc(void* p, size_t n, const char* file, int line) {
+    if (!p) return cs__ms_malloc(n, file, line);
+    cs__ms_hdr* h = (cs__ms_hdr*)p - 1;
+    cs__ms_hdr old = *h;
+#ifdef CS__ARENA_ON
+    int in_arena = cs__arena_cur && cs__arena_owner(h);
+#endif
+    cs__ms_hdr* nh = (cs__ms_hdr*)cs__ms_raw_realloc(h, sizeof(cs__ms_hdr) + n);
+    if (!nh) return NULL;
+#ifdef CS__ARENA_ON
+    if (in_arena && nh != h) h->magic = 0;   // the old copy stays in the arena until release
+#endif
+    cs__ms_acquire();
+    cs__ms_note_free(&old, 1);
+    cs__ms_note_alloc(nh, n, file, line, 1);
+    cs__ms_release();
+    return nh + 1;
+}
+
+#ifdef CS__ARENA_ON
+// Arena blocks are never passed to CS_FREE; count them freed when their arena is released.
+static void cs__ms_arena_block(void* b, size_t n) {
+    cs__ms_hdr* h = (cs__ms_hdr*)b;
+    if (n < sizeof(cs__ms_hdr) || h->magic != CS_MS_MAGIC || n != sizeof(cs__ms_hdr) + h->size) return;
+    cs__ms_acquire(); cs__ms_note_free(h, 0); cs__ms_release();
+    h->magic = 0;
+}
+static void cs__ms_arena_release(cs_arena* a) { cs__arena_each(a, cs__ms_arena_block); }
+#endif
+
+static int cs__ms_cmp(const void* a, const void* b) {
+    const cs__ms_site* x = *(const cs__ms_site* const*)a;
+    const cs__ms_site* y = *(const cs__ms_site* const*)b;
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+static void cs__ms_flush(void) {
+    const char* path = getenv("CS_MEMSTATS_OUT");
+    FILE* f = path ? fopen(path, "wb") : NULL;
+    if (!f) f = stderr;
+    static const cs__ms_site* order[CS_MS_SITES];
+    size_t n = 0;
+    for (size_t i = 0; i < CS_MS_SITES; ++i) if (cs__ms_sites[i].file) order[n++] = &cs__ms_sites[i];
+    qsort(order, n, sizeof order[0], cs__ms_cmp);
+
+    fprintf(f, "[C-Script memstats] allocs=%llu frees=%llu peak=%llu B live=%llu B in %llu blocks\n",
+        cs__ms_allocs, cs__ms_frees, cs__ms_peak, cs__ms_live, cs__ms_live_blocks);
+    fprintf(f, "%-32s %10s %10s %10s %14s %10s %12s\n", "site", "allocs", "frees", "reallocs", "bytes", "live", "live_bytes");
+    for (size_t i = 0; i < n; ++i) {
+        const cs__ms_site* s = order[i];
+        char where[256];
+        snprintf(where, sizeof where, "%s:%d", s->file, s->line);
+        fprintf(f, "%-32s %10llu %10llu %10llu %14llu %10llu %12llu\n", where, s->allocs, s->frees, s->reallocs, s->bytes, s->live_blocks, s->live_bytes);
+    }
+    fprintf(f, "size histogram:\n");
+    for (unsigned b = 0; b < 64; ++b)
+        if (cs__ms_hist[b]) fprintf(f, "  [%llu, %llu) %llu\n", 1ULL << b, b < 63 ? 1ULL << (b + 1) : ~0ULL, cs__ms_hist[b]);
+    if (cs__ms_live_blocks) {
+        fprintf(f, "leaks (still live at exit):\n");
+        for (size_t i = 0; i < n; ++i)
+            if (order[i]->live_blocks) fprintf(f, "  %s:%d %llu blocks, %llu B\n", order[i]->file, order[i]->line, order[i]->live_blocks, order[i]->live_bytes);
+    }
+    if (f != stderr) fclose(f);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((constructor))
+#endif
+static void cs__ms_ctor(void) {
+#ifdef CS__ARENA_ON
+    cs__arena_release_hook = cs__ms_arena_release;
+#endif
+    atexit(cs__ms_flush);
+}
+
+#undef CS_MALLOC
+#undef CS_FREE
+#undef CS_REALLOC
+#define CS_MALLOC(n)     cs__ms_malloc((n), __FILE__, __LINE__)
+#define CS_FREE(p)       cs__ms_free((p), __FILE__, __LINE__)
+#define CS_REALLOC(p, n) cs__ms_realloc((p), (n), __FILE__, __LINE__)
+)CS";
+}
+
+// ---- @sample on: in-process sampling profiler ----
+// ITIMER_PROF delivers SIGPROF to whichever thread is burning CPU; the handler
+// walks the frame-pointer chain from the interrupted context and pushes the
+// stack into that thread's SPSC ring. A background thread folds the rings into
+// a stack table; at exit the table is symbolized from the executable's own
+// .symtab and written as collapsed stacks ("root;...;leaf count"), which both
+// flamegraph tools and --profile-use read. Full stacks need the thread's stack
+// bounds: main and pool workers register themselves, other threads get their
+// leaf frame only until they call cs_sample_thread_start(). Linux x86-64 and
+// AArch64; elsewhere the module compiles but records nothing.
+static string prelude_sample() {
+    return R"CS(
+// ---- Sampling profiler (@sample on) ----
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+  #include <elf.h>
+  #include <fcntl.h>
+  #include <link.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <ucontext.h>
+#endif
+#define CS__SAMPLE_ON 1
+
+#ifndef CS_SAMPLE_THREADS
+  #define CS_SAMPLE_THREADS 64
+#endif
+#ifndef CS_SAMPLE_DEPTH
+  #define CS_SAMPLE_DEPTH 32
+#endif
+#define CS_SAMPLE_RING 512   /* per thread, power of two; drained every 10ms */
+
+/* ra: return address at the top of the stack (x86-64) or in LR (AArch64),
+   i.e. the caller of a leaf that set up no frame; 0 when it isn't code. */
+typedef struct { unsigned n; uintptr_t ra; uintptr_t pc[CS_SAMPLE_DEPTH]; } cs__smp;
+typedef struct {
+    atomic_uint head; char _pad0[64 - sizeof(atomic_uint)];   /* written by the thread's handler */
+    atomic_uint tail; char _pad1[64 - sizeof(atomic_uint)];   /* written by the drainer */
+    cs__smp buf[CS_SAMPLE_RING];
+} cs__smp_ring;
+
+static cs__smp_ring cs__smp_rings[CS_SAMPLE_THREADS];
+static atomic_uint cs__smp_nrings;
+static atomic_ullong cs__smp_dropped;
+static atomic_int cs__smp_stop;
+static pthread_t cs__smp_thread;
+static int cs__smp_running = 0;
+static _Thread_local cs__smp_ring* cs__smp_mine;
+static _Thread_local int cs__smp_full;
+static _Thread_local uintptr_t cs__smp_hi;   /* top of this thread's stack; 0 = unknown */
+static uintptr_t cs__smp_text_lo, cs__smp_text_hi;   /* the executable's code, set once by the ctor */
+
+/* Slots are never returned; threads past CS_SAMPLE_THREADS go unsampled. */
+static cs__smp_ring* cs__smp_claim(void) {
+    if (cs__smp_mine || cs__smp_full) return cs__smp_mine;
+    unsigned i = atomic_fetch_add_explicit(&cs__smp_nrings, 1, memory_order_relaxed);
+    if (i >= CS_SAMPLE_THREADS) { cs__smp_full = 1; return NULL; }
+    return cs__smp_mine = &cs__smp_rings[i];
+}
+
+static unsigned cs__smp_unwind(const void* ctx, uintptr_t* pc, uintptr_t* ra) {
+    uintptr_t ip, fp, sp, lr;
+    uintptr_t hi = cs__smp_hi;
+#if defined(__linux__) && defined(__x86_64__)
+    const ucontext_t* uc = (const ucontext_t*)ctx;
+    ip = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+    fp = (uintptr_t)uc->uc_mcontext.gregs[REG_RBP];
+    sp = (uintptr_t)uc->uc_mcontext.gregs[REG_RSP];
+    lr = hi && sp < hi && (sp & (sizeof(uintptr_t) - 1)) == 0 ? *(const uintptr_t*)sp : 0;
+#elif defined(__linux__) && defined(__aarch64__)
+    const ucontext_t* uc = (const ucontext_t*)ctx;
+    ip = (uintptr_t)uc->uc_mcontext.pc;
+    fp = (uintptr_t)uc->uc_mcontext.regs[29];
+    sp = (uintptr_t)uc->uc_mcontext.sp;
+    lr = (uintptr_t)uc->uc_mcontext.regs[30];
+#else
+    (void)ctx; (void)pc; (void)ra; (void)ip; (void)fp; (void)sp; (void)lr; (void)hi;
+    return 0;
+#endif
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+    unsigned n = 0;
+    pc[n++] = ip;
+    /* A frameless leaf leaves fp at its caller's record, so the walk below
+       skips the caller; keep the candidate and decide at symbolization. */
+    *ra = lr >= cs__smp_text_lo && lr < cs__smp_text_hi ? lr : 0;
+    /* Each frame record is {caller fp, return address}; only follow it while
+       it stays inside this thread's stack and keeps moving towards the top. */
+    while (n < CS_SAMPLE_DEPTH && hi && fp >= sp && fp <= hi - 2 * sizeof(uintptr_t) &&
+           (fp & (sizeof(uintptr_t) - 1)) == 0) {
+        const uintptr_t* rec = (const uintptr_t*)fp;
+        if (!rec[1]) break;
+        pc[n++] = rec[1];
+        if (rec[0] <= fp) break;
+        fp = rec[0];
+    }
+    return n;
+#endif
+}
+
+static void cs__smp_handler(int sig, siginfo_t* si, void* ctx) {
+    (void)sig; (void)si;
+    int saved = errno;
+    cs__smp_ring* r = cs__smp_claim();
+    if (r) {
+        unsigned h = atomic_load_explicit(&r->head, memory_order_relaxed);
+        unsigned t = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (h - t >= CS_SAMPLE_RING) atomic_fetch_add_explicit(&cs__smp_dropped, 1, memory_order_relaxed);
+        else {
+            cs__smp* s = &r->buf[h & (CS_SAMPLE_RING - 1)];
+            s->n = cs__smp_unwind(ctx, s->pc, &s->ra);
+            if (s->n) atomic_store_explicit(&r->head, h + 1, memory_order_release);
+        }
+    }
+    errno = saved;
+}
+
+/* Record the calling thread's stack bounds so samples get full stacks. */
+static void cs_sample_thread_start(void) {
+    sigset_t m, old;
+    sigemptyset(&m); sigaddset(&m, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &m, &old);
+#if defined(__linux__)
+    pthread_attr_t a; void* base; size_t size;
+    if (pthread_getattr_np(pthread_self(), &a) == 0) {
+        if (pthread_attr_getstack(&a, &base, &size) == 0) cs__smp_hi = (uintptr_t)base + size;
+        pthread_attr_destroy(&a);
+    }
+#endif
+    cs__smp_claim();
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// ---- Folded stack table (drainer thread, then the exit flush) ----
+typedef struct { unsigned long long count; unsigned n; uintptr_t ra; uintptr_t pc[CS_SAMPLE_DEPTH]; } cs__smp_stack;
+static cs__smp_stack* cs__smp_tab = NULL;
+static size_t cs__smp_cap = 0, cs__smp_len = 0;
+
+static size_t cs__smp_hash(const uintptr_t* pc, unsigned n, uintptr_t ra) {
+    uint64_t h = 1469598103934665603ull ^ (uint64_t)ra;
+    for (unsigned i = 0; i < n; ++i) { h ^= (uint64_t)pc[i]; h *= 1099511628211ull; }
+    return (size_t)(h ^ (h >> 29));
+}
+
+static cs__smp_stack* cs__smp_slot(cs__smp_stack* tab, size_t cap, const uintptr_t* pc, unsigned n, uintptr_t ra) {
+    for (size_t i = cs__smp_hash(pc, n, ra) & (cap - 1);; i = (i + 1) & (cap - 1)) {
+        cs__smp_stack* e = &tab[i];
+        if (!e->count || (e->n == n && e->ra == ra && memcmp(e->pc, pc, n * sizeof(uintptr_t)) == 0)) return e;
+    }
+}
+
+static void cs__smp_add(const cs__smp* s) {
+    if (2 * (cs__smp_len + 1) > cs__smp_cap) {
+        size_t cap = cs__smp_cap ? 2 * cs__smp_cap : 1024;
+        cs__smp_stack* tab = (cs__smp_stack*)calloc(cap, sizeof(cs__smp_stack));
+        if (!tab) { atomic_fetch_add_explicit(&cs__smp_dropped, 1, memory_order_relaxed); return; }
+        for (size_t i = 0; i < cs__smp_cap; ++i)
+            if (cs__smp_tab[i].count) *cs__smp_slot(tab, cap, cs__smp_tab[i].pc, cs__smp_tab[i].n, cs__smp_tab[i].ra) = cs__smp_tab[i];
+        free(cs__smp_tab);
+        cs__smp_tab = tab; cs__smp_cap = cap;
+    }
+    cs__smp_stack* e = cs__smp_slot(cs__smp_tab, cs__smp_cap, s->pc, s->n, s->ra);
+    if (!e->count) { e->n = s->n; e->ra = s->ra; memcpy(e->pc, s->pc, s->n * sizeof(uintptr_t)); cs__smp_len++; }
+    e->count++;
+}
+
+static void cs__smp_drain(void) {
+    unsigned nr = atomic_load_explicit(&cs__smp_nrings, memory_order_acquire);
+    if (nr > CS_SAMPLE_THREADS) nr = CS_SAMPLE_THREADS;
+    for (unsigned k = 0; k < nr; ++k) {
+        cs__smp_ring* r = &cs__smp_rings[k];
+        unsigned t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        unsigned h = atomic_load_explicit(&r->head, memory_order_acquire);
+        for (; t != h; ++t) cs__smp_add(&r->buf[t & (CS_SAMPLE_RING - 1)]);
+        atomic_store_explicit(&r->tail, t, memory_order_release);
+    }
+}
+
+static void* cs__smp_drainer(void* arg) {
+    (void)arg;
+    struct timespec ts = { 0, 10 * 1000 * 1000L };
+    while (!atomic_load_explicit(&cs__smp_stop, memory_order_acquire)) {
+        nanosleep(&ts, NULL);
+        cs__smp_drain();
+    }
+    return NULL;
+}
+
+// ---- Symbolization from the executable's .symtab ----
+typedef struct { uintptr_t lo, hi; const char* name; } cs__smp_sym;
+static cs__smp_sym* cs__smp_syms = NULL;
+static size_t cs__smp_nsyms = 0;
+
+static int cs__smp_sym_cmp(const void* a, const void* b) {
+    uintptr_t x = ((const cs__smp_sym*)a)->lo, y = ((const cs__smp_sym*)b)->lo;
+    return x < y ? -1 : x > y;
+}
+
+#if defined(__linux__)
+static int cs__smp_base_cb(struct dl_phdr_info* info, size_t size, void* out) {
+    (void)size;
+    *(uintptr_t*)out = (uintptr_t)info->dlpi_addr;   /* first entry is the executable */
+    return 1;
+}
+
+static int cs__smp_text_cb(struct dl_phdr_info* info, size_t size, void* out) {
+    (void)size; (void)out;
+    for (unsigned i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr)* ph = &info->dlpi_phdr[i];
+        if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_X)) continue;
+        uintptr_t lo = (uintptr_t)info->dlpi_addr + (uintptr_t)ph->p_vaddr, hi = lo + (uintptr_t)ph->p_memsz;
+        if (!cs__smp_text_hi || lo < cs__smp_text_lo) cs__smp_text_lo = lo;
+        if (hi > cs__smp_text_hi) cs__smp_text_hi = hi;
+    }
+    return 1;
+}
+#endif
+
+static void cs__smp_load_syms(void) {
+#if defined(__linux__)
+    int fd = open("/proc/self/exe", O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ElfW(Ehdr))) { close(fd); return; }
+    const unsigned char* img = (const unsigned char*)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (img == (const unsigned char*)MAP_FAILED) return;   /* the mapping stays until exit: names point into it */
+    const ElfW(Ehdr)* eh = (const ElfW(Ehdr)*)img;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_shoff + (size_t)eh->e_shnum * sizeof(ElfW(Shdr)) > (size_t)st.st_size) return;
+    const ElfW(Shdr)* sh = (const ElfW(Shdr)*)(img + eh->e_shoff);
+    uintptr_t bias = 0;
+    dl_iterate_phdr(cs__smp_base_cb, &bias);
+    for (unsigned i = 0; i < eh->e_shnum; ++i) {
+        if (sh[i].sh_type != SHT_SYMTAB || !sh[i].sh_entsize || sh[i].sh_link >= eh->e_shnum) continue;
+        const ElfW(Sym)* sym = (const ElfW(Sym)*)(img + sh[i].sh_offset);
+        const char* str = (const char*)(img + sh[sh[i].sh_link].sh_offset);
+        size_t n = sh[i].sh_size / sh[i].sh_entsize;
+        cs__smp_syms = (cs__smp_sym*)calloc(n ? n : 1, sizeof(cs__smp_sym));
+        if (!cs__smp_syms) return;
+        for (size_t k = 0; k < n; ++k) {
+            if (ELF64_ST_TYPE(sym[k].st_info) != STT_FUNC || !sym[k].st_value) continue;
+            cs__smp_sym* d = &cs__smp_syms[cs__smp_nsyms++];
+            d->lo = bias + (uintptr_t)sym[k].st_value;
+            d->hi = d->lo + (sym[k].st_size ? (uintptr_t)sym[k].st_size : 1);
+            d->name = str + sym[k].st_name;
+        }
+        break;
+    }
+    qsort(cs__smp_syms, cs__smp_nsyms, sizeof(cs__smp_sym), cs__smp_sym_cmp);
+#endif
+}
+
+static const char* cs__smp_name(uintptr_t pc) {
+    size_t lo = 0, hi = cs__smp_nsyms;
+    while (lo < hi) { size_t mid = (lo + hi) / 2; if (cs__smp_syms[mid].lo <= pc) lo = mid + 1; else hi = mid; }
+    if (lo && pc < cs__smp_syms[lo - 1].hi) return cs__smp_syms[lo - 1].name;
+    return "[unknown]";
+}
+
+typedef struct { char* line; unsigned long long count; } cs__smp_out;
+static int cs__smp_out_cmp(const void* a, const void* b) {
+    return strcmp(((const cs__smp_out*)a)->line, ((const cs__smp_out*)b)->line);
+}
+
+// Stacks that only differ in pcs inside the same functions merge into one line.
+// A line starts at main (or, on other threads, at the first symbolized frame),
+// not at the libc start-up frames above it. The top-of-stack return address is
+// the leaf's caller when it names a function the frame walk didn't already
+// put directly above the leaf.
+static void cs__smp_flush(void) {
+    struct itimerval off;
+    memset(&off, 0, sizeof off);
+    setitimer(ITIMER_PROF, &off, NULL);
+    if (cs__smp_running) {
+        atomic_store_explicit(&cs__smp_stop, 1, memory_order_release);
+        pthread_join(cs__smp_thread, NULL);
+        cs__smp_running = 0;
+    }
+    cs__smp_drain();
+    cs__smp_load_syms();
+
+    cs__smp_out* rows = (cs__smp_out*)calloc(cs__smp_len ? cs__smp_len : 1, sizeof(cs__smp_out));
+    size_t nrows = 0;
+    for (size_t i = 0; rows && i < cs__smp_cap; ++i) {
+        const cs__smp_stack* e = &cs__smp_tab[i];
+        if (!e->count) continue;
+        const char* names[CS_SAMPLE_DEPTH + 1];
+        unsigned cnt = 0;
+        /* return addresses point past the call; look up the call itself */
+        for (unsigned k = 0; k < e->n; ++k) {
+            names[cnt++] = cs__smp_name(k ? e->pc[k] - 1 : e->pc[k]);
+            if (k == 0 && e->ra) {
+                const char* caller = cs__smp_name(e->ra - 1);
+                if (strcmp(caller, "[unknown]") != 0 && strcmp(caller, names[0]) != 0 &&
+                    (e->n < 2 || strcmp(caller, cs__smp_name(e->pc[1] - 1)) != 0))
+                    names[cnt++] = caller;
+            }
+        }
+        unsigned top = cnt;
+        while (top > 0 && strcmp(names[top - 1], "main") != 0) --top;
+        if (!top) { top = cnt; while (top > 1 && strcmp(names[top - 1], "[unknown]") == 0) --top; }
+        size_t len = 0, cap = 256;
+        char* s = (char*)malloc(cap);
+        if (!s) break;
+        for (unsigned k = top; k-- > 0;) {
+            const char* nm = names[k];
+            size_t w = strlen(nm);
+            if (len + w + 2 > cap) { while (len + w + 2 > cap) cap *= 2; char* g = (char*)realloc(s, cap); if (!g) break; s = g; }
+            if (len) s[len++] = ';';
+            memcpy(s + len, nm, w); len += w;
+        }
+        s[len] = 0;
+        rows[nrows].line = s; rows[nrows].count = e->count; nrows++;
+    }
+    if (rows) qsort(rows, nrows, sizeof(cs__smp_out), cs__smp_out_cmp);
+
+    const char* path = getenv("CS_SAMPLE_OUT");
+    FILE* f = fopen(path && *path ? path : "cs_sample.folded", "wb");
+    for (size_t i = 0; i < nrows; ++i) {
+        unsigned long long c = rows[i].count;
+        while (i + 1 < nrows && strcmp(rows[i].line, rows[i + 1].line) == 0) c += rows[++i].count;
+        if (f) fprintf(f, "%s %llu\n", rows[i].line, c);
+    }
+    if (f) fclose(f);
+    for (size_t i = 0; i < nrows; ++i) free(rows[i].line);
+    free(rows);
+
+    unsigned long long dropped = atomic_load(&cs__smp_dropped);
+    if (dropped) fprintf(stderr, "[C-Script sample] %llu samples dropped (ring full)\n", dropped);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((constructor))
+#endif
+static void cs__smp_ctor(void) {
+    const char* env = getenv("CS_SAMPLE_HZ");
+    long hz = env ? atol(env) : 997;   /* off the 1kHz grid so periodic work isn't aliased */
+    if (hz <= 0) return;
+    if (hz > 100000) hz = 100000;
+
+#if defined(__linux__)
+    dl_iterate_phdr(cs__smp_text_cb, NULL);
+#endif
+    cs_sample_thread_start();
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_sigaction = cs__smp_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) != 0) return;
+
+    /* the drainer is created with SIGPROF blocked so it never samples itself */
+    sigset_t m, old;
+    sigemptyset(&m); sigaddset(&m, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &m, &old);
+    cs__smp_running = pthread_create(&cs__smp_thread, NULL, cs__smp_drainer, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    atexit(cs__smp_flush);
+    struct itimerval it;
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = (suseconds_t)(1000000L / hz > 0 ? 1000000L / hz : 1);
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_PROF, &it, NULL);
+}
+)CS";
+}
+
+// ---- cscriptc bench: benchmark harness ----
+// Runs every registered bench block: a warmup, then the iteration count is
+// grown until one timed batch takes CS_BENCH_TIME_MS / CS_BENCH_SAMPLES, then
+// CS_BENCH_SAMPLES batches are timed. Reports median and MAD (median absolute
+// deviation) of ns per iteration as JSON on stdout. Times come from the TSC
+// (lfence-fenced, calibrated against CLOCK_MONOTONIC) where it is invariant,
+// else from clock_gettime; CS_BENCH_CLOCK=monotonic forces the latter.
+// With --counters (or CS_BENCH_COUNTERS=1) the timed batches also run inside
+// perf_event_open groups and each bench reports cycles, instructions, IPC and
+// branch/cache misses per iteration. Where the PMU isn't reachable (containers,
+// VMs, perf_event_paranoid, other OSes) that is noted once and timing goes on.
+static string prelude_bench() {
+    return R"CS(
+// ---- Benchmark harness (cscriptc bench) ----
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+  #include <cpuid.h>
+  #include <x86intrin.h>
+#endif
+#if defined(__linux__)
+  #include <errno.h>
+  #include <linux/perf_event.h>
+  #include <sys/ioctl.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+#endif
+
+typedef void (*cs_bench_fn)(uint64_t iters);
+typedef struct { const char* name; cs_bench_fn fn; const char* file; int line; } cs__bench_ent;
+
+#define CS_BENCH_MAX 256
+static cs__bench_ent cs__bench_tab[CS_BENCH_MAX];
+static int cs__bench_n = 0;
+
+static void cs_bench_register(const char* name, cs_bench_fn fn, const char* file, int line) {
+    if (cs__bench_n == CS_BENCH_MAX) { fprintf(stderr, "[C-Script bench] more than %d benches\n", CS_BENCH_MAX); abort(); }
+    cs__bench_tab[cs__bench_n++] = (cs__bench_ent){ name, fn, file, line };
+}
+#define CS_BENCH_REGISTER(name) \
+    __attribute__((constructor)) static void cs__bench_reg_##name(void) { cs_bench_register(#name, cs__bench_##name, __FILE__, __LINE__); }
+
+static int cs__bench_tsc = 0;
+static double cs__bench_ns_per_tick = 1.0;
+
+static inline uint64_t cs__bench_mono(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t cs__bench_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (cs__bench_tsc) { _mm_lfence(); uint64_t t = __rdtsc(); _mm_lfence(); return t; }
+#endif
+    return cs__bench_mono();
+}
+
+static void cs__bench_clock_init(void) {
+    const char* env = getenv("CS_BENCH_CLOCK");
+    if (env && strcmp(env, "monotonic") == 0) return;
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned a, b, c, d;
+    if (!__get_cpuid(0x80000007u, &a, &b, &c, &d) || !(d & (1u << 8))) return;   /* invariant TSC */
+    uint64_t m0 = cs__bench_mono(), t0 = __rdtsc(), m1;
+    do m1 = cs__bench_mono(); while (m1 - m0 < 20000000u);
+    uint64_t t1 = __rdtsc();
+    if (t1 <= t0) return;
+    cs__bench_ns_per_tick = (double)(m1 - m0) / (double)(t1 - t0);
+    cs__bench_tsc = 1;
+#endif
+}
+
+// ---- Hardware counters ----
+// Two groups, so each fits the PMU at once on common cores: {cycles,
+// instructions, branches, branch-misses} and {cache-references, cache-misses}.
+// A group whose leader can't be opened is left out; members that fail are
+// skipped. Counts are scaled by enabled/running time if the kernel multiplexed.
+enum { CS_PMC_CYCLES, CS_PMC_INSTR, CS_PMC_BRANCHES, CS_PMC_BR_MISS, CS_PMC_CACHE_REF, CS_PMC_CACHE_MISS, CS_PMC_N };
+static const char* const cs__pmc_names[CS_PMC_N] = {
+    "cycles", "instructions", "branches", "branch_misses", "cache_references", "cache_misses" };
+
+typedef struct {
+    int on;
+    int leader[2];
+    int group[CS_PMC_N], slot[CS_PMC_N];   /* slot -1: not counting */
+    double sum[CS_PMC_N];
+    char why[128];
+} cs__pmc;
+
+#if defined(__linux__)
+static int cs__pmc_open(uint64_t config, int group_fd) {
+    struct perf_event_attr a;
+    memset(&a, 0, sizeof a);
+    a.size = sizeof a;
+    a.type = PERF_TYPE_HARDWARE;
+    a.config = config;
+    a.disabled = group_fd < 0;
+    a.exclude_kernel = 1;
+    a.exclude_hv = 1;
+    a.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &a, 0, -1, group_fd, 0);
+}
+#endif
+
+static void cs__pmc_init(cs__pmc* p) {
+    memset(p, 0, sizeof *p);
+    p->leader[0] = p->leader[1] = -1;
+    for (int i = 0; i < CS_PMC_N; ++i) p->slot[i] = -1;
+#if defined(__linux__)
+    static const uint64_t cfg[CS_PMC_N] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+                                            PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES };
+    static const int first[2] = { CS_PMC_CYCLES, CS_PMC_CACHE_REF }, last[2] = { CS_PMC_BR_MISS, CS_PMC_CACHE_MISS };
+    int err = 0;
+    for (int g = 0; g < 2; ++g) {
+        int n = 0;
+        for (int i = first[g]; i <= last[g]; ++i) {
+            int fd = cs__pmc_open(cfg[i], p->leader[g]);
+            if (fd < 0) { if (!err) err = errno; if (i == first[g]) break; continue; }
+            if (p->leader[g] < 0) p->leader[g] = fd;
+            p->group[i] = g; p->slot[i] = n++;
+        }
+        if (p->leader[g] >= 0) p->on = 1;
+    }
+    if (!p->on) snprintf(p->why, sizeof p->why, "perf_event_open: %s", strerror(err));
+#else
+    snprintf(p->why, sizeof p->why, "hardware counters need Linux perf_event_open");
+#endif
+}
+
+static void cs__pmc_ctl(const cs__pmc* p, int start) {
+#if defined(__linux__)
+    for (int g = 0; g < 2; ++g) {
+        if (p->leader[g] < 0) continue;
+        if (start) ioctl(p->leader[g], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(p->leader[g], start ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+#else
+    (void)p; (void)start;
+#endif
+}
+
+static void cs__pmc_accumulate(cs__pmc* p) {
+#if defined(__linux__)
+    for (int g = 0; g < 2; ++g) {
+        uint64_t buf[3 + CS_PMC_N];   /* nr, time_enabled, time_running, values[nr] */
+        if (p->leader[g] < 0 || read(p->leader[g], buf, sizeof buf) < (ssize_t)(3 * sizeof(uint64_t)) || !buf[2]) continue;
+        double scale = (double)buf[1] / (double)buf[2];
+        for (int i = 0; i < CS_PMC_N; ++i)
+            if (p->slot[i] >= 0 && p->group[i] == g && (uint64_t)p->slot[i] < buf[0]) p->sum[i] += (double)buf[3 + p->slot[i]] * scale;
+    }
+#else
+    (void)p;
+#endif
+}
+
+static double cs__bench_batch_ns(cs_bench_fn fn, uint64_t iters, cs__pmc* pmc) {
+    if (pmc) cs__pmc_ctl(pmc, 1);
+    uint64_t t0 = cs__bench_ticks();
+    fn(iters);
+    uint64_t t1 = cs__bench_ticks();
+    if (pmc) { cs__pmc_ctl(pmc, 0); cs__pmc_accumulate(pmc); }
+    return (double)(t1 - t0) * cs__bench_ns_per_tick;
+}
+
+static int cs__bench_dbl_cmp(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double cs__bench_median(double* v, int n) {
+    qsort(v, (size_t)n, sizeof(double), cs__bench_dbl_cmp);
+    return n % 2 ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]);
+}
+
+static long cs__bench_env(const char* key, long dflt, long lo, long hi) {
+    const char* v = getenv(key);
+    long n = v ? atol(v) : dflt;
+    return n < lo ? lo : n > hi ? hi : n;
+}
+
+static void cs__bench_json_str(const char* s) {
+    putchar('"');
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20) printf("\\u%04x", (unsigned)(unsigned char)*s);
+        else putchar(*s);
+    }
+    putchar('"');
+}
+
+typedef struct { double median, mad, min, max, mean; uint64_t iters; int samples; double pmc[CS_PMC_N]; } cs__bench_result;
+
+static cs__bench_result cs__bench_measure(const cs__bench_ent* b, cs__pmc* pmc) {
+    int samples = (int)cs__bench_env("CS_BENCH_SAMPLES", 30, 5, 1000);
+    double target = (double)cs__bench_env("CS_BENCH_TIME_MS", 300, 1, 600000) * 1e6 / samples;
+    double warmup = (double)cs__bench_env("CS_BENCH_WARMUP_MS", 50, 0, 60000) * 1e6;
+
+    /* Warmup doubles as calibration: grow the batch until it hits the target. */
+    uint64_t iters = 1;
+    double spent = 0;
+    for (;;) {
+        double ns = cs__bench_batch_ns(b->fn, iters, NULL);
+        spent += ns;
+        if (ns >= target && spent >= warmup) break;
+        if (ns >= target) continue;
+        double grow = ns > 0 ? 1.2 * target / ns : 10.0;
+        if (grow > 10.0) grow = 10.0;
+        if (grow < 1.5) grow = 1.5;
+        if ((double)iters * grow > 1e12) break;
+        iters = (uint64_t)((double)iters * grow);
+    }
+
+    cs__bench_result r;
+    double* per = (double*)malloc((size_t)samples * sizeof(double));
+    if (!per) { fprintf(stderr, "[C-Script bench] out of memory\n"); abort(); }
+    r.min = 1e300; r.max = 0; r.mean = 0;
+    if (pmc) memset(pmc->sum, 0, sizeof pmc->sum);
+    for (int i = 0; i < samples; ++i) {
+        per[i] = cs__bench_batch_ns(b->fn, iters, pmc) / (double)iters;
+        if (per[i] < r.min) r.min = per[i];
+        if (per[i] > r.max) r.max = per[i];
+        r.mean += per[i] / samples;
+    }
+    r.median = cs__bench_median(per, samples);
+    for (int i = 0; i < samples; ++i) per[i] = per[i] > r.median ? per[i] - r.median : r.median - per[i];
+    r.mad = cs__bench_median(per, samples);
+    r.iters = iters; r.samples = samples;
+    for (int i = 0; i < CS_PMC_N; ++i)
+        r.pmc[i] = pmc && pmc->slot[i] >= 0 ? pmc->sum[i] / ((double)iters * samples) : -1.0;
+    free(per);
+    return r;
+}
+
+/* Per-iteration counts plus derived ratios; counters that didn't open are left out. */
+static void cs__bench_print_pmc(const cs__bench_result* r) {
+    const double* c = r->pmc;
+    printf(", \"counters\": {");
+    const char* sep = "";
+    for (int i = 0; i < CS_PMC_N; ++i)
+        if (c[i] >= 0) { printf("%s\"%s\": %.4f", sep, cs__pmc_names[i], c[i]); sep = ", "; }
+    if (c[CS_PMC_CYCLES] > 0 && c[CS_PMC_INSTR] >= 0) printf(", \"ipc\": %.4f", c[CS_PMC_INSTR] / c[CS_PMC_CYCLES]);
+    if (c[CS_PMC_BRANCHES] > 0 && c[CS_PMC_BR_MISS] >= 0) printf(", \"branch_miss_rate\": %.6f", c[CS_PMC_BR_MISS] / c[CS_PMC_BRANCHES]);
+    if (c[CS_PMC_CACHE_REF] > 0 && c[CS_PMC_CACHE_MISS] >= 0) printf(", \"cache_miss_rate\": %.6f", c[CS_PMC_CACHE_MISS] / c[CS_PMC_CACHE_REF]);
+    printf("}");
+
+    fprintf(stderr, "%-24s", "");
+    if (c[CS_PMC_CYCLES] > 0 && c[CS_PMC_INSTR] >= 0) fprintf(stderr, " IPC %.2f (%.1f cyc/iter)", c[CS_PMC_INSTR] / c[CS_PMC_CYCLES], c[CS_PMC_CYCLES]);
+    if (c[CS_PMC_BR_MISS] >= 0) fprintf(stderr, "  br-miss %.3f/iter", c[CS_PMC_BR_MISS]);
+    if (c[CS_PMC_BRANCHES] > 0 && c[CS_PMC_BR_MISS] >= 0) fprintf(stderr, " (%.2f%%)", 100.0 * c[CS_PMC_BR_MISS] / c[CS_PMC_BRANCHES]);
+    if (c[CS_PMC_CACHE_MISS] >= 0) fprintf(stderr, "  cache-miss %.3f/iter", c[CS_PMC_CACHE_MISS]);
+    if (c[CS_PMC_CACHE_REF] > 0 && c[CS_PMC_CACHE_MISS] >= 0) fprintf(stderr, " (%.2f%%)", 100.0 * c[CS_PMC_CACHE_MISS] / c[CS_PMC_CACHE_REF]);
+    fprintf(stderr, "\n");
+}
+
+static int cs__bench_line_cmp(const void* a, const void* b) {
+    return ((const cs__bench_ent*)a)->line - ((const cs__bench_ent*)b)->line;
+}
+
+/* Entry point of a `cscriptc bench` build; --filter runs benches whose name
+   contains the text, --counters adds hardware counters. */
+static int cs_bench_main(int argc, char** argv) {
+    const char* filter = NULL;
+    const char* env = getenv("CS_BENCH_COUNTERS");
+    int counters = env && *env && strcmp(env, "0") != 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) filter = argv[++i];
+        else if (strcmp(argv[i], "--counters") == 0) counters = 1;
+    }
+    cs__bench_clock_init();
+    qsort(cs__bench_tab, (size_t)cs__bench_n, sizeof(cs__bench_ent), cs__bench_line_cmp);
+
+    cs__pmc pmc;
+    if (counters) {
+        cs__pmc_init(&pmc);
+        if (!pmc.on) fprintf(stderr, "[C-Script bench] no hardware counters (%s); timing only\n", pmc.why);
+    }
+
+    printf("{\"clock\": \"%s\", ", cs__bench_tsc ? "tsc" : "monotonic");
+    if (counters && !pmc.on) {
+        printf("\"counters\": ");
+        cs__bench_json_str(pmc.why);
+        printf(", ");
+    }
+    printf("\"benchmarks\": [");
+    int first = 1;
+    for (int i = 0; i < cs__bench_n; ++i) {
+        const cs__bench_ent* b = &cs__bench_tab[i];
+        if (filter && !strstr(b->name, filter)) continue;
+        cs__bench_result r = cs__bench_measure(b, counters && pmc.on ? &pmc : NULL);
+        fprintf(stderr, "%-24s %12.3f ns/iter  (MAD %.3f, %d x %llu)\n", b->name, r.median, r.mad, r.samples, (unsigned long long)r.iters);
+        printf("%s\n  {\"name\": ", first ? "" : ",");
+        cs__bench_json_str(b->name);
+        printf(", \"file\": ");
+        cs__bench_json_str(b->file);
+        printf(", \"line\": %d, \"iterations\": %llu, \"samples\": %d, \"median_ns\": %.4f, \"mad_ns\": %.4f, "
+               "\"min_ns\": %.4f, \"max_ns\": %.4f, \"mean_ns\": %.4f",
+               b->line, (unsigned long long)r.iters, r.samples, r.median, r.mad, r.min, r.max, r.mean);
+        if (counters && pmc.on) cs__bench_print_pmc(&r);
+        printf("}");
+        first = 0;
+    }
+    printf("\n]}\n");
+    return 0;
+}
+)CS";
+}
+
+// ---- --trace-lib / @trace on: function tracing to a Chrome trace ----
+// CS_TRACE_SCOPE("name") stamps the entry time into a scope variable whose
+// cleanup handler stamps the exit and pushes one complete ("X") event into the
+// thread's SPSC ring, so every return path is covered and an event is never
+// half-recorded. Stamps are raw TSC/counter ticks; a writer thread calibrates
+// them against CLOCK_MONOTONIC once, drains the rings every 2ms and streams the
+// events to CS_TRACE_OUT (default cs_trace.json) for chrome://tracing or
+// Perfetto. A full ring drops the event and counts it. GCC/Clang only; with
+// other compilers the scope is a no-op.
+static string prelude_trace() {
+    return R"CS(
+// ---- Function tracing (--trace-lib / @trace) ----
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+#endif
+#ifndef CS_TRACE_LIB
+  #define CS_TRACE_LIB 1
+#endif
+
+#ifndef CS_TRACE_RING
+  #define CS_TRACE_RING 32768   /* events per thread, power of two */
+#endif
+
+typedef struct { uint64_t t0, t1; const char* name; } cs__trace_ev;
+typedef struct cs__trace_ring {
+    atomic_uint head; char _pad0[64 - sizeof(atomic_uint)];   /* written by the owning thread */
+    atomic_uint tail; char _pad1[64 - sizeof(atomic_uint)];   /* written by the writer thread */
+    struct cs__trace_ring* next;
+    unsigned tid;
+    atomic_ullong dropped;   /* owner-written, no RMW on the hot path */
+    cs__trace_ev ev[CS_TRACE_RING];
+} cs__trace_ring;
+
+static _Atomic(cs__trace_ring*) cs__trace_rings = NULL;
+static atomic_uint cs__trace_ntids;
+static atomic_int cs__trace_stop;
+static _Thread_local cs__trace_ring* cs__trace_mine;
+static _Thread_local int cs__trace_nomem;
+
+static inline uint64_t cs__trace_mono(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t cs__trace_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t t;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+#else
+    return cs__trace_mono();
+#endif
+}
+
+/* Slow path: first event on this thread. Rings live until exit. */
+static cs__trace_ring* cs__trace_ring_new(void) {
+    cs__trace_ring* r = (cs__trace_ring*)calloc(1, sizeof(cs__trace_ring));
+    if (!r) { cs__trace_nomem = 1; return NULL; }
+    r->tid = atomic_fetch_add_explicit(&cs__trace_ntids, 1, memory_order_relaxed) + 1;
+    cs__trace_ring* h = atomic_load_explicit(&cs__trace_rings, memory_order_relaxed);
+    do r->next = h; while (!atomic_compare_exchange_weak_explicit(&cs__trace_rings, &h, r, memory_order_release, memory_order_relaxed));
+    return cs__trace_mine = r;
+}
+
+typedef struct { uint64_t t0; const char* name; } cs__trace_scope;
+
+static inline cs__trace_scope cs__trace_enter(const char* name) {
+    cs__trace_scope s = { cs__trace_now(), name };
+    return s;
+}
+
+static inline void cs__trace_leave(cs__trace_scope* s) {
+    uint64_t t1 = cs__trace_now();
+    cs__trace_ring* r = cs__trace_mine;
+    if (__builtin_expect(!r, 0) && (cs__trace_nomem || !(r = cs__trace_ring_new()))) return;
+    unsigned h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (__builtin_expect(h - atomic_load_explicit(&r->tail, memory_order_acquire) >= CS_TRACE_RING, 0)) {
+        atomic_store_explicit(&r->dropped, atomic_load_explicit(&r->dropped, memory_order_relaxed) + 1, memory_order_relaxed);
+        return;
+    }
+    cs__trace_ev* e = &r->ev[h & (CS_TRACE_RING - 1)];
+    e->t0 = s->t0; e->t1 = t1; e->name = s->name;
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+  #define CS_TRACE_SCOPE(name) \
+      cs__trace_scope CS_CONCAT(cs__trace_, __LINE__) __attribute__((cleanup(cs__trace_leave))) = cs__trace_enter(name)
+#else
+  #define CS_TRACE_SCOPE(name) ((void)0)
+#endif
+
+// ---- Writer thread ----
+static FILE* cs__trace_f = NULL;
+static pthread_t cs__trace_thread;
+static int cs__trace_running = 0;
+static uint64_t cs__trace_tick0, cs__trace_mono0;
+static double cs__trace_ns_per_tick = 0;
+static int cs__trace_first = 1;
+
+static void cs__trace_calibrate(void) {
+    uint64_t t = cs__trace_now(), m = cs__trace_mono();
+    if (t > cs__trace_tick0 && m > cs__trace_mono0) cs__trace_ns_per_tick = (double)(m - cs__trace_mono0) / (double)(t - cs__trace_tick0);
+    else cs__trace_ns_per_tick = 1.0;
+}
+
+static unsigned cs__trace_drain(void) {
+    unsigned n = 0;
+    if (!cs__trace_f) return 0;
+    if (cs__trace_ns_per_tick == 0) cs__trace_calibrate();
+    for (cs__trace_ring* r = atomic_load_explicit(&cs__trace_rings, memory_order_acquire); r; r = r->next) {
+        unsigned t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        unsigned h = atomic_load_explicit(&r->head, memory_order_acquire);
+        for (; t != h; ++t, ++n) {
+            const cs__trace_ev* e = &r->ev[t & (CS_TRACE_RING - 1)];
+            double ts = (double)(int64_t)(e->t0 - cs__trace_tick0) * cs__trace_ns_per_tick / 1000.0;
+            double dur = (double)(e->t1 - e->t0) * cs__trace_ns_per_tick / 1000.0;
+            fprintf(cs__trace_f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+                    cs__trace_first ? "" : ",", e->name, ts, dur, (int)getpid(), r->tid);
+            cs__trace_first = 0;
+        }
+        atomic_store_explicit(&r->tail, t, memory_order_release);
+    }
+    return n;
+}
+
+static void* cs__trace_writer(void* arg) {
+    (void)arg;
+    struct timespec cal = { 0, 10 * 1000 * 1000L }, ts = { 0, 2 * 1000 * 1000L };
+    nanosleep(&cal, NULL);
+    cs__trace_calibrate();   /* once, over the first 10ms */
+    while (!atomic_load_explicit(&cs__trace_stop, memory_order_acquire))
+        if (cs__trace_drain() < CS_TRACE_RING / 4) nanosleep(&ts, NULL);   /* keep going while busy */
+    return NULL;
+}
+
+static void cs__trace_flush(void) {
+    if (cs__trace_running) {
+        atomic_store_explicit(&cs__trace_stop, 1, memory_order_release);
+        pthread_join(cs__trace_thread, NULL);
+        cs__trace_running = 0;
+    }
+    cs__trace_drain();
+    if (cs__trace_f) {
+        fprintf(cs__trace_f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+        fclose(cs__trace_f);
+        cs__trace_f = NULL;
+    }
+    unsigned long long dropped = 0;
+    for (cs__trace_ring* r = atomic_load(&cs__trace_rings); r; r = r->next) dropped += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+    if (dropped) fprintf(stderr, "[C-Script trace] %llu events dropped (ring full; raise CS_TRACE_RING or trace fewer functions)\n", dropped);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((constructor))
+#endif
+static void cs__trace_ctor(void) {
+    const char* path = getenv("CS_TRACE_OUT");
+    cs__trace_f = fopen(path && *path ? path : "cs_trace.json", "wb");
+    if (!cs__trace_f) { fprintf(stderr, "[C-Script trace] cannot open trace file\n"); return; }
+    fprintf(cs__trace_f, "{\"traceEvents\":[");
+    cs__trace_tick0 = cs__trace_now();
+    cs__trace_mono0 = cs__trace_mono();
+    cs__trace_running = pthread_create(&cs__trace_thread, NULL, cs__trace_writer, NULL) == 0;
+    atexit(cs__trace_flush);
+}
+)CS";
+}
+
+// ---- @use simd: vector kernels with one-time ISA dispatch ----
+// Every kernel has a scalar body plus SSE2/AVX2/AVX-512 bodies on x86 (built
+// with target attributes, picked at startup from cpuid) or a NEON body on
+// AArch64. Callers go through a table of function pointers filled in once by a
+// constructor; CS_SIMD=scalar|sse2|avx2|avx512 caps the tier for testing.
+// Float reductions reassociate, so results may differ from a serial loop in the
+// last bits; NaN handling in min/max follows the hardware instruction.
+static string prelude_simd() {
+    return R"CS(
+// ---- SIMD kernels (@use simd) ----
+#include <math.h>
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+  #define CS_SIMD_X86 1
+  #include <immintrin.h>
+  #define CS__TGT(t) __attribute__((target(t)))
+#elif defined(__aarch64__)
+  #define CS_SIMD_NEON 1
+  #include <arm_neon.h>
+#endif
+
+#define CS__ADD(a, b) ((a) + (b))
+#define CS__MIN(a, b) ((b) < (a) ? (b) : (a))
+#define CS__MAX(a, b) ((b) > (a) ? (b) : (a))
+
+// Reduction skeleton shared by every ISA: two independent accumulators over
+// 2*W elements per step, then the lanes and the tail are folded in scalar.
+#define CS__RED_FN(TGT, name, T, VT, W, SPLAT, LOAD, STORE, VOP, SOP, INIT) \
+    TGT static T name(const T* p, size_t n) {                                 \
+        VT a0 = SPLAT(INIT), a1 = SPLAT(INIT); size_t i = 0;                  \
+        for (; i + 2 * (W) <= n; i += 2 * (W)) {                              \
+            a0 = VOP(a0, LOAD(p + i)); a1 = VOP(a1, LOAD(p + i + (W)));       \
+        }                                                                     \
+        a0 = VOP(a0, a1);                                                     \
+        T lanes[W]; STORE(lanes, a0);                                         \
+        T r = (INIT);                                                         \
+        for (size_t k = 0; k < (W); ++k) r = SOP(r, lanes[k]);                \
+        for (; i < n; ++i) r = SOP(r, p[i]);                                  \
+        return r;                                                             \
+    }
+
+// -- scalar --
+static float cs__sum_f32_scalar(const float* p, size_t n) { float r = 0.0f; for (size_t i = 0; i < n; ++i) r += p[i]; return r; }
+static float cs__min_f32_scalar(const float* p, size_t n) { float r = INFINITY; for (size_t i = 0; i < n; ++i) r = CS__MIN(r, p[i]); return r; }
+static float cs__max_f32_scalar(const float* p, size_t n) { float r = -INFINITY; for (size_t i = 0; i < n; ++i) r = CS__MAX(r, p[i]); return r; }
+static float cs__dot_f32_scalar(const float* a, const float* b, size_t n) { float r = 0.0f; for (size_t i = 0; i < n; ++i) r += a[i] * b[i]; return r; }
+static int64_t cs__sum_i32_scalar(const int32_t* p, size_t n) { int64_t r = 0; for (size_t i = 0; i < n; ++i) r += p[i]; return r; }
+static int32_t cs__min_i32_scalar(const int32_t* p, size_t n) { int32_t r = INT32_MAX; for (size_t i = 0; i < n; ++i) r = CS__MIN(r, p[i]); return r; }
+static int32_t cs__max_i32_scalar(const int32_t* p, size_t n) { int32_t r = INT32_MIN; for (size_t i = 0; i < n; ++i) r = CS__MAX(r, p[i]); return r; }
+static size_t cs__find_byte_scalar(const void* p, size_t n, int c) {
+    const unsigned char* s = (const unsigned char*)p;
+    for (size_t i = 0; i < n; ++i) if (s[i] == (unsigned char)c) return i;
+    return n;
+}
+static size_t cs__prefix_len_scalar(const void* a, const void* b, size_t n) {
+    const unsigned char* x = (const unsigned char*)a; const unsigned char* y = (const unsigned char*)b;
+    size_t i = 0; while (i < n && x[i] == y[i]) ++i;
+    return i;
+}
+static inline char cs__fold_char(char c, char lo) { return (char)((unsigned char)(c - lo) < 26u ? c ^ 0x20 : c); }
+static void cs__ascii_lower_scalar(char* d, const char* s, size_t n) { for (size_t i = 0; i < n; ++i) d[i] = cs__fold_char(s[i], 'A'); }
+static void cs__ascii_upper_scalar(char* d, const char* s, size_t n) { for (size_t i = 0; i < n; ++i) d[i] = cs__fold_char(s[i], 'a'); }
+
+#ifdef CS_SIMD_X86
+// -- SSE2 --
+#define CS__LD_PS(p) _mm_loadu_ps(p)
+#define CS__ST_PS(p, v) _mm_storeu_ps((p), (v))
+#define CS__LD_I128(p) _mm_loadu_si128((const __m128i*)(const void*)(p))
+#define CS__ST_I128(p, v) _mm_storeu_si128((__m128i*)(void*)(p), (v))
+CS__TGT("sse2") static inline __m128i cs__min_epi32_sse2(__m128i a, __m128i b) { __m128i m = _mm_cmpgt_epi32(a, b); return _mm_or_si128(_mm_and_si128(m, b), _mm_andnot_si128(m, a)); }
+CS__TGT("sse2") static inline __m128i cs__max_epi32_sse2(__m128i a, __m128i b) { __m128i m = _mm_cmpgt_epi32(a, b); return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b)); }
+CS__RED_FN(CS__TGT("sse2"), cs__sum_f32_sse2, float, __m128, 4, _mm_set1_ps, CS__LD_PS, CS__ST_PS, _mm_add_ps, CS__ADD, 0.0f)
+CS__RED_FN(CS__TGT("sse2"), cs__min_f32_sse2, float, __m128, 4, _mm_set1_ps, CS__LD_PS, CS__ST_PS, _mm_min_ps, CS__MIN, INFINITY)
+CS__RED_FN(CS__TGT("sse2"), cs__max_f32_sse2, float, __m128, 4, _mm_set1_ps, CS__LD_PS, CS__ST_PS, _mm_max_ps, CS__MAX, -INFINITY)
+CS__RED_FN(CS__TGT("sse2"), cs__min_i32_sse2, int32_t, __m128i, 4, _mm_set1_epi32, CS__LD_I128, CS__ST_I128, cs__min_epi32_sse2, CS__MIN, INT32_MAX)
+CS__RED_FN(CS__TGT("sse2"), cs__max_i32_sse2, int32_t, __m128i, 4, _mm_set1_epi32, CS__LD_I128, CS__ST_I128, cs__max_epi32_sse2, CS__MAX, INT32_MIN)
+CS__TGT("sse2") static float cs__dot_f32_sse2(const float* a, const float* b, size_t n) {
+    __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps(); size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float l[4]; _mm_storeu_ps(l, _mm_add_ps(a0, a1));
+    float r = (l[0] + l[1]) + (l[2] + l[3]);
+    for (; i < n; ++i) r += a[i] * b[i];
+    return r;
+}
+CS__TGT("sse2") static int64_t cs__sum_i32_sse2(const int32_t* p, size_t n) {
+    __m128i acc = _mm_setzero_si128(), z = _mm_setzero_si128(); size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = CS__LD_I128(p + i), sg = _mm_cmpgt_epi32(z, x);
+        acc = _mm_add_epi64(acc, _mm_add_epi64(_mm_unpacklo_epi32(x, sg), _mm_unpackhi_epi32(x, sg)));
+    }
+    int64_t l[2]; CS__ST_I128(l, acc);
+    int64_t r = l[0] + l[1];
+    for (; i < n; ++i) r += p[i];
+    return r;
+}
+CS__TGT("sse2") static size_t cs__find_byte_sse2(const void* p, size_t n, int c) {
+    const unsigned char* s = (const unsigned char*)p; __m128i k = _mm_set1_epi8((char)c); size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(CS__LD_I128(s + i), k));
+        if (m) return i + (size_t)__builtin_ctz(m);
+    }
+    for (; i < n; ++i) if (s[i] == (unsigned char)c) return i;
+    return n;
+}
+CS__TGT("sse2") static size_t cs__prefix_len_sse2(const void* a, const void* b, size_t n) {
+    const unsigned char* x = (const unsigned char*)a; const unsigned char* y = (const unsigned char*)b; size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        unsigned m = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(CS__LD_I128(x + i), CS__LD_I128(y + i))) & 0xFFFFu;
+        if (m) return i + (size_t)__builtin_ctz(m);
+    }
+    while (i < n && x[i] == y[i]) ++i;
+    return i;
+}
+CS__TGT("sse2") static void cs__ascii_fold_sse2(char* d, const char* s, size_t n, char lo) {
+    __m128i below = _mm_set1_epi8((char)(lo - 1)), above = _mm_set1_epi8((char)(lo + 26)), bit = _mm_set1_epi8(0x20); size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = CS__LD_I128(s + i);
+        __m128i in = _mm_and_si128(_mm_cmpgt_epi8(x, below), _mm_cmpgt_epi8(above, x));
+        CS__ST_I128(d + i, _mm_xor_si128(x, _mm_and_si128(in, bit)));
+    }
+    for (; i < n; ++i) d[i] = cs__fold_char(s[i], lo);
+}
+CS__TGT("sse2") static void cs__ascii_lower_sse2(char* d, const char* s, size_t n) { cs__ascii_fold_sse2(d, s, n, 'A'); }
+CS__TGT("sse2") static void cs__ascii_upper_sse2(char* d, const char* s, size_t n) { cs__ascii_fold_sse2(d, s, n, 'a'); }
+
+// -- AVX2 (+FMA) --
+#define CS__LD_I256(p) _mm256_loadu_si256((const __m256i*)(const void*)(p))
+#define CS__ST_I256(p, v) _mm256_storeu_si256((__m256i*)(void*)(p), (v))
+CS__RED_FN(CS__TGT("avx2,fma"), cs__sum_f32_avx2, float, __m256, 8, _mm256_set1_ps, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_add_ps, CS__ADD, 0.0f)
+CS__RED_FN(CS__TGT("avx2,fma"), cs__min_f32_avx2, float, __m256, 8, _mm256_set1_ps, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_min_ps, CS__MIN, INFINITY)
+CS__RED_FN(CS__TGT("avx2,fma"), cs__max_f32_avx2, float, __m256, 8, _mm256_set1_ps, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_max_ps, CS__MAX, -INFINITY)
+CS__RED_FN(CS__TGT("avx2,fma"), cs__min_i32_avx2, int32_t, __m256i, 8, _mm256_set1_epi32, CS__LD_I256, CS__ST_I256, _mm256_min_epi32, CS__MIN, INT32_MAX)
+CS__RED_FN(CS__TGT("avx2,fma"), cs__max_i32_avx2, int32_t, __m256i, 8, _mm256_set1_epi32, CS__LD_I256, CS__ST_I256, _mm256_max_epi32, CS__MAX, INT32_MIN)
+CS__TGT("avx2,fma") static float cs__dot_f32_avx2(const float* a, const float* b, size_t n) {
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(); size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        a0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), a0);
+        a1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), a1);
+    }
+    float l[8]; _mm256_storeu_ps(l, _mm256_add_ps(a0, a1));
+    float r = ((l[0] + l[1]) + (l[2] + l[3])) + ((l[4] + l[5]) + (l[6] + l[7]));
+    for (; i < n; ++i) r += a[i] * b[i];
+    return r;
+}
+CS__TGT("avx2,fma") static int64_t cs__sum_i32_avx2(const int32_t* p, size_t n) {
+    __m256i a0 = _mm256_setzero_si256(), a1 = _mm256_setzero_si256(); size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        a0 = _mm256_add_epi64(a0, _mm256_cvtepi32_epi64(CS__LD_I128(p + i)));
+        a1 = _mm256_add_epi64(a1, _mm256_cvtepi32_epi64(CS__LD_I128(p + i + 4)));
+    }
+    int64_t l[4]; CS__ST_I256(l, _mm256_add_epi64(a0, a1));
+    int64_t r = (l[0] + l[1]) + (l[2] + l[3]);
+    for (; i < n; ++i) r += p[i];
+    return r;
+}
+CS__TGT("avx2,fma") static size_t cs__find_byte_avx2(const void* p, size_t n, int c) {
+    const unsigned char* s = (const unsigned char*)p; __m256i k = _mm256_set1_epi8((char)c); size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(CS__LD_I256(s + i), k));
+        if (m) return i + (size_t)__builtin_ctz(m);
+    }
+    return i + cs__find_byte_sse2(s + i, n - i, c);
+}
+CS__TGT("avx2,fma") static size_t cs__prefix_len_avx2(const void* a, const void* b, size_t n) {
+    const unsigned char* x = (const unsigned char*)a; const unsigned char* y = (const unsigned char*)b; size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        unsigned m = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(CS__LD_I256(x + i), CS__LD_I256(y + i)));
+        if (m) return i + (size_t)__builtin_ctz(m);
+    }
+    return i + cs__prefix_len_sse2(x + i, y + i, n - i);
+}
+CS__TGT("avx2,fma") static void cs__ascii_fold_avx2(char* d, const char* s, size_t n, char lo) {
+    __m256i below = _mm256_set1_epi8((char)(lo - 1)), above = _mm256_set1_epi8((char)(lo + 26)), bit = _mm256_set1_epi8(0x20); size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = CS__LD_I256(s + i);
+        __m256i in = _mm256_and_si256(_mm256_cmpgt_epi8(x, below), _mm256_cmpgt_epi8(above, x));
+        CS__ST_I256(d + i, _mm256_xor_si256(x, _mm256_and_si256(in, bit)));
+    }
+    cs__ascii_fold_sse2(d + i, s + i, n - i, lo);
+}
+CS__TGT("avx2,fma") static void cs__ascii_lower_avx2(char* d, const char* s, size_t n) { cs__ascii_fold_avx2(d, s, n, 'A'); }
+CS__TGT("avx2,fma") static void cs__ascii_upper_avx2(char* d, const char* s, size_t n) { cs__ascii_fold_avx2(d, s, n, 'a'); }
+
+// -- AVX-512 (F + BW) --
+#define CS__LD_I512(p) _mm512_loadu_si512((const void*)(p))
+#define CS__ST_I512(p, v) _mm512_storeu_si512((void*)(p), (v))
+CS__RED_FN(CS__TGT("avx512f,avx512bw"), cs__sum_f32_avx512, float, __m512, 16, _mm512_set1_ps, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_add_ps, CS__ADD, 0.0f)
+CS__RED_FN(CS__TGT("avx512f,avx512bw"), cs__min_f32_avx512, float, __m512, 16, _mm512_set1_ps, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_min_ps, CS__MIN, INFINITY)
+CS__RED_FN(CS__TGT("avx512f,avx512bw"), cs__max_f32_avx512, float, __m512, 16, _mm512_set1_ps, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_max_ps, CS__MAX, -INFINITY)
+CS__RED_FN(CS__TGT("avx512f,avx512bw"), cs__min_i32_avx512, int32_t, __m512i, 16, _mm512_set1_epi32, CS__LD_I512, CS__ST_I512, _mm512_min_epi32, CS__MIN, INT32_MAX)
+CS__RED_FN(CS__TGT("avx512f,avx512bw"), cs__max_i32_avx512, int32_t, __m512i, 16, _mm512_set1_epi32, CS__LD_I512, CS__ST_I512, _mm512_max_epi32, CS__MAX, INT32_MIN)
+CS__TGT("avx512f,avx512bw") static float cs__dot_f32_avx512(const float* a, const float* b, size_t n) {
+    __m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps(); size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        a0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), a0);
+        a1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), a1);
+    }
+    for (; i + 16 <= n; i += 16) a0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), a0);
+    float r = _mm512_reduce_add_ps(_mm512_add_ps(a0, a1));
+    for (; i < n; ++i) r += a[i] * b[i];
+    return r;
+}
+CS__TGT("avx512f,avx512bw") static int64_t cs__sum_i32_avx512(const int32_t* p, size_t n) {
+    __m512i a0 = _mm512_setzero_si512(), a1 = _mm512_setzero_si512(); size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        a0 = _mm512_add_epi64(a0, _mm512_cvtepi32_epi64(_mm256_loadu_si256((const __m256i*)(const void*)(p + i))));
+        a1 = _mm512_add_epi64(a1, _mm512_cvtepi32_epi64(_mm256_loadu_si256((const __m256i*)(const void*)(p + i + 8))));
+    }
+    int64_t r = (int64_t)_mm512_reduce_add_epi64(_mm512_add_epi64(a0, a1));
+    for (; i < n; ++i) r += p[i];
+    return r;
+}
+CS__TGT("avx512f,avx512bw") static size_t cs__find_byte_avx512(const void* p, size_t n, int c) {
+    const unsigned char* s = (const unsigned char*)p; __m512i k = _mm512_set1_epi8((char)c); size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        unsigned long long m = _mm512_cmpeq_epi8_mask(CS__LD_I512(s + i), k);
+        if (m) return i + (size_t)__builtin_ctzll(m);
+    }
+    if (i < n) {   // masked tail: one load, no scalar loop
+        __mmask64 live = ~0ULL >> (64 - (n - i));
+        unsigned long long m = _mm512_mask_cmpeq_epi8_mask(live, _mm512_maskz_loadu_epi8(live, s + i), k);
+        if (m) return i + (size_t)__builtin_ctzll(m);
+    }
+    return n;
+}
+CS__TGT("avx512f,avx512bw") static size_t cs__prefix_len_avx512(const void* a, const void* b, size_t n) {
+    const unsigned char* x = (const unsigned char*)a; const unsigned char* y = (const unsigned char*)b; size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        unsigned long long m = _mm512_cmpneq_epi8_mask(CS__LD_I512(x + i), CS__LD_I512(y + i));
+        if (m) return i + (size_t)__builtin_ctzll(m);
+    }
+    return i + cs__prefix_len_sse2(x + i, y + i, n - i);
+}
+CS__TGT("avx512f,avx512bw") static void cs__ascii_fold_avx512(char* d, const char* s, size_t n, char lo) {
+    __m512i base = _mm512_set1_epi8(lo), span = _mm512_set1_epi8(26), bit = _mm512_set1_epi8(0x20); size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m512i x = CS__LD_I512(s + i);
+        __mmask64 in = _mm512_cmplt_epu8_mask(_mm512_sub_epi8(x, base), span);
+        CS__ST_I512(d + i, _mm512_mask_blend_epi8(in, x, _mm512_xor_si512(x, bit)));
+    }
+    cs__ascii_fold_sse2(d + i, s + i, n - i, lo);
+}
+CS__TGT("avx512f,avx512bw") static void cs__ascii_lower_avx512(char* d, const char* s, size_t n) { cs__ascii_fold_avx512(d, s, n, 'A'); }
+CS__TGT("avx512f,avx512bw") static void cs__ascii_upper_avx512(char* d, const char* s, size_t n) { cs__ascii_fold_avx512(d, s, n, 'a'); }
+#endif /* CS_SIMD_X86 */
+
+#ifdef CS_SIMD_NEON
+// -- NEON (AArch64) --
+#define CS__NOTGT
+static inline uint64_t cs__neon_mask(uint8x16_t eq) {   // 4 bits per byte lane
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+CS__RED_FN(CS__NOTGT, cs__sum_f32_neon, float, float32x4_t, 4, vdupq_n_f32, vld1q_f32, vst1q_f32, vaddq_f32, CS__ADD, 0.0f)
+CS__RED_FN(CS__NOTGT, cs__min_f32_neon, float, float32x4_t, 4, vdupq_n_f32, vld1q_f32, vst1q_f32, vminq_f32, CS__MIN, INFINITY)
+CS__RED_FN(CS__NOTGT, cs__max_f32_neon, float, float32x4_t, 4, vdupq_n_f32, vld1q_f32, vst1q_f32, vmaxq_f32, CS__MAX, -INFINITY)
+CS__RED_FN(CS__NOTGT, cs__min_i32_neon, int32_t, int32x4_t, 4, vdupq_n_s32, vld1q_s32, vst1q_s32, vminq_s32, CS__MIN, INT32_MAX)
+CS__RED_FN(CS__NOTGT, cs__max_i32_neon, int32_t, int32x4_t, 4, vdupq_n_s32, vld1q_s32, vst1q_s32, vmaxq_s32, CS__MAX, INT32_MIN)
+static float cs__dot_f32_neon(const float* a, const float* b, size_t n) {
+    float32x4_t a0 = vdupq_n_f32(0.0f), a1 = vdupq_n_f32(0.0f); size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        a0 = vfmaq_f32(a0, vld1q_f32(a + i), vld1q_f32(b + i));
+        a1 = vfmaq_f32(a1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    float r = vaddvq_f32(vaddq_f32(a0, a1));
+    for (; i < n; ++i) r += a[i] * b[i];
+    return r;
+}
+static int64_t cs__sum_i32_neon(const int32_t* p, size_t n) {
+    int64x2_t a0 = vdupq_n_s64(0), a1 = vdupq_n_s64(0); size_t i = 0;
+    for (; i + 8 <= n; i += 8) { a0 = vpadalq_s32(a0, vld1q_s32(p + i)); a1 = vpadalq_s32(a1, vld1q_s32(p + i + 4)); }
+    int64_t r = vaddvq_s64(vaddq_s64(a0, a1));
+    for (; i < n; ++i) r += p[i];
+    return r;
+}
+static size_t cs__find_byte_neon(const void* p, size_t n, int c) {
+    const unsigned char* s = (const unsigned char*)p; uint8x16_t k = vdupq_n_u8((uint8_t)c); size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint64_t m = cs__neon_mask(vceqq_u8(vld1q_u8(s + i), k));
+        if (m) return i + ((size_t)__builtin_ctzll(m) >> 2);
+    }
+    for (; i < n; ++i) if (s[i] == (unsigned char)c) return i;
+    return n;
+}
+static size_t cs__prefix_len_neon(const void* a, const void* b, size_t n) {
+    const unsigned char* x = (const unsigned char*)a; const unsigned char* y = (const unsigned char*)b; size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint64_t m = cs__neon_mask(vmvnq_u8(vceqq_u8(vld1q_u8(x + i), vld1q_u8(y + i))));
+        if (m) return i + ((size_t)__builtin_ctzll(m) >> 2);
+    }
+    while (i < n && x[i] == y[i]) ++i;
+    return i;
+}
+static void cs__ascii_fold_neon(char* d, const char* s, size_t n, char lo) {
+    uint8x16_t base = vdupq_n_u8((uint8_t)lo), span = vdupq_n_u8(26), bit = vdupq_n_u8(0x20); size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t x = vld1q_u8((const uint8_t*)s + i);
+        uint8x16_t in = vcltq_u8(vsubq_u8(x, base), span);
+        vst1q_u8((uint8_t*)d + i, veorq_u8(x, vandq_u8(in, bit)));
+    }
+    for (; i < n; ++i) d[i] = cs__fold_char(s[i], lo);
+}
+static void cs__ascii_lower_neon(char* d, const char* s, size_t n) { cs__ascii_fold_neon(d, s, n, 'A'); }
+static void cs__ascii_upper_neon(char* d, const char* s, size_t n) { cs__ascii_fold_neon(d, s, n, 'a'); }
+#endif /* CS_SIMD_NEON */
+
+// -- dispatch --
+typedef struct cs__simd_ops {
+    const char* isa;
+    float (*sum_f32)(const float*, size_t);
+    float (*min_f32)(const float*, size_t);
+    float (*max_f32)(const float*, size_t);
+    float (*dot_f32)(const float*, const float*, size_t);
+    int64_t (*sum_i32)(const int32_t*, size_t);
+    int32_t (*min_i32)(const int32_t*, size_t);
+    int32_t (*max_i32)(const int32_t*, size_t);
+    size_t (*find_byte)(const void*, size_t, int);
+    size_t (*prefix_len)(const void*, const void*, size_t);
+    void (*ascii_lower)(char*, const char*, size_t);
+    void (*ascii_upper)(char*, const char*, size_t);
+} cs__simd_ops;
+#define CS__SIMD_OPS(isa) { #isa, cs__sum_f32_##isa, cs__min_f32_##isa, cs__max_f32_##isa, cs__dot_f32_##isa, \
+    cs__sum_i32_##isa, cs__min_i32_##isa, cs__max_i32_##isa, cs__find_byte_##isa, cs__prefix_len_##isa,          \
+    cs__ascii_lower_##isa, cs__ascii_upper_##isa }
+
+#if defined(CS_SIMD_NEON)
+static cs__simd_ops cs__simd = CS__SIMD_OPS(neon);   // NEON is baseline on AArch64
+#elif defined(CS_SIMD_X86) && defined(__SSE2__)
+static cs__simd_ops cs__simd = CS__SIMD_OPS(sse2);
+#else
+static cs__simd_ops cs__simd = CS__SIMD_OPS(scalar);
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((constructor))
+#endif
+static void cs__simd_init(void) {
+    const char* cap = getenv("CS_SIMD");
+    if (cap && strcmp(cap, "scalar") == 0) { cs__simd = (cs__simd_ops)CS__SIMD_OPS(scalar); return; }
+#ifdef CS_SIMD_X86
+    int lim = !cap ? 3 : strcmp(cap, "sse2") == 0 ? 1 : strcmp(cap, "avx2") == 0 ? 2 : 3;
+    __builtin_cpu_init();
+    if (lim >= 3 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) cs__simd = (cs__simd_ops)CS__SIMD_OPS(avx512);
+    else if (lim >= 2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) cs__simd = (cs__simd_ops)CS__SIMD_OPS(avx2);
+    else if (__builtin_cpu_supports("sse2")) cs__simd = (cs__simd_ops)CS__SIMD_OPS(sse2);
+#endif
+}
+
+// -- public API (pointer + length, or any view with .ptr/.len) --
+static inline const char* cs_simd_isa(void) { return cs__simd.isa; }
+static inline float cs_sum_f32(const float* p, size_t n) { return cs__simd.sum_f32(p, n); }
+static inline float cs_min_f32(const float* p, size_t n) { return cs__simd.min_f32(p, n); }   // +inf when n == 0
+static inline float cs_max_f32(const float* p, size_t n) { return cs__simd.max_f32(p, n); }   // -inf when n == 0
+static inline float cs_dot_f32(const float* a, const float* b, size_t n) { return cs__simd.dot_f32(a, b, n); }
+static inline int64_t cs_sum_i32(const int32_t* p, size_t n) { return cs__simd.sum_i32(p, n); }
+static inline int32_t cs_min_i32(const int32_t* p, size_t n) { return cs__simd.min_i32(p, n); }   // INT32_MAX when n == 0
+static inline int32_t cs_max_i32(const int32_t* p, size_t n) { return cs__simd.max_i32(p, n); }   // INT32_MIN when n == 0
+static inline size_t cs_find_byte(const void* p, size_t n, int c) { return cs__simd.find_byte(p, n, c); }   // n when absent
+static inline size_t cs_prefix_len(const void* a, const void* b, size_t n) { return cs__simd.prefix_len(a, b, n); }
+static inline void cs_ascii_lower(char* dst, const char* src, size_t n) { cs__simd.ascii_lower(dst, src, n); }   // dst may equal src
+static inline void cs_ascii_upper(char* dst, const char* src, size_t n) { cs__simd.ascii_upper(dst, src, n); }
+#define cs_sum_f32_v(v)       cs_sum_f32((v).ptr, (v).len)
+#define cs_min_f32_v(v)       cs_min_f32((v).ptr, (v).len)
+#define cs_max_f32_v(v)       cs_max_f32((v).ptr, (v).len)
+#define cs_dot_f32_v(a, b)    cs_dot_f32((a).ptr, (b).ptr, (a).len < (b).len ? (a).len : (b).len)
+#define cs_sum_i32_v(v)       cs_sum_i32((v).ptr, (v).len)
+#define cs_min_i32_v(v)       cs_min_i32((v).ptr, (v).len)
+#define cs_max_i32_v(v)       cs_max_i32((v).ptr, (v).len)
+#define cs_find_byte_v(v, c)  cs_find_byte((v).ptr, (v).len, (c))
+#define cs_prefix_len_v(a, b) cs_prefix_len((a).ptr, (b).ptr, (a).len < (b).len ? (a).len : (b).len)
+)CS";
+}
+
+static string prelude_modules(const Config& cfg) {
+    string o;
+    if (cfg.modules.count("sample")) o += prelude_sample();   // before threads: workers register with it
+    if (cfg.modules.count("threads")) o += prelude_threads();
+    if (cfg.modules.count("chan")) o += prelude_chan();
+    if (cfg.modules.count("arena")) o += prelude_arena();
+    if (cfg.modules.count("memstats")) o += prelude_memstats();
+    if (cfg.modules.count("simd")) o += prelude_simd();
+    if (cfg.modules.count("bench")) o += prelude_bench();
+    if (cfg.modules.count("trace")) o += prelude_trace();
+    return o;
+}
+
+//============================= Optimization level =============================
+// @opt / -O spellings -> O0 O1 O2 O3 max size Oz. "size" is -Os; "Oz" trades
+// more speed for size (clang, GCC 12+) and sets MinSize in embedded codegen.
+static string normalize_opt(const string& v) {
+    if (v == "s" || v == "Os" || v == "Osize") return "size";
+    if (v == "z" || v == "Oz" || v == "minsize") return "Oz";
+    if (v == "Omax") return "max";
+    if (v.size() == 1 && isdigit((unsigned char)v[0])) return "O" + v;
+    return v;
+}
+
+static bool is_size_opt(const Config& cfg) { return cfg.opt == "size" || cfg.opt == "Oz"; }
+
+//============================= Directives & body =============================
+// '@' forms that annotate the code that follows rather than configure the
+// build; they stay in the body for the lowering passes.
+static bool is_inline_annotation(const string& name) {
+    static const set<string> names = { "unsafe", "arena", "unroll", "vectorize", "likely", "unlikely",
+                                        "noalias", "restrict", "assume_aligned", "packed", "aligned", "cacheline", "soa" };
+    return names.count(name) > 0;
+}
+
+// Scans the mapped source line by line; only directive lines are copied out,
+// everything else is appended to body in place. Directive lines leave an empty
+// line behind so the body keeps the .csc line numbering.
+static void parse_directives_and_collect(std::string_view in, Config& cfg, string& body) {
+    body.reserve(in.size() + 1);
+    for (size_t at = 0; at < in.size();) {
+        size_t nl = in.find('\n', at);
+        std::string_view line = in.substr(at, nl == std::string_view::npos ? std::string_view::npos : nl - at);
+        at = nl == std::string_view::npos ? in.size() : nl + 1;
+        size_t lead = line.find_first_not_of(" \t\r\n");
+        if (lead != std::string_view::npos && line[lead] == '@') {
+            string t = trim(string(line.substr(lead)));
+            std::istringstream ls(t.substr(1));
+            string name; ls >> name;
+            {
+                size_t cut = name.find_first_of("({");
+                if (cut != string::npos && is_inline_annotation(name.substr(0, cut))) name.erase(cut);
+            }
+            if (is_inline_annotation(name) || (name == "trace" && t.find_first_of(" \t") == string::npos)) {
+                body.append(line); body.push_back('\n');   // bare @trace marks the next function
+                continue;
+            }
+            if (name == "hardline") {
+                string v; ls >> v;
+                cfg.hardline = (v != "off");
+            }
+            else if (name == "softline") {
+                string v; ls >> v;
+                cfg.softline = (v != "off");
+            }
+            else if (name == "opt") {
+                string v; ls >> v;
+                cfg.opt = normalize_opt(v);
+            }
+            else if (name == "lto") {
+                string v; ls >> v;
+                cfg.lto = (v != "off");
+            }
+            else if (name == "profile") {
+                string v; ls >> v;
+                cfg.profile = (v != "off");
+                cfg.profile_sample = (v == "sample");
+            }
+            else if (name == "debug") {
+                string v; ls >> v;
+                cfg.debug = (v != "off");
+            }
+            else if (name == "out") {
+                string v; ls >> std::quoted(v);
+                cfg.out = v;
+            }
+            else if (name == "abi") {
+                string v; ls >> std::quoted(v);
+                cfg.abi = v;
+            }
+            else if (name == "define") {
+                string v; ls >> v;
+                cfg.defines.push_back(v);
+            }
+            else if (name == "inc") {
+                string v; ls >> std::quoted(v);
+                cfg.incs.push_back(v);
+            }
+            else if (name == "libpath") {
+                string v; ls >> std::quoted(v);
+                cfg.libpaths.push_back(v);
+            }
+            else if (name == "link") {
+                string v; ls >> std::quoted(v);
+                cfg.links.push_back(v);
+            }
+            else if (name == "target") {
+                string v; ls >> std::quoted(v);
+                cfg.target = v;
+            }
+            else if (name == "memstats") {
+                string v; ls >> v;
+                if (v == "off") cfg.modules.erase("memstats");
+                else cfg.modules.insert("memstats");
+            }
+            else if (name == "muttrack") {
+                // on: mutation counters; sites: plus the per-call-site breakdown
+                string v; ls >> v;
+                auto drop = [&](const string& d) { cfg.defines.erase(std::remove(cfg.defines.begin(), cfg.defines.end(), d), cfg.defines.end()); };
+                drop("CS_CAPSULE=1"); drop("CS_MUT_SITES=1");
+                if (v != "off") cfg.defines.push_back("CS_CAPSULE=1");
+                if (v == "sites") cfg.defines.push_back("CS_MUT_SITES=1");
+            }
+            else if (name == "trace") {
+                string v; ls >> v;
+                if (v == "off") cfg.modules.erase("trace");
+                else cfg.modules.insert("trace");
+            }
+            else if (name == "sample") {
+                string v; ls >> v;
+                if (v == "off") cfg.modules.erase("sample");
+                else cfg.modules.insert("sample");
+            }
+            else if (name == "chan") {
+                string v; ls >> v;
+                if (v != "spsc" && v != "mpmc") throw CompilerError("@chan expects spsc or mpmc, got '" + v + "'");
+                cfg.chan_mode = v;
+            }
+            else if (name == "cpu") {
+                string v; ls >> v;
+                if (v.empty()) throw CompilerError("@cpu expects native, a CPU name or a feature list like +avx2,+fma");
+                if (cfg.cpu.empty()) cfg.cpu = v;   // --cpu on the command line wins
+            }
+            else if (name == "use") {
+                string v; ls >> v;
+                if (v == "threads" || v == "arena" || v == "simd") cfg.modules.insert(v);
+                else std::cerr << "warning: unknown module @use " << v << "\n";
+            }
+            else {
+                std::cerr << "warning: unknown directive @" << name << "\n";
+            }
+            body.push_back('\n');   // keep body line N == .csc line N
+            continue;
+        }
+        body.append(line); body.push_back('\n');
+    }
+}
+
+//============================= Constant expressions =============================
+// Tiny integer constant-expression evaluator used for enumerator initialisers.
+// Handles literals, earlier enumerators, parentheses and the C integer operators;
+// anything else (sizeof, casts, external macros) reports failure so callers can
+// fall back to a conservative lowering.
+struct ConstEval {
+    const string& s;
+    const map<string, long long>& env;
+    size_t i = 0;
+    bool ok = true;
+
+    ConstEval(const string& src, const map<string, long long>& e) : s(src), env(e) {}
+
+    void ws() { while (i < s.size() && isspace((unsigned char)s[i])) ++i; }
+    bool eat(const char* op) {
+        ws();
+        size_t n = strlen(op);
+        if (s.compare(i, n, op) != 0) return false;
+        // don't split '<<' into '<' or '|' out of '||'
+        if (n == 1 && i + 1 < s.size() && s[i + 1] == op[0] && (op[0] == '<' || op[0] == '>' || op[0] == '&' || op[0] == '|')) return false;
+        i += n; return true;
+    }
+
+    long long primary() {
+        ws();
+        if (i >= s.size()) { ok = false; return 0; }
+        char c = s[i];
+        if (c == '(') {
+            ++i; long long v = bor();
+            if (!eat(")")) ok = false;
+            return v;
+        }
+        if (c == '\'') {
+            ++i;
+            if (i >= s.size()) { ok = false; return 0; }
+            long long v = (unsigned char)s[i++];
+            if (v == '\\' && i < s.size()) {
+                char e = s[i++];
+                switch (e) {
+                case 'n': v = '\n'; break; case 't': v = '\t'; break; case 'r': v = '\r'; break;
+                case '0': v = 0; break; case '\\': v = '\\'; break; case '\'': v = '\''; break;
+                default: ok = false; break;
+                }
+            }
+            if (i >= s.size() || s[i] != '\'') { ok = false; return 0; }
+            ++i; return v;
+        }
+        if (isdigit((unsigned char)c)) {
+            int base = 10;
+            if (c == '0' && i + 1 < s.size() && (s[i + 1] == 'x' || s[i + 1] == 'X')) { base = 16; i += 2; }
+            else if (c == '0' && i + 1 < s.size() && (s[i + 1] == 'b' || s[i + 1] == 'B')) { base = 2; i += 2; }
+            else if (c == '0') base = 8;
+            unsigned long long v = 0;
+            size_t start = i;
+            while (i < s.size() && isxdigit((unsigned char)s[i])) {
+                int d = isdigit((unsigned char)s[i]) ? s[i] - '0' : (tolower((unsigned char)s[i]) - 'a' + 10);
+                if (d >= base) break;
+                v = v * (unsigned)base + (unsigned)d; ++i;
+            }
+            if (i == start && base != 8) { ok = false; return 0; }
+            while (i < s.size() && (s[i] == 'u' || s[i] == 'U' || s[i] == 'l' || s[i] == 'L')) ++i;
+            return (long long)v;
+        }
+        if (isalpha((unsigned char)c) || c == '_') {
+            size_t b = i;
+            while (i < s.size() && (isalnum((unsigned char)s[i]) || s[i] == '_')) ++i;
+            auto it = env.find(s.substr(b, i - b));
+            if (it == env.end()) { ok = false; return 0; }
+            return it->second;
+        }
+        ok = false; return 0;
+    }
+    long long unary() {
+        if (eat("-")) return -unary();
+        if (eat("+")) return unary();
+        if (eat("~")) return ~unary();
+        if (eat("!")) return !unary();
+        return primary();
+    }
+    long long mul() {
+        long long v = unary();
+        while (ok) {
+            if (eat("*")) v *= unary();
+            else if (eat("/")) { long long r = unary(); if (r == 0) { ok = false; return 0; } v /= r; }
+            else if (eat("%")) { long long r = unary(); if (r == 0) { ok = false; return 0; } v %= r; }
+            else break;
+        }
+        return v;
+    }
+    long long add() {
+        long long v = mul();
+        while (ok) {
+            if (eat("+")) v += mul();
+            else if (eat("-")) v -= mul();
+            else break;
+        }
+        return v;
+    }
+    long long shift() {
+        long long v = add();
+        while (ok) {
+            if (eat("<<")) v = (long long)((unsigned long long)v << (add() & 63));
+            else if (eat(">>")) v >>= (add() & 63);
+            else break;
+        }
+        return v;
+    }
+    long long band() { long long v = shift(); while (ok && eat("&")) v &= shift(); return v; }
+    long long bxor() { long long v = band(); while (ok && eat("^")) v ^= band(); return v; }
+    long long bor() { long long v = bxor(); while (ok && eat("|")) v |= bxor(); return v; }
+};
+
+static bool eval_const_int(const string& expr, const map<string, long long>& env, long long& out) {
+    ConstEval ev(expr, env);
+    long long v = ev.bor();
+    ev.ws();
+    if (!ev.ok || ev.i != expr.size()) return false;
+    out = v;
+    return true;
+}
+
+//============================= Perfect hashing =============================
+// Collision-free hash over a fixed key set, used by switch! on strings and by
+// enum! name lookup. The hash mixes the length with a few distinguishing byte
+// positions (counted from the front or the back), chosen greedily so the
+// (length, bytes) tuples are unique; if no small position set separates the
+// keys every byte is hashed. A seed search then finds a table size/seed with
+// no collisions, so a lookup is one hash, one slot and one memcmp. Key sets
+// too large for that fall back to linear probing in the same table layout.
+struct PerfectHash {
+    bool full = false;     // hash every byte instead of selected positions
+    bool probe = false;    // collisions resolved by linear probing
+    vector<int> pos;       // p >= 0: s[p]; p < 0: s[n - 1 - (-p - 1)]; 0 when out of range
+    uint32_t seed = 0;
+    size_t size = 1;       // table size (power of two)
+    vector<int> slot;      // key index per slot, -1 when empty
+};
+
+// Key sets up to this size must get a collision-free table (no probe loop).
+static constexpr size_t PH_MAX_PROBE_FREE = 128;
+
+static uint32_t ph_hash(const PerfectHash& ph, const string& k) {
+    const size_t n = k.size();
+    // Multiply after folding in the seed: a bare XOR would move every key by
+    // the same amount when no position bytes follow, leaving collisions intact.
+    uint32_t h = (ph.seed ^ (static_cast<uint32_t>(n) * 0x9E3779B1u)) * 0x01000193u;
+    auto mix = [&](unsigned char b) { h = (h ^ b) * 0x01000193u; };
+    if (ph.full) for (unsigned char c : k) mix(c);
+    else for (int p : ph.pos) {
+        size_t q = p >= 0 ? static_cast<size_t>(p) : static_cast<size_t>(-p - 1);
+        mix(q < n ? static_cast<unsigned char>(k[p >= 0 ? q : n - 1 - q]) : 0);
+    }
+    return h ^ (h >> 15);
+}
+
+static PerfectHash build_perfect_hash(const vector<string>& keys) {
+    PerfectHash ph;
+    size_t maxlen = 0;
+    for (auto& k : keys) maxlen = std::max(maxlen, k.size());
+    auto distinct = [&](const vector<int>& pos) {
+        set<string> seen;
+        for (auto& k : keys) {
+            string t = std::to_string(k.size()) + ":";
+            for (int p : pos) {
+                size_t q = p >= 0 ? static_cast<size_t>(p) : static_cast<size_t>(-p - 1);
+                t.push_back(q < k.size() ? k[p >= 0 ? q : k.size() - 1 - q] : '\0');
+            }
+            seen.insert(t);
+        }
+        return seen.size();
+    };
+    size_t best = distinct(ph.pos);
+    while (best < keys.size() && ph.pos.size() < 4) {
+        int pick = 0; size_t pickScore = best;
+        for (size_t q = 0; q < std::min<size_t>(maxlen, 32); ++q)
+            for (int cand : { static_cast<int>(q), -static_cast<int>(q) - 1 }) {
+                vector<int> tryPos = ph.pos; tryPos.push_back(cand);
+                size_t sc = distinct(tryPos);
+                if (sc > pickScore) { pickScore = sc; pick = cand; }
+            }
+        if (pickScore == best) break;
+        ph.pos.push_back(pick);
+        best = pickScore;
+    }
+    ph.full = best < keys.size();
+    if (ph.full) ph.pos.clear();
+
+    size_t base = 1;
+    while (base < keys.size()) base <<= 1;
+    for (size_t size = base; size <= base * 16; size <<= 1) {
+        for (uint32_t seed = 0; seed < 4096; ++seed) {
+            ph.seed = seed; ph.size = size;
+            ph.slot.assign(size, -1);
+            bool ok = true;
+            for (size_t i = 0; i < keys.size() && ok; ++i) {
+                size_t k = ph_hash(ph, keys[i]) & (size - 1);
+                if (ph.slot[k] >= 0) ok = false; else ph.slot[k] = static_cast<int>(i);
+            }
+            if (ok) return ph;
+        }
+    }
+    // With up to 16x headroom and 4096 seeds a small set always separates;
+    // reaching the probing table for one means the hash lost its seed.
+    if (keys.size() <= PH_MAX_PROBE_FREE)
+        throw CompilerError("internal error: no collision-free hash for " + std::to_string(keys.size()) + " keys");
+    ph.probe = true; ph.seed = 0; ph.size = base * 2;
+    ph.slot.assign(ph.size, -1);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        size_t k = ph_hash(ph, keys[i]) & (ph.size - 1);
+        while (ph.slot[k] >= 0) k = (k + 1) & (ph.size - 1);
+        ph.slot[k] = static_cast<int>(i);
+    }
+    return ph;
+}
+
+// C statements computing `uint32_t <h>` for the string (s, n), matching ph_hash.
+static string ph_emit_hash(const PerfectHash& ph, const string& s, const string& n, const string& h) {
+    std::ostringstream o;
+    o << "uint32_t " << h << " = (" << ph.seed << "u ^ ((uint32_t)" << n << " * 0x9E3779B1u)) * 0x01000193u; ";
+    if (ph.full)
+        o << "for (size_t " << h << "_i = 0; " << h << "_i < " << n << "; ++" << h << "_i) " << h << " = (" << h << " ^ (unsigned char)" << s << "[" << h << "_i]) * 0x01000193u; ";
+    else for (int p : ph.pos) {
+        size_t q = p >= 0 ? static_cast<size_t>(p) : static_cast<size_t>(-p - 1);
+        string idx = p >= 0 ? std::to_string(q) : n + " - " + std::to_string(q + 1);
+        o << h << " = (" << h << " ^ (" << n << " > " << q << " ? (unsigned char)" << s << "[" << idx << "] : 0u)) * 0x01000193u; ";
+    }
+    o << h << " ^= " << h << " >> 15; ";
+    return o.str();
+}
+
+// C statements that look (s, n) up in a key table T (fields .len/.key, n keys)
+// through T_slot, the slot->key+1 index built from ph; `hit` runs with the
+// matching entry available as T[e - 1].
+static string ph_emit_lookup(const PerfectHash& ph, size_t nkeys, const string& T, const string& s, const string& n,
+    const string& h, const string& hit) {
+    const string E = nkeys < 255 ? "unsigned char" : "unsigned short";
+    std::ostringstream o;
+    o << "static const " << E << " " << T << "_slot[" << ph.size << "] = {";
+    for (size_t k = 0; k < ph.size; ++k) o << (k ? "," : "") << ph.slot[k] + 1;
+    o << "}; " << ph_emit_hash(ph, s, n, h);
+    const string match = "if (" + T + "[e - 1].len == " + n + " && memcmp(" + T + "[e - 1].key, " + s + ", " + n + ") == 0) { " + hit + " ";
+    if (ph.probe)
+        o << "{ " << E << " e; for (size_t k = " << h << " & " << ph.size - 1 << "u; (e = " << T << "_slot[k]) != 0; k = (k + 1) & " << ph.size - 1 << "u) "
+        << match << "break; } } ";
+    else
+        o << "{ " << E << " e = " << T << "_slot[" << h << " & " << ph.size - 1 << "u]; if (e) " << match << "} } ";
+    return o.str();
+}
+
+// Decode the bytes of a C string literal ("..." with the usual escapes).
+static bool decode_c_string(const string& lit, string& out) {
+    if (lit.size() < 2 || lit.front() != '"' || lit.back() != '"') return false;
+    out.clear();
+    for (size_t i = 1; i + 1 < lit.size(); ++i) {
+        char c = lit[i];
+        if (c != '\\') { out.push_back(c); continue; }
+        if (++i + 1 >= lit.size()) return false;
+        c = lit[i];
+        switch (c) {
+        case 'n': out.push_back('\n'); break;
+        case 't': out.push_back('\t'); break;
+        case 'r': out.push_back('\r'); break;
+        case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': {
+            int v = 0, k = 0;
+            while (k < 3 && i + 1 < lit.size() && lit[i] >= '0' && lit[i] <= '7') { v = v * 8 + (lit[i] - '0'); ++i; ++k; }
+            --i; out.push_back(static_cast<char>(v)); break;
+        }
+        case 'x': {
+            int v = 0, k = 0;
+            while (i + 2 < lit.size() && isxdigit((unsigned char)lit[i + 1])) { ++i; ++k; v = v * 16 + (isdigit((unsigned char)lit[i]) ? lit[i] - '0' : (tolower(lit[i]) - 'a' + 10)); }
+            if (!k) return false;
+            out.push_back(static_cast<char>(v)); break;
+        }
+        case '\\': case '"': case '\'': case '?': out.push_back(c); break;
+        case 'a': out.push_back('\a'); break;
+        case 'b': out.push_back('\b'); break;
+        case 'f': out.push_back('\f'); break;
+        case 'v': out.push_back('\v'); break;
+        default: return false;
+        }
+    }
+    return true;
+}
+
+//============================= enum! parsing + emission =============================
+struct EnumInfo {
+    set<string> members;
+    bool is_flags = false;
+    // Declaration-ordered enumerators with their evaluated values; only
+    // meaningful when values_known (every initialiser folded to a constant).
+    vector<pair<string, long long>> values;
+    bool values_known = false;
+};
+
+// Split an enum body into enumerators and fold their values the way C does
+// (implicit previous+1, explicit initialisers may reference earlier members).
+static void split_enum_body(const string& body, EnumInfo& info) {
+    map<string, long long> env;
+    long long next = 0;
+    bool known = true;
+    string token;
+    auto flush = [&]() {
+        string t = trim(token);
+        token.clear();
+        if (t.empty()) return;
+        size_t eq = t.find('=');
+        string ident = trim(eq == string::npos ? t : t.substr(0, eq));
+        if (ident.empty()) return;
+        long long v = next;
+        if (eq != string::npos && !eval_const_int(trim(t.substr(eq + 1)), env, v)) known = false;
+        info.members.insert(ident);
+        info.values.push_back({ ident, v });
+        env[ident] = v;
+        next = v + 1;
+        };
+    int depth = 0;
+    for (char c : body) {
+        if (c == '(') depth++;
+        else if (c == ')') depth--;
+        if (c == ',' && depth == 0) flush();
+        else token.push_back(c);
+    }
+    flush();
+    info.values_known = known;
+}
+
+// Emit cs__enum_is_valid_<Name>. With folded values this is branch-free for
+// dense enums (one unsigned range compare) and for sparse enums spanning at
+// most 64 values (one constant bitmap test); wider sparse enums binary-search
+// a sorted table. Unknown values keep the per-member switch.
+static string emit_enum_validator(const string& name, const EnumInfo& info) {
+    std::ostringstream o;
+    const string fn = "cs__enum_is_valid_" + name;
+    if (!info.values_known || info.values.empty()) {
+        o << "static inline int " << fn << "(int v){ switch((" << name << ")v){ ";
+        for (auto& e : info.members) o << "case " << e << ": ";
+        o << "return 1; default: return 0; } }\n";
+        return o.str();
+    }
+
+    vector<long long> vals;
+    for (auto& kv : info.values) vals.push_back(kv.second);
+    std::sort(vals.begin(), vals.end());
+    vals.erase(std::unique(vals.begin(), vals.end()), vals.end());
+    const long long lo = vals.front(), hi = vals.back();
+    const unsigned long long span = (unsigned long long)hi - (unsigned long long)lo;
+
+    if (span == vals.size() - 1) {
+        o << "static inline int " << fn << "(int v){ return (unsigned long long)((long long)v - (" << lo
+            << "LL)) <= " << span << "ULL; }\n";
+    }
+    else if (span < 64) {
+        unsigned long long mask = 0;
+        for (long long v : vals) mask |= 1ULL << (unsigned long long)(v - lo);
+        o << "static inline int " << fn << "(int v){ unsigned long long d = (unsigned long long)((long long)v - ("
+            << lo << "LL)); return d < 64ULL && ((0x" << std::hex << mask << std::dec << "ULL >> d) & 1ULL); }\n";
+    }
+    else {
+        o << "static const int cs__enum_vals_" << name << "[" << vals.size() << "] = { ";
+        for (size_t i = 0; i < vals.size(); ++i) o << (i ? ", " : "") << vals[i];
+        o << " };\n"
+            << "static inline int " << fn << "(int v){ size_t lo = 0, hi = " << vals.size() << "; "
+            << "while(lo < hi){ size_t mid = lo + (hi - lo) / 2; int x = cs__enum_vals_" << name << "[mid]; "
+            << "if(x == v) return 1; if(x < v) lo = mid + 1; else hi = mid; } return 0; }\n";
+    }
+    return o.str();
+}
+
+// Emit Name_name(v) (declared name, NULL for values outside the enum) and
+// Name_from_str(s, n, &out) (perfect-hashed, true on a hit). With folded
+// values the name lookup is a direct table index; aliases report the first
+// declared name.
+static string emit_enum_names(const string& name, const EnumInfo& info) {
+    std::ostringstream o;
+    const string fn = name + "_name";
+    if (info.values_known && !info.values.empty()) {
+        long long lo = info.values.front().second, hi = lo;
+        for (auto& kv : info.values) { lo = std::min(lo, kv.second); hi = std::max(hi, kv.second); }
+        const unsigned long long span = (unsigned long long)hi - (unsigned long long)lo + 1;
+        if (span <= std::max<unsigned long long>(64, 4 * info.values.size())) {
+            vector<string> tbl(static_cast<size_t>(span));
+            for (auto& kv : info.values) {
+                string& slot = tbl[static_cast<size_t>(kv.second - lo)];
+                if (slot.empty()) slot = "\"" + kv.first + "\"";
+            }
+            o << "static const char* const cs__enum_names_" << name << "[" << span << "] = {";
+            for (size_t i = 0; i < tbl.size(); ++i) o << (i ? ", " : " ") << (tbl[i].empty() ? "NULL" : tbl[i]);
+            o << " };\n"
+                << "static inline const char* " << fn << "(" << name << " v){ unsigned long long d = (unsigned long long)((long long)v - ("
+                << lo << "LL)); return d < " << span << "ULL ? cs__enum_names_" << name << "[d] : NULL; }\n";
+        }
+        else {
+            set<long long> seen;
+            o << "static inline const char* " << fn << "(" << name << " v){ switch ((long long)v) {";
+            for (auto& kv : info.values)
+                if (seen.insert(kv.second).second) o << " case " << kv.second << "LL: return \"" << kv.first << "\";";
+            o << " default: return NULL; } }\n";
+        }
+    }
+    else {
+        o << "static inline const char* " << fn << "(" << name << " v){";
+        for (auto& kv : info.values) o << " if (v == " << kv.first << ") return \"" << kv.first << "\";";
+        o << " return NULL; }\n";
+    }
+
+    vector<string> keys;
+    for (auto& kv : info.values) keys.push_back(kv.first);
+    if (keys.empty()) return o.str();
+    PerfectHash ph = build_perfect_hash(keys);
+    const string T = "cs__enum_keys_" + name;
+    o << "static inline bool " << name << "_from_str(const char* s, size_t n, " << name << "* out){ "
+        << "static const struct { size_t len; const char* key; " << name << " val; } " << T << "[" << keys.size() << "] = {";
+    for (auto& k : keys) o << " {" << k.size() << ", \"" << k << "\", " << k << "},";
+    o << " }; " << ph_emit_lookup(ph, keys.size(), T, "s", "n", "h", "*out = " + T + "[e - 1].val; return true;")
+        << "return false; }\n";
+    return o.str();
+}
+
+static string lower_enum_bang_and_collect(const string& in, map<string, EnumInfo>& enums) {
+    using namespace cs_regex_wrap;
+
+    string s = in;
+    // Match standard enum! and enum_flags!
+    std::regex re_standard(R"(enum!\s+([A-Za-z_]\w*)\s*\{([^}]*)\})");
+    std::regex re_flags(R"(enum_flags!\s+([A-Za-z_]\w*)\s*\{([^}]*)\})");
+
+    cmatch m;
+    string out;
+    out.reserve(s.size() * 12 / 10);
+    size_t pos = 0, last = 0;
+    SourceCursor lines(s);
+
+    // Process standard enums
+    while (search_from(s, pos, m, re_standard)) {
+        append_prefix(out, s, last, m);
+        last = pos;
+
+        string name = m[1].str();
+        string body = m[2].str();
+        EnumInfo info;
+        info.is_flags = false;
+        split_enum_body(body, info);
+        enums[name] = info;
+
+        // Emit real C typedef enum + validators
+        out += "typedef enum " + name + " { " + body + " } " + name + ";";
+        string helpers = emit_enum_validator(name, info);
+        helpers += emit_enum_names(name, info);
+        helpers += "static inline void cs__enum_assert_" + name + "(int v){\n"
+            "#if defined(CS_HARDLINE)\n"
+            "  if(!cs__enum_is_valid_" + name + "(v)){\n"
+            "    fprintf(stderr,\"[C-Script hardline] Non-exhaustive switch for enum " + name + " (value %d)\\n\", v);\n"
+            "    abort();\n"
+            "  }\n"
+            "#else\n"
+            "  (void)v;\n"
+            "#endif\n"
+            "}\n";
+        out += generated_lines(lines, pos, helpers);
+    }
+    out.append(s, last, string::npos);
+
+    // Reset position to search for flag enums
+    pos = last = 0;
+    string s2 = out;
+    out.clear();
+    out.reserve(s2.size() * 12 / 10);
+    SourceCursor lines2(s2);
+
+    // Process flag enums (bitfield enums)
+    while (search_from(s2, pos, m, re_flags)) {
+        append_prefix(out, s2, last, m);
+        last = pos;
+
+        string name = m[1].str();
+        string body = m[2].str();
+        EnumInfo info;
+        info.is_flags = true;
+        split_enum_body(body, info);
+        enums[name] = info;
+
+        // Emit flag enum as C typedef with bitwise operations helpers
+        out += "typedef enum " + name + " { " + body + " } " + name + ";";
+        out += generated_lines(lines2, pos,
+            "static inline " + name + " " + name + "_combine(" + name + " a, " + name + " b) { return (" + name + ")(a | b); }\n"
+            "static inline bool " + name + "_has(" + name + " flags, " + name + " flag) { return (flags & flag) == flag; }\n");
+    }
+
+    // Append tail
+    out.append(s2, last, string::npos);
+    return out;
 }
 
 //============================= Compile-time switch exhaustiveness =============================
@@ -556,28 +3320,307 @@ static void check_exhaustiveness_or_die(const string& src,
             seen.insert(m[1].str());
         }
 
-        // Compare with enum set if exists
-        auto itE = enums.find(Type);
-        if (itE != enums.end()) {
-            // Skip flags enum - they don't require exhaustiveness checking
-            if (itE->second.is_flags) {
-                i = b + 1;
-                continue;
+        // Compare with enum set if exists
+        auto itE = enums.find(Type);
+        if (itE != enums.end()) {
+            // Skip flags enum - they don't require exhaustiveness checking
+            if (itE->second.is_flags) {
+                i = b + 1;
+                continue;
+            }
+
+            const auto& universe = itE->second.members;
+            vector<string> missing;
+            for (const auto& e : universe) if (!seen.count(e)) missing.push_back(e);
+            if (!missing.empty()) {
+                auto lc = line_col_at(src, a);
+                std::ostringstream err;
+                err << "Non-exhaustive switch for enum '" << Type << "'. Missing:";
+                for (auto& mname : missing) err << " " << mname;
+                throw CompilerError(err.str(), lc.first, lc.second);
+            }
+        }
+        i = b + 1;
+    }
+}
+
+//============================= Struct attributes + layout =============================
+// @packed / @aligned(N) / @cacheline struct Name { ... }
+//   -> CS_PACKED_BEGIN typedef struct CS_PACKED CS_ALIGNAS(N) Name { ... } Name; CS_PACKED_END
+// With --verbose every `struct Name { ... }` in the file gets a layout report
+// (offsets, holes, tail padding) computed from a host size table; fields whose
+// type isn't known to the table make the report say so instead of guessing.
+struct FieldInfo {
+    string type;          // base type with const/volatile dropped
+    string name;
+    int ptr = 0;          // pointer depth
+    size_t count = 1;     // array elements (product of all dimensions)
+    bool opaque = false;  // bit-field, nested aggregate, unparsable dimension...
+    bool line_pad = false;// CS_PAD_TO_CACHELINE(T, name): own cache line(s)
+    bool array_ptr = false;// T (*name)[N]: laid out as a pointer
+};
+
+struct StructLayout {
+    bool known = true;
+    string why;           // first field that made the layout unknown
+    size_t size = 0, align = 1;
+};
+
+static vector<FieldInfo> parse_struct_fields(const string& body) {
+    vector<FieldInfo> out;
+    for (auto& rawDecl : split_top_level(body, ";")) {
+        string decl = trim(rawDecl);
+        if (decl.empty()) continue;
+        vector<string> items = split_top_level(decl, ",");
+        string base;
+        for (size_t k = 0; k < items.size(); ++k) {
+            FieldInfo f;
+            string it = trim(items[k]);
+            if (k == 0 && starts_with(it, "CS_PAD_TO_CACHELINE(") && it.back() == ')') {
+                vector<string> a = split_top_level(it.substr(20, it.size() - 21), ",");
+                if (a.size() == 2) {
+                    string t = trim(a[0]);
+                    while (!t.empty() && (t.back() == '*' || isspace((unsigned char)t.back()))) { if (t.back() == '*') f.ptr++; t.pop_back(); }
+                    f.type = t; f.name = trim(a[1]); f.line_pad = true;
+                    out.push_back(f);
+                    break;
+                }
+            }
+            // T (*name)[N]: a pointer to an array (how @soa stores array fields)
+            static const std::regex ptrToArray(R"(^([^(]*)\(\s*(\*+)\s*([A-Za-z_]\w*)\s*\)\s*(\[[^\]]*\]\s*)+$)");
+            std::smatch pm;
+            if (std::regex_match(it, pm, ptrToArray)) { it = pm[1].str() + pm[2].str() + " " + pm[3].str(); f.array_ptr = true; }
+            else if (it.find_first_of("(:{") != string::npos) {   // fn pointer, bit-field, nested aggregate
+                f.name = it; f.opaque = true; out.push_back(f); continue;
+            }
+            size_t bracket = it.find('[');
+            string head = trim(it.substr(0, bracket));
+            size_t beg = head.size();
+            while (beg > 0 && (isalnum((unsigned char)head[beg - 1]) || head[beg - 1] == '_')) --beg;
+            f.name = head.substr(beg);
+            string prefix = head.substr(0, beg);
+            for (char c : prefix) if (c == '*') f.ptr++;
+            string t;
+            for (char c : prefix) if (c != '*') t.push_back(c);
+            if (k == 0) {
+                std::istringstream ts(t);
+                string w;
+                while (ts >> w) if (w != "const" && w != "volatile" && w != "restrict") base += (base.empty() ? "" : " ") + w;
+            }
+            f.type = base;
+            while (bracket != string::npos) {
+                size_t close = find_matching(it, bracket);
+                long long n = 0;
+                if (close == string::npos || !eval_const_int(it.substr(bracket + 1, close - bracket - 1), {}, n) || n <= 0) { f.opaque = true; break; }
+                f.count *= static_cast<size_t>(n);
+                bracket = it.find('[', close);
+            }
+            if (f.name.empty() || f.type.empty()) f.opaque = true;
+            out.push_back(f);
+        }
+    }
+    return out;
+}
+
+// Size/alignment of a field type on the host, or false if unknown.
+static bool type_layout(const FieldInfo& f, const map<string, StructLayout>& structs, const map<string, EnumInfo>& enums,
+    size_t& size, size_t& align) {
+    if (f.ptr > 0) { size = align = sizeof(void*); return true; }
+    static const map<string, size_t> prim = {
+        {"char",1},{"signed char",1},{"unsigned char",1},{"_Bool",1},{"bool",1},{"int8_t",1},{"uint8_t",1},{"i8",1},{"u8",1},{"atomic_bool",1},{"atomic_char",1},
+        {"short",2},{"short int",2},{"unsigned short",2},{"int16_t",2},{"uint16_t",2},{"i16",2},{"u16",2},
+        {"int",4},{"signed",4},{"unsigned",4},{"unsigned int",4},{"float",4},{"int32_t",4},{"uint32_t",4},{"i32",4},{"u32",4},{"f32",4},
+        {"atomic_int",4},{"atomic_uint",4},
+        {"long",sizeof(long)},{"long int",sizeof(long)},{"unsigned long",sizeof(long)},{"atomic_long",sizeof(long)},{"atomic_ulong",sizeof(long)},
+        {"long long",8},{"unsigned long long",8},{"double",8},{"int64_t",8},{"uint64_t",8},{"i64",8},{"u64",8},{"f64",8},
+        {"atomic_llong",8},{"atomic_ullong",8},
+        {"size_t",sizeof(size_t)},{"ptrdiff_t",sizeof(ptrdiff_t)},{"intptr_t",sizeof(intptr_t)},{"uintptr_t",sizeof(uintptr_t)},
+        {"atomic_size_t",sizeof(size_t)},{"atomic_intptr_t",sizeof(intptr_t)},{"atomic_uintptr_t",sizeof(uintptr_t)},
+    };
+    auto p = prim.find(f.type);
+    if (p != prim.end()) { size = align = p->second; return true; }
+    string t = starts_with(f.type, "struct ") ? trim(f.type.substr(7)) : f.type;
+    auto st = structs.find(t);
+    if (st != structs.end() && st->second.known) { size = st->second.size; align = st->second.align; return true; }
+    if (enums.count(t)) { size = align = sizeof(int); return true; }
+    return false;
+}
+
+static StructLayout layout_struct(const string& name, const vector<FieldInfo>& fields, bool packed, size_t min_align,
+    const map<string, StructLayout>& structs, const map<string, EnumInfo>& enums, std::ostream* report) {
+    StructLayout L;
+    std::ostringstream rows;
+    size_t off = 0, holes = 0;
+    for (auto& f : fields) {
+        size_t sz = 0, al = 1;
+        if (f.opaque || !type_layout(f, structs, enums, sz, al)) {
+            L.known = false; L.why = f.opaque ? f.name : f.type + " " + f.name;
+            break;
+        }
+        if (f.line_pad) { al = std::max<size_t>(al, 64); sz = (sz + 63) / 64 * 64; }
+        else if (packed) al = 1;
+        size_t at = (off + al - 1) / al * al;
+        if (at > off) { rows << "      [" << (at - off) << " byte hole]\n"; holes += at - off; }
+        rows << "    " << std::setw(5) << at << "  " << f.name << (f.count > 1 ? "[" + std::to_string(f.count) + "]" : "")
+            << " : " << f.type << string(static_cast<size_t>(f.ptr), '*') << " (" << sz * f.count << ")\n";
+        off = at + sz * f.count;
+        L.align = std::max(L.align, al);
+    }
+    L.align = std::max(L.align, min_align);
+    L.size = (off + L.align - 1) / L.align * L.align;
+    if (report) {
+        *report << "layout " << name << (packed ? " [packed]" : "") << ": ";
+        if (!L.known) { *report << "unknown (field '" << L.why << "')\n"; return L; }
+        *report << "size " << L.size << ", align " << L.align << ", holes " << holes << ", tail padding " << (L.size - off) << "\n"
+            << rows.str();
+        if (L.size > 64 && L.align < 64) *report << "      note: spans " << (L.size + 63) / 64 << " cache lines\n";
+    }
+    return L;
+}
+
+static string lower_struct_attrs(const string& in, const Config& cfg, const map<string, EnumInfo>& enums) {
+    using namespace cs_regex_wrap;
+    std::regex r(R"(((?:@(?:packed|cacheline|aligned\s*\([^)]*\))\s*)*)struct\s+([A-Za-z_]\w*)\s*\{)");
+    std::regex attrRe(R"(@(packed|cacheline|aligned)\s*(?:\(([^)]*)\))?)");
+    cmatch m;
+    size_t pos = 0, last = 0;
+    string out;
+    out.reserve(in.size());
+    map<string, StructLayout> layouts;
+    while (search_from(in, pos, m, r)) {
+        size_t at = prefix_end_abs(in, m);
+        size_t close = find_matching(in, pos - 1);
+        if (close == string::npos) continue;
+        string name = m[2].str();
+        string attrs = m[1].str();
+
+        bool packed = false;
+        string align;
+        size_t min_align = 1;
+        for (std::sregex_iterator it(attrs.begin(), attrs.end(), attrRe), e; it != e; ++it) {
+            string a = (*it)[1].str(), v = trim((*it)[2].str());
+            if (a == "packed") packed = true;
+            else if (a == "cacheline") { align = "CS_CACHELINE"; min_align = std::max<size_t>(min_align, 64); }
+            else {
+                long long n = 0;
+                if (!eval_const_int(v, {}, n) || n <= 0 || (n & (n - 1))) {
+                    auto lc = line_col_at(in, at);
+                    throw CompilerError("@aligned expects a power-of-two byte count", lc.first, lc.second);
+                }
+                align = std::to_string(n);
+                min_align = std::max(min_align, static_cast<size_t>(n));
             }
+        }
+        string body = in.substr(pos, close - pos);
+        layouts[name] = layout_struct(name, parse_struct_fields(body), packed, min_align, layouts, enums, cfg.verbose ? &std::cerr : nullptr);
+        if (attrs.empty()) continue;   // plain struct: report only
+
+        append_prefix(out, in, last, m);
+        out += (packed ? "CS_PACKED_BEGIN typedef struct CS_PACKED " : "typedef struct ");
+        if (!align.empty()) out += "CS_ALIGNAS(" + align + ") ";
+        out += name + " {" + body + "} " + name + ";";
+        if (packed) out += " CS_PACKED_END";
+        size_t k = close + 1;
+        while (k < in.size() && (in[k] == ' ' || in[k] == '\t')) ++k;
+        if (k < in.size() && in[k] == ';') pos = last = k + 1;
+        else if (k < in.size() && (isalpha((unsigned char)in[k]) || in[k] == '_' || in[k] == '*')) {
+            out += " " + name;   // `} var;` declarators follow
+            pos = last = close + 1;
+        }
+        else pos = last = close + 1;
+    }
+    out.append(in, last, string::npos);
+    return out;
+}
 
-            const auto& universe = itE->second.members;
-            vector<string> missing;
-            for (const auto& e : universe) if (!seen.count(e)) missing.push_back(e);
-            if (!missing.empty()) {
-                auto lc = line_col_at(src, a);
-                std::ostringstream err;
-                err << "Non-exhaustive switch for enum '" << Type << "'. Missing:";
-                for (auto& mname : missing) err << " " << mname;
-                throw CompilerError(err.str(), lc.first, lc.second);
-            }
+//============================= @soa structs =============================
+// @soa struct Point { float x, y, z; }
+//   -> typedef struct Point { ... } Point;            (the row type, unchanged)
+//      typedef struct PointSoA { float* x; float* y; float* z; size_t len, cap; } PointSoA;
+//      PointSoA_init/_reserve/_push/_get/_set/_free
+// Each field lives in its own CS_MALLOC'd array, so a loop over s.x[i] is a
+// unit-stride walk the vectorizer can take; _get/_set rebuild/scatter a row.
+static string emit_soa(const string& name, const string& body, const vector<FieldInfo>& fields) {
+    const string S = name + "SoA";
+    std::ostringstream o;
+    o << "typedef struct " << name << " {" << body << "} " << name << ";\n"
+        << "typedef struct " << S << " {";
+    for (auto& f : fields) {
+        string elem = f.type + string(static_cast<size_t>(f.ptr), '*');
+        if (f.count > 1) o << " " << elem << " (*" << f.name << ")[" << f.count << "];";
+        else o << " " << elem << "* " << f.name << ";";
+    }
+    o << " size_t len, cap; } " << S << ";\n"
+        << "static inline void " << S << "_init(" << S << "* s){ memset(s, 0, sizeof *s); }\n"
+        << "static inline int " << S << "_reserve(" << S << "* s, size_t cap){\n"
+        << "    if (cap <= s->cap) return 0;\n";
+    for (auto& f : fields)
+        o << "    { void* p = CS_REALLOC(s->" << f.name << ", cap * sizeof *s->" << f.name << "); if (!p) return -1; s->" << f.name << " = p; }\n";
+    o << "    s->cap = cap; return 0;\n"
+        << "}\n"
+        << "static inline int " << S << "_push(" << S << "* s, " << name << " v){\n"
+        << "    if (s->len == s->cap && " << S << "_reserve(s, s->cap ? s->cap * 2 : 16) != 0) return -1;\n"
+        << "    " << S << "_set(s, s->len++, v); return 0;\n"
+        << "}\n";
+    // _set is referenced by _push, so emit it ahead of it.
+    std::ostringstream set, get;
+    set << "static inline void " << S << "_set(" << S << "* s, size_t i, " << name << " v){";
+    get << "static inline " << name << " " << S << "_get(const " << S << "* s, size_t i){ " << name << " v;";
+    for (auto& f : fields) {
+        if (f.count > 1) {
+            set << " memcpy(s->" << f.name << "[i], v." << f.name << ", sizeof v." << f.name << ");";
+            get << " memcpy(v." << f.name << ", s->" << f.name << "[i], sizeof v." << f.name << ");";
         }
-        i = b + 1;
+        else {
+            set << " s->" << f.name << "[i] = v." << f.name << ";";
+            get << " v." << f.name << " = s->" << f.name << "[i];";
+        }
+    }
+    set << " }\n";
+    get << " return v; }\n";
+    string out = o.str();
+    size_t push = out.find("static inline int " + S + "_push");
+    out.insert(push, set.str());
+    out += get.str();
+    out += "static inline void " + S + "_free(" + S + "* s){";
+    for (auto& f : fields) out += " CS_FREE(s->" + f.name + ");";
+    out += " memset(s, 0, sizeof *s); }\n";
+    return out;
+}
+
+static string lower_soa_structs(const string& in) {
+    using namespace cs_regex_wrap;
+    std::regex r(R"(@soa\s+struct\s+([A-Za-z_]\w*)\s*\{)");
+    cmatch m;
+    size_t pos = 0, last = 0;
+    string out;
+    out.reserve(in.size());
+    vector<bool> code = code_mask(in);
+    while (search_from(in, pos, m, r)) {
+        size_t at = prefix_end_abs(in, m);
+        if (!code[at]) continue;
+        auto fail = [&](const string& msg) { auto lc = line_col_at(in, at); return CompilerError(msg, lc.first, lc.second); };
+        size_t close = find_matching(in, pos - 1);
+        if (close == string::npos) throw fail("@soa struct is missing its closing '}'");
+        string name = m[1].str();
+        string body = in.substr(pos, close - pos);
+        vector<FieldInfo> fields = parse_struct_fields(body);
+        if (fields.empty()) throw fail("@soa struct " + name + " has no fields");
+        for (auto& f : fields)
+            if (f.opaque || f.line_pad || f.array_ptr) throw fail("@soa struct " + name + ": cannot split field '" + f.name + "' into its own array");
+
+        append_prefix(out, in, last, m);
+        string gen = emit_soa(name, body, fields);
+        // keep the line count: the generated declarations go on the struct's own lines
+        size_t lines = static_cast<size_t>(std::count(body.begin(), body.end(), '\n'));
+        for (char& c : gen) if (c == '\n' && lines == 0) c = ' '; else if (c == '\n') --lines;
+        out += gen;
+        size_t k = close + 1;
+        while (k < in.size() && (in[k] == ' ' || in[k] == '\t')) ++k;
+        pos = last = (k < in.size() && in[k] == ';') ? k + 1 : close + 1;
     }
+    out.append(in, last, string::npos);
+    return out;
 }
 
 //============================= @unsafe blocks =============================
@@ -601,8 +3644,1135 @@ static string lower_unsafe_blocks(const string& in) {
                 i = k; continue;
             }
         }
-        out.push_back(s[i++]);
+        out.push_back(s[i++]);
+    }
+    return out;
+}
+
+//============================= @arena blocks =============================
+// @arena name [(chunk_bytes)] { body }
+//   -> { cs_arena name; cs_arena_init(&name, chunk); cs_arena_push(&name);
+//        defer { cs_arena_pop(&name); cs_arena_release(&name); } body }
+// The release is a defer, so return/break out of the block free the arena too.
+// "@arena" in a literal or comment is left alone.
+static string lower_arena_blocks(const string& in, Config& cfg) {
+    using namespace cs_regex_wrap;
+    std::regex r(R"(@arena\s+([A-Za-z_]\w*)\s*(\(\s*([^)]*)\))?\s*\{)");
+    cmatch m;
+    size_t pos = 0, last = 0;
+    string out;
+    out.reserve(in.size());
+    vector<bool> code = code_mask(in);
+    while (search_from(in, pos, m, r)) {
+        size_t at = prefix_end_abs(in, m);
+        if (!code[at]) continue;
+        size_t close = find_matching(in, pos - 1);
+        auto fail = [&](const string& msg) { auto lc = line_col_at(in, at); return CompilerError(msg, lc.first, lc.second); };
+        if (close == string::npos) throw fail("@arena block is missing its closing '}'");
+        string name = m[1].str();
+        string chunk = m[3].matched ? trim(m[3].str()) : "0";
+        string body = in.substr(pos, close - pos);
+
+        append_prefix(out, in, last, m);
+        out += "{ cs_arena " + name + "; cs_arena_init(&" + name + ", (size_t)(" + chunk + ")); cs_arena_push(&" + name + ");";
+        out += " defer { cs_arena_pop(&" + name + "); cs_arena_release(&" + name + "); }";
+        out += lower_arena_blocks(body, cfg);
+        out += "}";
+        pos = last = close + 1;
+        cfg.modules.insert("arena");
+    }
+    out.append(in, last, string::npos);
+    return out;
+}
+
+//============================= Statement annotations =============================
+// @unroll(n) / @vectorize in front of a loop -> CS_UNROLL(n) / CS_VECTORIZE
+// (loop pragmas, see prelude); @likely / @unlikely in front of if/while wrap
+// the condition in likely()/unlikely(). Annotations may be stacked; ones in
+// literals or comments are plain text.
+static string lower_stmt_annotations(const string& in, Config& cfg) {
+    using namespace cs_regex_wrap;
+    std::regex r(R"(@(unroll|vectorize|likely|unlikely)\b)");
+    std::regex loopRe(R"(^\s*(for|while|do|@)\b)");
+    std::regex condRe(R"(^\s*(if|while)\s*\()");
+    cmatch m;
+    size_t pos = 0, last = 0;
+    string out;
+    out.reserve(in.size());
+    vector<bool> code = code_mask(in);
+    while (search_from(in, pos, m, r)) {
+        size_t at = prefix_end_abs(in, m);
+        if (!code[at]) continue;
+        auto fail = [&](const string& msg) { auto lc = line_col_at(in, at); return CompilerError(msg, lc.first, lc.second); };
+        string kind = m[1].str();
+        append_prefix(out, in, last, m);
+        last = pos;
+
+        string rest = in.substr(pos, 256);
+        cmatch nm;
+        if (kind == "unroll") {
+            size_t open = pos;
+            while (open < in.size() && (in[open] == ' ' || in[open] == '\t')) ++open;
+            size_t close = (open < in.size() && in[open] == '(') ? find_matching(in, open) : string::npos;
+            string n = close == string::npos ? "" : trim(in.substr(open + 1, close - open - 1));
+            if (n.empty() || n.find_first_not_of("0123456789") != string::npos)
+                throw fail("@unroll expects an integer count, e.g. @unroll(4)");
+            pos = last = close + 1;
+            rest = in.substr(pos, 256);
+            if (!search_iter(rest.cbegin(), rest.cend(), nm, loopRe))
+                throw fail("@unroll must precede a for/while/do loop");
+            out += "CS_UNROLL(" + n + ")";
+        }
+        else if (kind == "vectorize") {
+            if (!search_iter(rest.cbegin(), rest.cend(), nm, loopRe))
+                throw fail("@vectorize must precede a for/while/do loop");
+            out += "CS_VECTORIZE";
+            cfg.vectorize_hints = true;
+        }
+        else {
+            if (!search_iter(rest.cbegin(), rest.cend(), nm, condRe))
+                throw fail("@" + kind + " must precede an if or while statement");
+            size_t open = pos + static_cast<size_t>(nm.length(0)) - 1;
+            size_t close = find_matching(in, open);
+            if (close == string::npos) throw fail("@" + kind + ": unbalanced condition");
+            out.append(in, pos, open + 1 - pos);
+            out += kind + "(" + in.substr(open + 1, close - open - 1) + ")";
+            pos = last = close;
+        }
+    }
+    out.append(in, last, string::npos);
+    return out;
+}
+
+//============================= switch! on strings =============================
+// switch! (s) { "GET" => stmt; "PUT" | "POST" => { ... } _ => stmt; }
+// switch! (ptr, len) { ... }            (buffer that isn't NUL-terminated)
+// Case strings must be literals; they get a build-time perfect hash (see
+// PerfectHash) and the arms become a dense switch on the arm index, so a
+// dispatch is one hash, one table slot and one memcmp. Strings are open-ended,
+// so a '_' arm is required; duplicate case strings are errors. As in a C
+// switch, `break` inside an arm leaves the switch!. "switch!" in a literal or
+// comment is left alone.
+
+// End of a statement starting at i: the ';' at bracket depth 0 (strings skipped).
+static size_t find_stmt_end(const string& s, size_t i) {
+    int depth = 0;
+    for (; i < s.size(); ++i) {
+        char c = s[i];
+        if (c == '"' || c == '\'') { for (++i; i < s.size() && s[i] != c; ++i) if (s[i] == '\\') ++i; continue; }
+        if (c == '(' || c == '[' || c == '{') depth++;
+        else if (c == ')' || c == ']' || c == '}') depth--;
+        else if (c == ';' && depth == 0) return i;
+    }
+    return string::npos;
+}
+
+static string newlines_in(const string& s, size_t a, size_t b) {
+    return string(static_cast<size_t>(std::count(s.begin() + static_cast<std::ptrdiff_t>(a), s.begin() + static_cast<std::ptrdiff_t>(b), '\n')), '\n');
+}
+
+static string lower_string_switch(const string& in, int& counter) {
+    using namespace cs_regex_wrap;
+    std::regex r(R"(\bswitch!\s*\()");
+    cmatch m;
+    size_t pos = 0, last = 0;
+    string out;
+    out.reserve(in.size());
+    vector<bool> code = code_mask(in);
+    while (search_from(in, pos, m, r)) {
+        size_t at = prefix_end_abs(in, m);
+        if (!code[at]) continue;
+        auto fail = [&](const string& msg, size_t where) {
+            auto l = line_col_at(in, where);
+            throw CompilerError("switch!: " + msg, l.first, l.second);
+        };
+        size_t pclose = find_matching(in, pos - 1);
+        if (pclose == string::npos) fail("missing ')'", at);
+        vector<string> subj = split_top_level(in.substr(pos, pclose - pos), ",");
+        if (subj.empty() || subj.size() > 2 || trim(subj[0]).empty()) fail("expected (str) or (ptr, len)", at);
+        size_t bopen = skip_ws_comments(in, pclose + 1);
+        if (bopen >= in.size() || in[bopen] != '{') fail("expected '{' after the subject", bopen);
+        size_t bclose = find_matching(in, bopen);
+        if (bclose == string::npos) fail("missing closing '}'", bopen);
+
+        struct Arm { string body; string gap; };
+        vector<Arm> arms;
+        vector<string> keys, lits;
+        vector<int> keyArm;
+        int defaultArm = -1;
+        size_t i = bopen + 1;
+        for (;;) {
+            size_t start = i;
+            i = skip_ws_comments(in, i);
+            if (i >= bclose) { i = start; break; }   // keep the trailing lines for the closing brace
+            // patterns
+            bool wildcard = false;
+            vector<pair<string, size_t>> pats;
+            for (;;) {
+                i = skip_ws_comments(in, i);
+                if (in[i] == '_' && !(isalnum((unsigned char)in[i + 1]) || in[i + 1] == '_')) { wildcard = true; ++i; }
+                else if (in[i] == '"') {
+                    size_t e = i + 1;
+                    while (e < bclose && in[e] != '"') { if (in[e] == '\\') ++e; ++e; }
+                    if (e >= bclose) fail("unterminated string", i);
+                    pats.push_back({ in.substr(i, e + 1 - i), i });
+                    i = e + 1;
+                }
+                else fail("case patterns must be string literals or '_'", i);
+                i = skip_ws_comments(in, i);
+                if (in[i] != '|') break;
+                ++i;
+            }
+            if (in.compare(i, 2, "=>") != 0) fail("expected '=>'", i);
+            size_t bodyStart = i + 2;
+            size_t b = skip_ws_comments(in, bodyStart);
+            size_t bodyEnd;
+            if (in[b] == '{') {
+                bodyEnd = find_matching(in, b);
+                if (bodyEnd == string::npos || bodyEnd > bclose) fail("unbalanced arm body", b);
+                ++bodyEnd;
+                size_t after = skip_ws_comments(in, bodyEnd);
+                i = (after < bclose && (in[after] == ';' || in[after] == ',')) ? after + 1 : bodyEnd;
+            }
+            else {
+                bodyEnd = find_stmt_end(in, b);
+                if (bodyEnd == string::npos || bodyEnd > bclose) fail("arm statement must end with ';'", b);
+                ++bodyEnd;
+                i = bodyEnd;
+            }
+            int idx = static_cast<int>(arms.size());
+            arms.push_back({ in.substr(bodyStart, bodyEnd - bodyStart), newlines_in(in, start, bodyStart) });
+            if (wildcard) {
+                if (defaultArm >= 0) fail("more than one '_' arm", start);
+                defaultArm = idx;
+            }
+            for (auto& pt : pats) {
+                string bytes;
+                if (!decode_c_string(pt.first, bytes)) fail("unsupported escape in " + pt.first, pt.second);
+                for (size_t k = 0; k < keys.size(); ++k)
+                    if (keys[k] == bytes) fail("duplicate case " + pt.first, pt.second);
+                keys.push_back(bytes); lits.push_back(pt.first); keyArm.push_back(idx);
+            }
+        }
+        if (defaultArm < 0) fail("non-exhaustive string switch, add a '_' arm", at);
+        if (keys.empty()) fail("needs at least one string case", at);
+
+        PerfectHash ph = build_perfect_hash(keys);
+        const string id = std::to_string(counter++);
+        const string T = "cs__sw" + id, S = "cs__sw_s" + id, N = "cs__sw_n" + id, H = "cs__sw_h" + id, A = "cs__sw_arm" + id;
+        if (keys.size() >= 65535) fail("too many cases", at);
+        std::ostringstream o;
+        o << "{ const char* " << S << " = (const char*)(" << trim(subj[0]) << "); size_t " << N << " = "
+            << (subj.size() == 2 ? "(size_t)(" + trim(subj[1]) + ")" : "strlen(" + S + ")") << "; int " << A << " = " << defaultArm << "; "
+            << "static const struct { size_t len; int arm; const char* key; } " << T << "[" << keys.size() << "] = {";
+        for (size_t k = 0; k < keys.size(); ++k) o << " {" << keys[k].size() << ", " << keyArm[k] << ", " << lits[k] << "},";
+        o << " }; " << ph_emit_lookup(ph, keys.size(), T, S, N, H, A + " = " + T + "[e - 1].arm;");
+        o << "switch (" << A << ") {";
+        for (size_t k = 0; k < arms.size(); ++k) {
+            o << arms[k].gap << " case " << k << ": {" << lower_string_switch(arms[k].body, counter) << " } break;";
+        }
+        o << newlines_in(in, i, bclose) << " } }";
+
+        append_prefix(out, in, last, m);
+        out += o.str();
+        pos = last = bclose + 1;
+    }
+    out.append(in, last, string::npos);
+    return out;
+}
+
+//============================= spawn / join / parallel_for =============================
+// spawn worker(arg)                  -> cs_spawn((cs_task_fn)(worker), (void*)(arg))
+// join t                             -> cs_join(t)
+// parallel_for (lo .. hi[, grain]) kernel(ctx);
+//                                    -> cs_parallel_for(lo, hi, grain, kernel, ctx);
+// Any of these pulls the task runtime into the prelude. Words inside string or
+// character literals and comments are left alone.
+static string lower_spawn_join(const string& in, Config& cfg) {
+    using namespace cs_regex_wrap;
+    string s = in;
+    bool used = false;
+
+    {
+        std::regex r(R"(\bparallel_for\s*\()");
+        cmatch m;
+        size_t pos = 0, last = 0;
+        string rebuilt;
+        vector<bool> code = code_mask(s);
+        while (search_from(s, pos, m, r)) {
+            const size_t at = prefix_end_abs(s, m);
+            if (!code[at]) continue;
+            auto fail = [&](const string& why) {
+                auto lc = line_col_at(s, at);
+                return CompilerError("parallel_for: " + why, lc.first, lc.second);
+                };
+            size_t close = find_matching(s, pos - 1);
+            if (close == string::npos) throw fail("unbalanced parentheses");
+            vector<string> hdr = split_top_level(s.substr(pos, close - pos), ",");
+            vector<string> range = split_top_level(hdr[0], "..");
+            if (range.size() != 2 || hdr.size() > 2) throw fail("expected (lo .. hi[, grain])");
+
+            size_t k = close + 1;
+            while (k < s.size() && isspace((unsigned char)s[k])) ++k;
+            size_t kb = k;
+            while (k < s.size() && (isalnum((unsigned char)s[k]) || s[k] == '_')) ++k;
+            string kernel = s.substr(kb, k - kb);
+            while (k < s.size() && isspace((unsigned char)s[k])) ++k;
+            if (kernel.empty() || k >= s.size() || s[k] != '(') throw fail("expected kernel(ctx) after the range");
+            size_t kclose = find_matching(s, k);
+            if (kclose == string::npos) throw fail("unbalanced kernel call");
+            string ctx = trim(s.substr(k + 1, kclose - k - 1));
+            size_t semi = kclose + 1;
+            while (semi < s.size() && isspace((unsigned char)s[semi])) ++semi;
+            if (semi >= s.size() || s[semi] != ';') throw fail("expected ';' after kernel call");
+
+            append_prefix(rebuilt, s, last, m);
+            string grain = hdr.size() == 2 ? trim(hdr[1]) : "0";
+            rebuilt += "cs_parallel_for((long)(" + trim(range[0]) + "), (long)(" + trim(range[1]) + "), (long)(" + grain + "), "
+                + kernel + ", (void*)(" + (ctx.empty() ? "NULL" : ctx) + "));";
+            pos = last = semi + 1;
+            used = true;
+        }
+        rebuilt.append(s, last, string::npos);
+        s.swap(rebuilt);
+    }
+
+    {
+        std::regex r(R"(\bspawn\s+([A-Za-z_]\w*)\s*\()");
+        cmatch m;
+        size_t pos = 0, last = 0;
+        string rebuilt;
+        vector<bool> code = code_mask(s);
+        while (search_from(s, pos, m, r)) {
+            const size_t at = prefix_end_abs(s, m);
+            if (!code[at]) continue;
+            size_t close = find_matching(s, pos - 1);
+            auto fail = [&](const string& msg) { auto lc = line_col_at(s, at); return CompilerError(msg, lc.first, lc.second); };
+            if (close == string::npos) throw fail("spawn: unbalanced parentheses");
+            string arg = trim(s.substr(pos, close - pos));
+            if (split_top_level(arg, ",").size() > 1)
+                throw fail("spawn takes a single pointer argument: spawn " + m[1].str() + "(arg)");
+            append_prefix(rebuilt, s, last, m);
+            rebuilt += "cs_spawn((cs_task_fn)(" + m[1].str() + "), (void*)(" + (arg.empty() ? "NULL" : arg) + "))";
+            pos = last = close + 1;
+            used = true;
+        }
+        rebuilt.append(s, last, string::npos);
+        s.swap(rebuilt);
+    }
+
+    {
+        std::regex r(R"(\bjoin\s+([A-Za-z_]\w*(?:(?:\.|->)[A-Za-z_]\w*|\[[^\]]*\])*))");
+        cmatch m;
+        size_t pos = 0, last = 0;
+        string rebuilt;
+        vector<bool> code = code_mask(s);
+        while (search_from(s, pos, m, r)) {
+            if (!code[prefix_end_abs(s, m)]) continue;
+            append_prefix(rebuilt, s, last, m);
+            last = pos;
+            rebuilt += "cs_join(" + m[1].str() + ")";
+            used = true;
+        }
+        rebuilt.append(s, last, string::npos);
+        s.swap(rebuilt);
+    }
+
+    if (used) cfg.modules.insert("threads");
+    return s;
+}
+
+//============================= chan[T] monomorphization =============================
+// One concrete ring per (element type, mode). The SPSC ring keeps producer and
+// consumer indices on separate cache lines with a cached copy of the other
+// side's index, so the fast path touches no shared line. The MPMC ring is
+// Vyukov's bounded queue (per-slot sequence numbers, one CAS per claim).
+// send_n/recv_n claim a whole run of slots with one index update.
+static string emit_chan_instance(const string& C, const string& T, const string& mode) {
+    std::ostringstream o;
+    o << "\n// chan[" << T << "] (" << mode << ")\n";
+    if (mode == "spsc") {
+        o << "typedef struct " << C << " {\n"
+            << "    _Alignas(CS_CHAN_LINE) atomic_size_t head; size_t tail_cache;\n"
+            << "    _Alignas(CS_CHAN_LINE) atomic_size_t tail; size_t head_cache;\n"
+            << "    _Alignas(CS_CHAN_LINE) size_t mask; " << T << "* buf;\n"
+            << "} " << C << ";\n"
+            << "static inline int " << C << "_init(" << C << "* c, size_t capacity){ size_t cap = cs__chan_pow2(capacity); "
+            << "c->buf = (" << T << "*)malloc(cap * sizeof(" << T << ")); if(!c->buf) return -1; c->mask = cap - 1; "
+            << "atomic_init(&c->head, 0); atomic_init(&c->tail, 0); c->head_cache = c->tail_cache = 0; return 0; }\n"
+            << "static inline void " << C << "_destroy(" << C << "* c){ free(c->buf); c->buf = NULL; }\n"
+            << "static inline size_t " << C << "_send_n(" << C << "* c, const " << T << "* v, size_t n){\n"
+            << "    size_t t = atomic_load_explicit(&c->tail, memory_order_relaxed);\n"
+            << "    size_t room = c->mask + 1 - (t - c->head_cache);\n"
+            << "    if (room < n) { c->head_cache = atomic_load_explicit(&c->head, memory_order_acquire); room = c->mask + 1 - (t - c->head_cache); }\n"
+            << "    if (n > room) n = room;\n"
+            << "    for (size_t i = 0; i < n; ++i) c->buf[(t + i) & c->mask] = v[i];\n"
+            << "    if (n) atomic_store_explicit(&c->tail, t + n, memory_order_release);\n"
+            << "    return n;\n"
+            << "}\n"
+            << "static inline size_t " << C << "_recv_n(" << C << "* c, " << T << "* out, size_t n){\n"
+            << "    size_t h = atomic_load_explicit(&c->head, memory_order_relaxed);\n"
+            << "    size_t avail = c->tail_cache - h;\n"
+            << "    if (avail < n) { c->tail_cache = atomic_load_explicit(&c->tail, memory_order_acquire); avail = c->tail_cache - h; }\n"
+            << "    if (n > avail) n = avail;\n"
+            << "    for (size_t i = 0; i < n; ++i) out[i] = c->buf[(h + i) & c->mask];\n"
+            << "    if (n) atomic_store_explicit(&c->head, h + n, memory_order_release);\n"
+            << "    return n;\n"
+            << "}\n";
+    }
+    else {
+        o << "typedef struct " << C << "_cell { atomic_size_t seq; " << T << " data; } " << C << "_cell;\n"
+            << "typedef struct " << C << " {\n"
+            << "    _Alignas(CS_CHAN_LINE) atomic_size_t enq;\n"
+            << "    _Alignas(CS_CHAN_LINE) atomic_size_t deq;\n"
+            << "    _Alignas(CS_CHAN_LINE) size_t mask; " << C << "_cell* buf;\n"
+            << "} " << C << ";\n"
+            << "static inline int " << C << "_init(" << C << "* c, size_t capacity){ size_t cap = cs__chan_pow2(capacity); "
+            << "c->buf = (" << C << "_cell*)malloc(cap * sizeof(" << C << "_cell)); if(!c->buf) return -1; c->mask = cap - 1; "
+            << "for (size_t i = 0; i < cap; ++i) atomic_init(&c->buf[i].seq, i); "
+            << "atomic_init(&c->enq, 0); atomic_init(&c->deq, 0); return 0; }\n"
+            << "static inline void " << C << "_destroy(" << C << "* c){ free(c->buf); c->buf = NULL; }\n"
+            << "static inline size_t " << C << "_send_n(" << C << "* c, const " << T << "* v, size_t n){\n"
+            << "    size_t pos = atomic_load_explicit(&c->enq, memory_order_relaxed);\n"
+            << "    for (;;) {\n"
+            << "        size_t k = 0;\n"
+            << "        while (k < n && k <= c->mask && atomic_load_explicit(&c->buf[(pos + k) & c->mask].seq, memory_order_acquire) == pos + k) ++k;\n"
+            << "        if (k == 0) {\n"
+            << "            size_t seq = atomic_load_explicit(&c->buf[pos & c->mask].seq, memory_order_acquire);\n"
+            << "            if ((ptrdiff_t)(seq - pos) < 0) return 0;\n"
+            << "            pos = atomic_load_explicit(&c->enq, memory_order_relaxed); continue;\n"
+            << "        }\n"
+            << "        if (atomic_compare_exchange_weak_explicit(&c->enq, &pos, pos + k, memory_order_relaxed, memory_order_relaxed)) {\n"
+            << "            for (size_t i = 0; i < k; ++i) { " << C << "_cell* cell = &c->buf[(pos + i) & c->mask]; cell->data = v[i]; atomic_store_explicit(&cell->seq, pos + i + 1, memory_order_release); }\n"
+            << "            return k;\n"
+            << "        }\n"
+            << "    }\n"
+            << "}\n"
+            << "static inline size_t " << C << "_recv_n(" << C << "* c, " << T << "* out, size_t n){\n"
+            << "    size_t pos = atomic_load_explicit(&c->deq, memory_order_relaxed);\n"
+            << "    for (;;) {\n"
+            << "        size_t k = 0;\n"
+            << "        while (k < n && k <= c->mask && atomic_load_explicit(&c->buf[(pos + k) & c->mask].seq, memory_order_acquire) == pos + k + 1) ++k;\n"
+            << "        if (k == 0) {\n"
+            << "            size_t seq = atomic_load_explicit(&c->buf[pos & c->mask].seq, memory_order_acquire);\n"
+            << "            if ((ptrdiff_t)(seq - (pos + 1)) < 0) return 0;\n"
+            << "            pos = atomic_load_explicit(&c->deq, memory_order_relaxed); continue;\n"
+            << "        }\n"
+            << "        if (atomic_compare_exchange_weak_explicit(&c->deq, &pos, pos + k, memory_order_relaxed, memory_order_relaxed)) {\n"
+            << "            for (size_t i = 0; i < k; ++i) { " << C << "_cell* cell = &c->buf[(pos + i) & c->mask]; out[i] = cell->data; atomic_store_explicit(&cell->seq, pos + i + c->mask + 1, memory_order_release); }\n"
+            << "            return k;\n"
+            << "        }\n"
+            << "    }\n"
+            << "}\n";
+    }
+    // Single-item and blocking forms are thin wrappers over the batch path.
+    o << "static inline int " << C << "_try_send(" << C << "* c, " << T << " v){ return " << C << "_send_n(c, &v, 1) == 1; }\n"
+        << "static inline int " << C << "_try_recv(" << C << "* c, " << T << "* out){ return " << C << "_recv_n(c, out, 1) == 1; }\n"
+        << "static inline void " << C << "_send(" << C << "* c, " << T << " v){ unsigned spins = 0; while (!" << C << "_try_send(c, v)) cs__chan_backoff(&spins); }\n"
+        << "static inline " << T << " " << C << "_recv(" << C << "* c){ " << T << " v; unsigned spins = 0; while (!" << C << "_try_recv(c, &v)) cs__chan_backoff(&spins); return v; }\n";
+    return o.str();
+}
+
+// chan[T] / chan[T, spsc|mpmc] -> cs_chan_<T> / cs_chan_<mode>_<T>; the
+// unqualified form uses the file's @chan mode. Each instance is declared once,
+// at file scope just ahead of the declaration that first mentions it. Text in
+// literals and comments is left alone.
+static string lower_chan_types(const string& in, Config& cfg) {
+    using namespace cs_regex_wrap;
+    std::regex r(R"(\bchan\s*\[)");
+    cmatch m;
+    size_t pos = 0, last = 0;
+    string s;
+    s.reserve(in.size());
+
+    struct Inst { string elem, mode; size_t first_use; };
+    map<string, Inst> insts;
+    vector<bool> code = code_mask(in);
+    while (search_from(in, pos, m, r)) {
+        size_t at = prefix_end_abs(in, m);
+        if (!code[at]) continue;
+        size_t close = find_matching(in, pos - 1);
+        if (close == string::npos) {
+            auto lc = line_col_at(in, at);
+            throw CompilerError("chan[: missing ']'", lc.first, lc.second);
+        }
+        vector<string> parts = split_top_level(in.substr(pos, close - pos), ",");
+        string elem = trim(parts[0]);
+        string mode = parts.size() > 1 ? trim(parts[1]) : cfg.chan_mode;
+        if (elem.empty() || parts.size() > 2 || (mode != "spsc" && mode != "mpmc")) {
+            auto lc = line_col_at(in, at);
+            throw CompilerError("expected chan[T] or chan[T, spsc|mpmc]", lc.first, lc.second);
+        }
+        string C = parts.size() > 1 ? "cs_chan_" + mode + "_" + mangle_type(elem) : "cs_chan_" + mangle_type(elem);
+
+        append_prefix(s, in, last, m);
+        if (!insts.count(C)) insts[C] = Inst{ elem, mode, s.size() };
+        s += C;
+        pos = last = close + 1;
+    }
+    s.append(in, last, string::npos);
+    if (insts.empty()) return s;
+
+    cfg.modules.insert("chan");
+    vector<pair<size_t, string>> decls;
+    for (auto& kv : insts)
+        decls.push_back({ toplevel_insert_point(s, kv.second.first_use), emit_chan_instance(kv.first, kv.second.elem, kv.second.mode) });
+    insert_generated(s, std::move(decls));
+    return s;
+}
+
+//============================= view[T] =============================
+// view[T] -> cs_view_<T>, a plain { T* ptr; size_t len; } pair with a _of()
+// constructor. Declared once per element type, ahead of its first use; text in
+// literals and comments is left alone.
+static string lower_view_types(const string& in) {
+    using namespace cs_regex_wrap;
+    std::regex r(R"(\bview\s*\[)");
+    cmatch m;
+    size_t pos = 0, last = 0;
+    string s;
+    s.reserve(in.size());
+
+    map<string, pair<string, size_t>> insts;   // name -> (elem, first use)
+    vector<bool> code = code_mask(in);
+    while (search_from(in, pos, m, r)) {
+        size_t at = prefix_end_abs(in, m);
+        if (!code[at]) continue;
+        size_t close = find_matching(in, pos - 1);
+        string elem = close == string::npos ? "" : trim(in.substr(pos, close - pos));
+        if (elem.empty()) {
+            auto lc = line_col_at(in, at);
+            throw CompilerError("expected view[T]", lc.first, lc.second);
+        }
+        string V = "cs_view_" + mangle_type(elem);
+        append_prefix(s, in, last, m);
+        if (!insts.count(V)) insts[V] = { elem, s.size() };
+        s += V;
+        pos = last = close + 1;
+    }
+    s.append(in, last, string::npos);
+
+    vector<pair<size_t, string>> decls;
+    for (auto& kv : insts) {
+        const string& V = kv.first;
+        const string& T = kv.second.first;
+        decls.push_back({ toplevel_insert_point(s, kv.second.second),
+            "\ntypedef struct " + V + " { " + T + "* ptr; size_t len; } " + V + ";\n"
+            "static inline " + V + " " + V + "_of(" + T + "* p, size_t n){ " + V + " v = { p, n }; return v; }\n" });
+    }
+    insert_generated(s, std::move(decls));
+    return s;
+}
+
+//============================= fn parameter attributes =============================
+// fn f(@noalias float* a, @assume_aligned(64) const float* b, ...)
+//   @noalias / @restrict   -> pointer gets CS_RESTRICT (C99 restrict)
+//   @assume_aligned(N)     -> "b = CS_ASSUME_ALIGNED(b, N);" at the top of the body
+// Clang turns both into LLVM noalias / align assumptions, so the embedded
+// toolchain needs nothing extra.
+static string apply_param_attrs(const string& param, const string& at_src, size_t at, vector<string>& prologue) {
+    string p = trim(param);
+    bool restrict_ = false;
+    string align;
+    while (starts_with(p, "@")) {
+        size_t e = 1;
+        while (e < p.size() && (isalnum((unsigned char)p[e]) || p[e] == '_')) ++e;
+        string attr = p.substr(1, e - 1);
+        string arg;
+        size_t k = e;
+        while (k < p.size() && isspace((unsigned char)p[k])) ++k;
+        if (k < p.size() && p[k] == '(') {
+            size_t close = find_matching(p, k);
+            if (close == string::npos) { auto lc = line_col_at(at_src, at); throw CompilerError("@" + attr + ": missing ')'", lc.first, lc.second); }
+            arg = trim(p.substr(k + 1, close - k - 1));
+            e = close + 1;
+        }
+        if (attr == "noalias" || attr == "restrict") restrict_ = true;
+        else if (attr == "assume_aligned") {
+            unsigned long long n = arg.find_first_not_of("0123456789") == string::npos && !arg.empty() ? std::stoull(arg) : 0;
+            if (n == 0 || (n & (n - 1))) { auto lc = line_col_at(at_src, at); throw CompilerError("@assume_aligned expects a power-of-two byte count", lc.first, lc.second); }
+            align = arg;
+        }
+        else { auto lc = line_col_at(at_src, at); throw CompilerError("unknown parameter attribute @" + attr, lc.first, lc.second); }
+        p = trim(p.substr(e));
+    }
+
+    // Declarator name: last identifier, before any array suffix.
+    size_t bracket = p.find('[');
+    size_t end = bracket == string::npos ? p.size() : bracket;
+    while (end > 0 && isspace((unsigned char)p[end - 1])) --end;
+    size_t beg = end;
+    while (beg > 0 && (isalnum((unsigned char)p[beg - 1]) || p[beg - 1] == '_')) --beg;
+    string name = p.substr(beg, end - beg);
+    size_t star = p.rfind('*', beg);
+    bool pointer = (star != string::npos) || bracket != string::npos;
+    if ((restrict_ || !align.empty()) && (!pointer || name.empty())) {
+        auto lc = line_col_at(at_src, at);
+        throw CompilerError("pointer attribute on non-pointer parameter '" + p + "'", lc.first, lc.second);
+    }
+    if (restrict_) {
+        if (bracket != string::npos) p.insert(bracket + 1, "CS_RESTRICT ");
+        else p.insert(star + 1, " CS_RESTRICT");
+    }
+    if (!align.empty()) prologue.push_back(name + " = CS_ASSUME_ALIGNED(" + name + ", " + align + ")");
+    return p;
+}
+
+static string lower_param_attrs(const string& s) {
+    using namespace cs_regex_wrap;
+    std::regex r(R"(\bfn\s+[A-Za-z_]\w*\s*\()");
+    cmatch m;
+    size_t pos = 0, last = 0;
+    string out;
+    out.reserve(s.size());
+    while (search_from(s, pos, m, r)) {
+        size_t open = pos - 1;
+        size_t close = find_matching(s, open);
+        if (close == string::npos) continue;
+        string params = s.substr(open + 1, close - open - 1);
+        if (params.find('@') == string::npos) continue;
+
+        size_t at = prefix_end_abs(s, m);
+        vector<string> prologue;
+        string cleaned;
+        for (auto& prm : split_top_level(params, ",")) {
+            if (!cleaned.empty()) cleaned += ", ";
+            cleaned += apply_param_attrs(prm, s, at, prologue);
+        }
+        append_prefix(out, s, last, m);
+        out.append(s, prefix_end_abs(s, m), open + 1 - prefix_end_abs(s, m));
+        out += cleaned;
+        last = pos = close;
+        if (prologue.empty()) continue;
+
+        // Attach the prologue to the body: after '{', or folded into a '=>' expression.
+        size_t brace = s.find('{', close), arrow = s.find("=>", close);
+        if (arrow != string::npos && (brace == string::npos || arrow < brace)) {
+            size_t semi = s.find(';', arrow);
+            if (semi == string::npos) continue;
+            out.append(s, close, arrow + 2 - close);
+            out += " (";
+            for (auto& st : prologue) out += st + ", ";
+            out += "(" + trim(s.substr(arrow + 2, semi - arrow - 2)) + "))";
+            last = pos = semi;
+        }
+        else if (brace != string::npos) {
+            out.append(s, close, brace + 1 - close);
+            for (auto& st : prologue) out += " " + st + ";";
+            last = pos = brace + 1;
+        }
+    }
+    out.append(s, last, string::npos);
+    return out;
+}
+
+//============================= Result(T) =============================
+// Result(T) -> Result_<T> { T value; const char* error; }, declared once per
+// payload type ahead of its first use, with _ok/_err/_unwrap helpers. Inside a
+// function returning Result(T), `return Ok(x)` / `return Err(m)` get the
+// concrete type and try(expr) yields expr's value or returns its error. None
+// of this applies to text in literals or comments.
+static string emit_result_instance(const string& R, const string& T) {
+    std::ostringstream o;
+    o << "\ntypedef struct " << R << " { " << T << " value; const char* error; } " << R << ";\n"
+        << "static inline " << R << " " << R << "_ok(" << T << " v){ " << R << " r; memset(&r, 0, sizeof r); r.value = v; return r; }\n"
+        << "static inline " << R << " " << R << "_err(const char* e){ " << R << " r; memset(&r, 0, sizeof r); r.error = e ? e : \"error\"; return r; }\n"
+        << "static inline " << T << " " << R << "_unwrap(" << R << " r){ if (unlikely(r.error != NULL)) cs__result_fail(r.error); return r.value; }\n";
+    return o.str();
+}
+
+static string lower_result_types(const string& in) {
+    using namespace cs_regex_wrap;
+    std::regex r(R"(\bResult\s*\()");
+    cmatch m;
+    size_t pos = 0, last = 0;
+    string s;
+    s.reserve(in.size());
+    map<string, string> insts;   // Result_<T> -> T
+    vector<bool> code = code_mask(in);
+    while (search_from(in, pos, m, r)) {
+        size_t at = prefix_end_abs(in, m);
+        if (!code[at]) continue;
+        size_t close = find_matching(in, pos - 1);
+        string T = close == string::npos ? "" : trim(in.substr(pos, close - pos));
+        if (T.empty() || T == "void") {
+            auto lc = line_col_at(in, at);
+            throw CompilerError("expected Result(T) with a non-void payload type", lc.first, lc.second);
+        }
+        string R = "Result_" + mangle_type(T);
+        append_prefix(s, in, last, m);
+        insts[R] = T;
+        s += R;
+        pos = last = close + 1;
+    }
+    s.append(in, last, string::npos);
+
+    // Bodies of functions returning a Result: type their Ok/Err returns and try().
+    std::regex hdr(R"((?:->\s*(Result_\w+)\s*(\{|=>))|(?:\b(Result_\w+)\s+[A-Za-z_]\w*\s*\([^;{)]*\)\s*\{))");
+    std::regex retRe(R"(\breturn\s+(Ok|Err)\s*\()");
+    std::regex tryRe(R"(\btry\s*\()");
+    vector<pair<size_t, size_t>> bodies;   // [open, close] of Result-returning bodies
+    string out;
+    pos = last = 0;
+    code = code_mask(s);
+    while (search_from(s, pos, m, hdr)) {
+        if (!code[prefix_end_abs(s, m)]) continue;
+        string R = m[1].matched ? m[1].str() : m[3].str();
+        append_prefix(out, s, last, m);
+        size_t bodyStart = pos, bodyEnd;
+        if (m[2].matched && m[2].str() == "=>") {
+            bodyEnd = s.find(';', pos);
+            if (bodyEnd == string::npos) bodyEnd = s.size();
+        }
+        else {
+            bodyEnd = find_matching(s, pos - 1);
+            if (bodyEnd == string::npos) bodyEnd = s.size();
+        }
+        out.append(s, prefix_end_abs(s, m), pos - prefix_end_abs(s, m));
+        string body = s.substr(bodyStart, bodyEnd - bodyStart);
+        if (m[2].matched && m[2].str() == "=>") {
+            string e = trim(body);
+            if (starts_with(e, "Ok(") || starts_with(e, "Err(")) body = " (" + R + ")" + e;
+        }
+        body = regex_replace_code(body, retRe, "return (" + R + ")$1(");
+        body = regex_replace_code(body, tryRe, "CS_TRY(" + R + ", ");
+        bodies.push_back({ out.size(), out.size() + body.size() });
+        out += body;
+        pos = last = bodyEnd;
+    }
+    out.append(s, last, string::npos);
+
+    // try() anywhere else has no Result to propagate into.
+    pos = 0;
+    code = code_mask(out);
+    while (search_from(out, pos, m, tryRe)) {
+        size_t at = prefix_end_abs(out, m);
+        if (!code[at]) continue;
+        bool inside = false;
+        for (auto& b : bodies) if (at >= b.first && at < b.second) inside = true;
+        if (!inside) {
+            auto lc = line_col_at(out, at);
+            throw CompilerError("try() is only valid inside a function returning Result(T)", lc.first, lc.second);
+        }
+    }
+    if (insts.empty()) return out;
+
+    vector<pair<size_t, string>> decls;
+    for (auto& kv : insts) {
+        size_t first = out.find(kv.first);   // offsets moved while typing bodies; find the first whole-word mention
+        while (first != string::npos && first + kv.first.size() < out.size() &&
+            (isalnum((unsigned char)out[first + kv.first.size()]) || out[first + kv.first.size()] == '_'))
+            first = out.find(kv.first, first + 1);
+        decls.push_back({ toplevel_insert_point(out, first), emit_result_instance(kv.first, kv.second) });
+    }
+    insert_generated(out, std::move(decls));
+    return out;
+}
+
+// File-scope function definitions in (lowered) source: `header` is where the
+// declaration text starts, `open`/`close` are the body braces. Brace pairs
+// that follow no parameter list (structs, initializers) are skipped.
+struct FnBody {
+    string name;
+    size_t header, open, close;
+};
+
+static vector<FnBody> toplevel_function_bodies(const string& in) {
+    vector<FnBody> fns;
+    size_t hdr = 0;
+    for (size_t i = 0; i < in.size();) {
+        char c = in[i];
+        if (c == '"' || c == '\'') {
+            for (++i; i < in.size() && in[i] != c; ++i) if (in[i] == '\\') ++i;
+            ++i;
+            continue;
+        }
+        size_t bol = i;
+        while (bol > 0 && (in[bol - 1] == ' ' || in[bol - 1] == '\t')) --bol;
+        if (in.compare(i, 2, "//") == 0 || in.compare(i, 2, "/*") == 0 || (c == '#' && (bol == 0 || in[bol - 1] == '\n'))) {
+            size_t j = c == '#' ? in.find('\n', i) : skip_ws_comments(in, i);
+            while (c == '#' && j != string::npos && j > 0 && in[j - 1] == '\\') j = in.find('\n', j + 1);
+            i = hdr = (j == string::npos ? in.size() : j);
+            continue;
+        }
+        if (c == ';' || c == '}') { hdr = ++i; continue; }
+        if (c != '{') { ++i; continue; }
+
+        size_t close = find_matching(in, i);
+        if (close == string::npos) break;
+        string header = in.substr(hdr, i - hdr);
+        size_t lastSig = header.find_last_not_of(" \t\r\n");
+        // The name precedes the parameter list: the last top-level (...) before
+        // the body or a softline '->', so attributes in front don't confuse it.
+        size_t paren = string::npos;
+        {
+            size_t arrow = header.find("->");
+            size_t pclose = header.find_last_of(')', arrow == string::npos ? string::npos : arrow);
+            for (int depth = 0; pclose != string::npos; --pclose) {
+                if (header[pclose] == ')') depth++;
+                else if (header[pclose] == '(' && --depth == 0) { paren = pclose; break; }
+                if (pclose == 0) break;
+            }
+        }
+        bool isFn = paren != string::npos && lastSig != string::npos &&
+            (header[lastSig] == ')' || header.find("->") != string::npos) && header.find('=') == string::npos;
+        if (isFn) {
+            size_t e = header.find_last_not_of(" \t\r\n", paren == 0 ? 0 : paren - 1);
+            size_t b = e;
+            while (b != string::npos && b > 0 && (isalnum((unsigned char)header[b - 1]) || header[b - 1] == '_')) --b;
+            string name = e == string::npos ? "" : header.substr(b, e + 1 - b);
+            fns.push_back({ name, hdr + header.find_first_not_of(" \t\r\n"), i, close });
+        }
+        i = hdr = close + 1;
+    }
+    return fns;
+}
+
+//============================= defer =============================
+// defer { ... }  /  defer stmt;
+// Registers cleanup for the enclosing block. The bodies are copied, in reverse
+// registration order, onto every exit path of that block: the closing brace,
+// each `return` (the value is computed into a temporary first, so it may still
+// use the resources being released), and each `break`/`continue` that leaves
+// the block. Copies are flattened onto one line to keep the .csc line numbers.
+// `goto` past a live defer is rejected, since its target scope is unknown, and
+// so is a defer directly under a case label (give the case its own block).
+struct DeferScope {
+    enum Kind { Block, Loop, Switch, Function } kind;
+    vector<string> bodies;   // registration order
+};
+
+struct DeferCtx {
+    const string& s;
+    vector<DeferScope> st;
+    string retType;          // "" when the header couldn't be read
+    int temps = 0;
+};
+
+static size_t defer_stmt_end(const string& s, size_t i);
+
+static string flatten_code(const string& body) {
+    string o;
+    for (size_t i = 0; i < body.size(); ++i) {
+        char c = body[i];
+        if (c == '"' || c == '\'') {
+            size_t j = i;
+            for (++j; j < body.size() && body[j] != c; ++j) if (body[j] == '\\') ++j;
+            o.append(body, i, j + 1 - i);
+            i = j;
+        }
+        else if (body.compare(i, 2, "//") == 0) { i = body.find('\n', i); if (i == string::npos) break; o += ' '; }
+        else if (body.compare(i, 2, "/*") == 0) { size_t e = body.find("*/", i + 2); if (e == string::npos) break; i = e + 1; o += ' '; }
+        else o += (c == '\n' || c == '\r') ? ' ' : c;
+    }
+    return trim(o);
+}
+
+// Cleanup code for leaving every scope from the innermost out to st[upto].
+static string defer_cleanup(const DeferCtx& ctx, size_t upto) {
+    string o;
+    for (size_t k = ctx.st.size(); k-- > upto;) {
+        const auto& b = ctx.st[k].bodies;
+        for (size_t j = b.size(); j-- > 0;) o += " " + b[j];
+    }
+    return o;
+}
+
+// End (one past) of the statement starting at i, following if/else, loops and
+// blocks without braces.
+static size_t defer_stmt_end(const string& s, size_t i) {
+    i = skip_ws_comments(s, i);
+    if (i >= s.size()) return i;
+    if (s[i] == '{') { size_t e = find_matching(s, i); return e == string::npos ? s.size() : e + 1; }
+    size_t j = i;
+    while (j < s.size() && (isalnum((unsigned char)s[j]) || s[j] == '_')) ++j;
+    string w = s.substr(i, j - i);
+    auto after_parens = [&](size_t p) {
+        p = skip_ws_comments(s, p);
+        if (p < s.size() && s[p] == '(') { size_t e = find_matching(s, p); return e == string::npos ? s.size() : e + 1; }
+        return p;
+    };
+    if (w == "if") {
+        size_t e = defer_stmt_end(s, after_parens(j));
+        size_t k = skip_ws_comments(s, e);
+        if (s.compare(k, 4, "else") == 0 && (k + 4 >= s.size() || !(isalnum((unsigned char)s[k + 4]) || s[k + 4] == '_')))
+            return defer_stmt_end(s, k + 4);
+        return e;
+    }
+    if (w == "for" || w == "while" || w == "switch") return defer_stmt_end(s, after_parens(j));
+    if (w == "do") {
+        size_t e = skip_ws_comments(s, defer_stmt_end(s, j));
+        if (s.compare(e, 5, "while") == 0) e = after_parens(e + 5);
+        size_t semi = find_stmt_end(s, e);
+        return semi == string::npos ? s.size() : semi + 1;
+    }
+    size_t semi = find_stmt_end(s, i);
+    return semi == string::npos ? s.size() : semi + 1;
+}
+
+static void lower_defer_range(DeferCtx& ctx, size_t a, size_t b, string& out);
+
+static void lower_defer_scope(DeferCtx& ctx, size_t open, size_t close, DeferScope::Kind kind, string& out) {
+    ctx.st.push_back({ kind, {} });
+    out += '{';
+    lower_defer_range(ctx, open + 1, close, out);
+    string tail = defer_cleanup(ctx, ctx.st.size() - 1);
+    if (!tail.empty()) out += tail + " ";
+    out += '}';
+    ctx.st.pop_back();
+}
+
+// Body of a loop/switch: a block, or a single statement that still bounds break/continue.
+static size_t lower_defer_body(DeferCtx& ctx, size_t i, DeferScope::Kind kind, string& out) {
+    size_t b = skip_ws_comments(ctx.s, i);
+    out.append(ctx.s, i, b - i);
+    if (b < ctx.s.size() && ctx.s[b] == '{') {
+        size_t e = find_matching(ctx.s, b);
+        if (e == string::npos) return ctx.s.size();
+        lower_defer_scope(ctx, b, e, kind, out);
+        return e + 1;
+    }
+    size_t e = defer_stmt_end(ctx.s, b);
+    ctx.st.push_back({ kind, {} });
+    lower_defer_range(ctx, b, e, out);
+    ctx.st.pop_back();
+    return e;
+}
+
+static void lower_defer_range(DeferCtx& ctx, size_t a, size_t b, string& out) {
+    const string& s = ctx.s;
+    size_t i = a;
+    while (i < b) {
+        char c = s[i];
+        if (c == '"' || c == '\'') {
+            size_t j = i;
+            for (++j; j < b && s[j] != c; ++j) if (s[j] == '\\') ++j;
+            out.append(s, i, j + 1 - i);
+            i = j + 1;
+            continue;
+        }
+        if (s.compare(i, 2, "//") == 0 || s.compare(i, 2, "/*") == 0) {
+            size_t j = std::min(skip_ws_comments(s, i), b);
+            out.append(s, i, j - i);
+            i = j;
+            continue;
+        }
+        if (c == '{') {
+            size_t e = find_matching(s, i);
+            if (e == string::npos || e >= b) { out.append(s, i, b - i); return; }
+            lower_defer_scope(ctx, i, e, DeferScope::Block, out);
+            i = e + 1;
+            continue;
+        }
+        if (!(isalpha((unsigned char)c) || c == '_') || (i > 0 && (isalnum((unsigned char)s[i - 1]) || s[i - 1] == '_'))) {
+            out += c; ++i;
+            continue;
+        }
+        size_t j = i;
+        while (j < b && (isalnum((unsigned char)s[j]) || s[j] == '_')) ++j;
+        string w = s.substr(i, j - i);
+        auto fail = [&](const string& msg) { auto lc = line_col_at(s, i); return CompilerError(msg, lc.first, lc.second); };
+
+        if (w == "defer") {
+            size_t p = i;
+            while (p > 0 && isspace((unsigned char)s[p - 1])) --p;
+            if (p > 0 && s[p - 1] != ';' && s[p - 1] != '{' && s[p - 1] != '}' && s[p - 1] != ':')
+                throw fail("defer must be a statement of its own inside a block");
+            // A case label isn't a scope: cases fall through and share the
+            // switch body, so the cleanup would run on other cases' exits too.
+            if (ctx.st.back().kind == DeferScope::Switch)
+                throw fail("defer under a case label needs its own block: case X: { defer ...; }");
+            size_t q = skip_ws_comments(s, j);
+            size_t e;
+            string body;
+            if (q < b && s[q] == '{') {
+                e = find_matching(s, q);
+                if (e == string::npos || e >= b) throw fail("defer block is missing its closing '}'");
+                body = s.substr(q, e + 1 - q);
+                ++e;
+            }
+            else {
+                size_t semi = find_stmt_end(s, q);
+                if (semi == string::npos || semi >= b) throw fail("defer statement is missing its ';'");
+                body = s.substr(q, semi + 1 - q);
+                e = semi + 1;
+            }
+            std::regex exitRe(R"(\b(return|goto|break|continue|defer)\b)");
+            std::smatch em;
+            if (std::regex_search(body, em, exitRe))
+                throw fail("'" + em[1].str() + "' is not allowed inside a defer body");
+            ctx.st.back().bodies.push_back(flatten_code(body));
+            out += newlines_in(s, i, e);
+            i = e;
+        }
+        else if (w == "return") {
+            string cleanup = defer_cleanup(ctx, 0);
+            size_t semi = find_stmt_end(s, j);
+            if (cleanup.empty() || semi == string::npos || semi >= b) { out += w; i = j; continue; }
+            string expr = trim(s.substr(j, semi - j));
+            string nl = newlines_in(s, j, semi);
+            if (expr.empty())
+                out += "{" + cleanup + " return; }";
+            else if (ctx.retType == "void")
+                out += "{ " + flatten_code(expr) + ";" + cleanup + " return; }";
+            else {
+                string t = "cs__ret" + std::to_string(ctx.temps++);
+                string ty = ctx.retType.empty() ? "__typeof__(" + flatten_code(expr) + ")" : ctx.retType;
+                out += "{ " + ty + " " + t + " = (" + flatten_code(expr) + ");" + cleanup + " return " + t + "; }";
+            }
+            out += nl;
+            i = semi + 1;
+        }
+        else if (w == "break" || w == "continue") {
+            size_t k = ctx.st.size();
+            while (k-- > 0) {
+                auto kd = ctx.st[k].kind;
+                if (kd == DeferScope::Loop || (kd == DeferScope::Switch && w == "break") || kd == DeferScope::Function) break;
+            }
+            string cleanup = ctx.st[k].kind == DeferScope::Function ? "" : defer_cleanup(ctx, k);
+            size_t semi = find_stmt_end(s, j);
+            if (cleanup.empty() || semi == string::npos || semi >= b) { out += w; i = j; continue; }
+            out += "{" + cleanup + " " + w + "; }";
+            out += newlines_in(s, j, semi);
+            i = semi + 1;
+        }
+        else if (w == "goto") {
+            if (!defer_cleanup(ctx, 0).empty())
+                throw fail("goto cannot leave a scope with pending defer blocks; use return or break");
+            out += w; i = j;
+        }
+        else if (w == "for" || w == "while" || w == "switch") {
+            size_t p = skip_ws_comments(s, j);
+            size_t e = (p < b && s[p] == '(') ? find_matching(s, p) : string::npos;
+            if (e == string::npos || e >= b) { out += w; i = j; continue; }
+            out.append(s, i, e + 1 - i);
+            i = lower_defer_body(ctx, e + 1, w == "switch" ? DeferScope::Switch : DeferScope::Loop, out);
+        }
+        else if (w == "do") {
+            out += w;
+            i = lower_defer_body(ctx, j, DeferScope::Loop, out);
+        }
+        else { out += w; i = j; }
+    }
+}
+
+// Return type from a function header: `fn f(a) -> T` or `static T f(a)`.
+static string defer_return_type(const string& header) {
+    string h = trim(header);
+    size_t paren = h.find('(');
+    size_t arrow = h.rfind("->");
+    if (arrow != string::npos && arrow > paren) return trim(h.substr(arrow + 2));
+    string before = trim(h.substr(0, paren));
+    size_t e = before.size();
+    while (e > 0 && (isalnum((unsigned char)before[e - 1]) || before[e - 1] == '_')) --e;
+    std::istringstream words(before.substr(0, e));
+    string w, ty;
+    while (words >> w)
+        if (w != "static" && w != "inline" && w != "extern" && w != "CS_HOT" && w != "CS_COLD")
+            ty += (ty.empty() ? "" : " ") + w;
+    if (ty.find('(') != string::npos || ty.find('#') != string::npos) return "";
+    return ty;
+}
+
+static string lower_defer(const string& in) {
+    using namespace cs_regex_wrap;
+    std::regex r(R"(\bdefer\b)");
+    cmatch m;
+    if (!search_iter(in.cbegin(), in.cend(), m, r)) return in;
+
+    string out;
+    out.reserve(in.size() + in.size() / 8);
+    size_t last = 0;
+    for (auto& f : toplevel_function_bodies(in)) {
+        out.append(in, last, f.open - last);
+        DeferCtx ctx{ in, {}, defer_return_type(in.substr(f.header, f.open - f.header)) };
+        lower_defer_scope(ctx, f.open, f.close, DeferScope::Function, out);
+        last = f.close + 1;
+    }
+    out.append(in, last, string::npos);
+    return out;
+}
+
+//============================= bench blocks =============================
+// bench name { body }   (file scope)
+//   -> static inline void cs__bench_name(uint64_t cs__iters) {
+//          for (uint64_t cs__it = 0; cs__it < cs__iters; ++cs__it) { body } }
+// The body is one iteration. Under `cscriptc bench` each function is registered
+// with the harness (CS_BENCH_REGISTER); ordinary builds still type-check the
+// blocks but never emit them. `continue` ends an iteration early; `return`
+// would end the whole timed batch, so it is rejected.
+static string lower_bench_blocks(const string& in, const Config& cfg) {
+    using namespace cs_regex_wrap;
+    std::regex r(R"((^|\n)[ \t]*bench\s+([A-Za-z_]\w*)\s*\{)");
+    cmatch m;
+    size_t pos = 0, last = 0;
+    string out;
+    set<string> seen;
+    out.reserve(in.size());
+    while (search_from(in, pos, m, r)) {
+        size_t at = prefix_end_abs(in, m) + static_cast<size_t>(m[1].length());
+        size_t close = find_matching(in, pos - 1);
+        auto fail = [&](const string& msg) { auto lc = line_col_at(in, at); return CompilerError(msg, lc.first, lc.second); };
+        if (close == string::npos) throw fail("bench block is missing its closing '}'");
+        string name = m[2].str();
+        if (!seen.insert(name).second) throw fail("duplicate bench '" + name + "'");
+        for (size_t i = skip_ws_comments(in, pos); i < close; i = skip_ws_comments(in, i)) {
+            char c = in[i];
+            if (c == '"' || c == '\'') { for (++i; i < close && in[i] != c; ++i) if (in[i] == '\\') ++i; ++i; continue; }
+            if (in.compare(i, 6, "return") == 0 && (i == 0 || !(isalnum((unsigned char)in[i - 1]) || in[i - 1] == '_')) &&
+                !(isalnum((unsigned char)in[i + 6]) || in[i + 6] == '_')) {
+                auto rl = line_col_at(in, i);
+                throw CompilerError("return inside bench '" + name + "' (use continue to end an iteration)", rl.first, rl.second);
+            }
+            ++i;
+        }
+
+        append_prefix(out, in, last, m);
+        out += m[1].str();
+        string fn = "static inline void cs__bench_" + name + "(uint64_t cs__iters)";
+        if (cfg.bench) out += fn + "; CS_BENCH_REGISTER(" + name + ") ";
+        out += fn + " { for (uint64_t cs__it = 0; cs__it < cs__iters; ++cs__it) {";
+        out.append(in, pos, close - pos);
+        out += "} }";
+        pos = last = close + 1;
+    }
+    out.append(in, last, string::npos);
+    return out;
+}
+
+//============================= @trace marks =============================
+// A bare `@trace` line marks the function defined next. With tracing on
+// (--trace-lib / @trace on) its body opens with CS_TRACE_SCOPE("name"); with
+// it off the mark is dropped. softline `fn`s are already traced wholesale by
+// softline_lower, so a mark on one adds nothing.
+static string lower_trace_marks(const string& in, const Config& cfg) {
+    using namespace cs_regex_wrap;
+    std::regex r(R"((^|\n)[ \t]*@trace[ \t]*(?=\r?\n|$))");
+    cmatch m;
+    size_t pos = 0, last = 0;
+    string out;
+    vector<pair<size_t, size_t>> marks;   // (offset in out, offset in in)
+    while (search_from(in, pos, m, r)) {
+        append_prefix(out, in, last, m);
+        out += m[1].str();
+        marks.push_back({ out.size(), prefix_end_abs(in, m) + static_cast<size_t>(m[1].length()) });
+        last = pos;
     }
+    if (marks.empty()) return in;
+    out.append(in, last, string::npos);
+
+    vector<FnBody> fns = toplevel_function_bodies(out);
+    vector<pair<size_t, string>> inserts;
+    for (auto& mk : marks) {
+        auto it = std::find_if(fns.begin(), fns.end(), [&](const FnBody& f) { return f.header >= mk.first; });
+        if (it == fns.end() || out.find_first_not_of(" \t\r\n", mk.first) != it->header) {
+            auto lc = line_col_at(in, mk.second);
+            throw CompilerError("@trace must be followed by a function definition", lc.first, lc.second);
+        }
+        if (cfg.modules.count("trace") && out.compare(it->header, 3, "fn ") != 0)
+            inserts.push_back({ it->open + 1, " CS_TRACE_SCOPE(\"" + it->name + "\");" });
+    }
+    for (auto i = inserts.rbegin(); i != inserts.rend(); ++i) out.insert(i->first, i->second);
     return out;
 }
 
@@ -610,21 +4780,23 @@ static string lower_unsafe_blocks(const string& in) {
 static string softline_lower(const string& src,
     bool softline_on,
     const set<string>& hotFns, // may be empty
-    bool instrument // first PGO pass: inject cs_prof_hit
+    bool instrument, // first PGO pass: inject cs_prof_hit
+    bool trace = false // --trace-lib / @trace on: CS_TRACE_SCOPE in every fn
 ) {
     using namespace cs_regex_wrap;
     if (!softline_on) return src;
 
-    string s = src;
+    string s = lower_param_attrs(src);
 
     // 1) single-expression fn:  fn name(args) -> ret => expr;
     {
         std::regex r(R"(\bfn\s+([A-Za-z_]\w*)\s*\(([^)]*)\)\s*->\s*([^=\{\n;]+)\s*=>\s*(.*?);)");
         cmatch m;
-        size_t pos = 0;
+        size_t pos = 0, last = 0;
         string rebuilt;
         while (search_from(s, pos, m, r)) {
-            append_prefix(rebuilt, s, pos - (m.length(0) ? m.length(0) : 0), m);
+            append_prefix(rebuilt, s, last, m);
+            last = pos;
             string name = trim(m[1].str());
             string args = m[2].str();
             string retty = trim(m[3].str());
@@ -635,11 +4807,12 @@ static string softline_lower(const string& src,
             fn << (hot ? "static CS_HOT inline " : "static inline ")
                 << retty << " " << name << "(" << args << "){ ";
             if (instrument) fn << "cs_prof_hit(\"" << name << "\"); ";
+            if (trace) fn << "CS_TRACE_SCOPE(\"" << name << "\"); ";
             fn << "return (" << expr << "); }";
             rebuilt += fn.str();
             // pos already advanced
         }
-        rebuilt.append(s, pos, string::npos);
+        rebuilt.append(s, last, string::npos);
         s.swap(rebuilt);
     }
 
@@ -647,10 +4820,11 @@ static string softline_lower(const string& src,
     {
         std::regex r(R"(\bfn\s+([A-Za-z_]\w*)\s*\(([^)]*)\)\s*->\s*([^\{;\n]+)\s*\{)");
         cmatch m;
-        size_t pos = 0;
+        size_t pos = 0, last = 0;
         string rebuilt;
         while (search_from(s, pos, m, r)) {
-            append_prefix(rebuilt, s, pos - (m.length(0) ? m.length(0) : 0), m);
+            append_prefix(rebuilt, s, last, m);
+            last = pos;
             string name = trim(m[1].str());
             string args = m[2].str();
             string retty = trim(m[3].str());
@@ -658,9 +4832,10 @@ static string softline_lower(const string& src,
             std::ostringstream hdr;
             hdr << (hot ? "CS_HOT " : "") << retty << " " << name << "(" << args << ")" << "{ ";
             if (instrument) hdr << "cs_prof_hit(\"" << name << "\"); ";
+            if (trace) hdr << "CS_TRACE_SCOPE(\"" << name << "\"); ";
             rebuilt += hdr.str();
         }
-        rebuilt.append(s, pos, string::npos);
+        rebuilt.append(s, last, string::npos);
         s.swap(rebuilt);
     }
 
@@ -710,122 +4885,869 @@ static int run_exe_with_env(const string& exe, const string& key, const string&
 #endif
 }
 
+//============================= Size-build linker =============================
+// Linker able to fold identical functions (--icf) for the size build, as a
+// -fuse-ld value; "" when only the default linker is available. gcc's LTO
+// plugin works with gold but not lld, so each compiler gets its own pick.
+static string pick_icf_linker(const string& cc) {
+#if defined(_WIN32) || defined(__APPLE__)
+    (void)cc;
+    return "";
+#else
+    static map<string, string> memo;
+    auto it = memo.find(cc);
+    if (it != memo.end()) return it->second;
+    bool clang = cc.find("clang") != string::npos;
+    vector<string> cands = clang ? vector<string>{ "lld", "gold" } : vector<string>{ "gold" };
+    string pick;
+    for (auto& l : cands)
+        if (system(("ld." + l + " --version > /dev/null 2>&1").c_str()) == 0) { pick = l; break; }
+    return memo[cc] = pick;
+#endif
+}
+
+//============================= Target CPU =============================
+// @cpu / --cpu value: comma-separated items, each a CPU name ("native",
+// "haswell", "x86-64-v3", "neoverse-n1", ...) or a feature toggle ("+avx2",
+// "-avx512f"). Empty means the toolchain's generic baseline.
+struct CpuSpec {
+    string name;              // at most one CPU name
+    vector<string> features;  // "+feat" / "-feat"
+};
+
+static CpuSpec parse_cpu_spec(const string& v) {
+    CpuSpec c;
+    for (auto& item : split(v, ',')) {
+        string t = trim(item);
+        if (t.empty()) continue;
+        if (t[0] == '+' || t[0] == '-') {
+            if (t.size() < 2) throw CompilerError("--cpu: empty feature name in '" + v + "'");
+            c.features.push_back(t);
+        }
+        else if (c.name.empty()) c.name = t;
+        else throw CompilerError("--cpu: more than one CPU name in '" + v + "'");
+    }
+    return c;
+}
+
+// Architecture the C compiler targets: the --target triple's first component,
+// else the host this compiler was built for.
+static string target_arch(const Config& cfg) {
+    if (!cfg.target.empty()) return cfg.target.substr(0, cfg.target.find('-'));
+#if defined(__aarch64__) || defined(_M_ARM64)
+    return "aarch64";
+#elif defined(__arm__) || defined(_M_ARM)
+    return "arm";
+#else
+    return "x86_64";
+#endif
+}
+
+static vector<string> cpu_flags(const Config& cfg, bool msvc) {
+    vector<string> f;
+    if (cfg.cpu.empty()) return f;
+    CpuSpec c = parse_cpu_spec(cfg.cpu);
+    if (msvc) {
+        // cl has no -march; /arch covers the vector ISA, which is what matters.
+        // cl can't probe the host, so "native" adds nothing rather than guess.
+        bool has512 = false, has2 = false;
+        for (auto& x : c.features) { has512 |= starts_with(x, "+avx512"); has2 |= x == "+avx2"; }
+        if (has512) f.push_back("/arch:AVX512");
+        else if (has2) f.push_back("/arch:AVX2");
+        return f;
+    }
+    if (c.name == "native" && !cfg.target.empty()) {
+        std::cerr << "warning: --cpu native ignored when cross-compiling for " << cfg.target << "\n";
+        c.name.clear();
+    }
+    string arch = target_arch(cfg);
+    if (arch == "aarch64" || arch == "arm64" || starts_with(arch, "arm")) {
+        // Arm takes -mcpu=<core> (or -march=<armvX>) with "+ext" / "+noext"
+        // suffixes; a bare feature list extends the baseline architecture.
+        if (c.name.empty() && c.features.empty()) return f;
+        string v = c.name.empty() ? (arch == "aarch64" || arch == "arm64" ? "armv8-a" : "") : c.name;
+        if (v.empty()) {
+            if (!c.features.empty()) std::cerr << "warning: --cpu features need a CPU or armvX name on " << arch << "\n";
+            return f;
+        }
+        for (auto& x : c.features) v += (x[0] == '+' ? "+" : "+no") + x.substr(1);
+        f.push_back((starts_with(v, "armv") ? "-march=" : "-mcpu=") + v);
+        return f;
+    }
+    if (!c.name.empty()) {
+        f.push_back("-march=" + c.name);
+        // x86-64-vN levels are not valid tuning targets
+        if (c.name.find("x86-64") == string::npos) f.push_back("-mtune=" + c.name);
+    }
+    for (auto& x : c.features) f.push_back((x[0] == '+' ? "-m" : "-mno-") + x.substr(1));
+    return f;
+}
+
 //============================= Build driver =============================
 struct BuildOut {
     int rc = 0;
     string exe;
 };
 
-static string build_cmd(const Config& cfg, const string& cc, const string& cpath, const string& out,
-    bool defineProfile = false) {
-    vector<string> cmd; cmd.push_back(cc);
-    bool msvc = (cc == "cl" || cc == "clang-cl");
+static string build_cmd(const Config& cfg, const string& cc, const string& cpath, const string& out,
+    bool defineProfile = false) {
+    vector<string> cmd; cmd.push_back(cc);
+    bool msvc = (cc == "cl" || cc == "clang-cl");
+
+    if (msvc) {
+        cmd.push_back("/nologo");
+        if (cfg.opt == "O0") cmd.push_back("/Od");
+        else if (cfg.opt == "O1") cmd.push_back("/O1");
+        else if (cfg.opt == "O2") cmd.push_back("/O2");
+        else if (cfg.opt == "O3" || cfg.opt == "max") cmd.push_back("/O2");
+        else if (is_size_opt(cfg)) { cmd.push_back("/O1"); cmd.push_back("/Gy"); cmd.push_back("/Gw"); }
+
+        if (cfg.debug) cmd.push_back("/Zi");
+        if (cfg.hardline || cfg.strict) { cmd.push_back("/Wall"); cmd.push_back("/WX"); }
+        if (cfg.lto) cmd.push_back("/GL");
+        for (auto& f : cpu_flags(cfg, true)) cmd.push_back(f);
+        if (cfg.hardline) cmd.push_back("/DCS_HARDLINE=1");
+        if (defineProfile) cmd.push_back(cfg.profile_sample ? "/Ob0" : "/DCS_PROFILE_BUILD=1");
+
+        for (auto& d : cfg.defines) cmd.push_back("/D" + d);
+        for (auto& p : cfg.incs)    cmd.push_back("/I" + p);
+
+        cmd.push_back(cpath);
+        cmd.push_back("/Fe:" + out);
+
+        if (cfg.debug) cmd.push_back("/Fd:" + out + ".pdb");
+
+        for (auto& lp : cfg.libpaths) cmd.push_back("/link /LIBPATH:\"" + lp + "\"");
+        for (auto& l : cfg.links) {
+            string lib = l;
+            if (lib.rfind(".lib") == string::npos) lib += ".lib";
+            cmd.push_back("/link " + lib);
+        }
+        if (is_size_opt(cfg)) cmd.push_back("/link /OPT:REF /OPT:ICF");
+    }
+    else {
+        cmd.push_back("-std=c11");
+
+        if (cfg.opt == "O0") cmd.push_back("-O0");
+        else if (cfg.opt == "O1") cmd.push_back("-O1");
+        else if (cfg.opt == "O2") cmd.push_back("-O2");
+        else if (cfg.opt == "O3") cmd.push_back("-O3");
+        else if (cfg.opt == "size") cmd.push_back("-Os");
+        else if (cfg.opt == "Oz") cmd.push_back("-Oz");
+        else if (cfg.opt == "max") { cmd.push_back("-O3"); if (cfg.lto && cfg.remarks_file.empty()) cmd.push_back("-flto"); }
+
+        if (cfg.debug) cmd.push_back("-g");
+
+        // POSIX clocks/signals aren't declared under plain -std=c11.
+        if (cfg.modules.count("sample") || cfg.modules.count("bench") || cfg.modules.count("trace")) cmd.push_back("-D_GNU_SOURCE");
+        // The sampler unwinds by frame pointer and reads ucontext registers.
+        if (cfg.modules.count("sample")) {
+            cmd.push_back("-fno-omit-frame-pointer");
+            cmd.push_back("-mno-omit-leaf-frame-pointer");
+        }
+
+        if (cfg.hardline) {
+            cmd.push_back("-Wall");
+            cmd.push_back("-Wextra");
+            if (cfg.warn_as_error) cmd.push_back("-Werror");
+            cmd.push_back("-Wconversion");
+            cmd.push_back("-Wsign-conversion");
+        }
+
+        // Remarks come from the compile step; with -flto the optimizer runs
+        // again at link time and its vectorizer remarks are lost, so a
+        // remarks build (one TU, little for LTO to add) is compiled without it.
+        if (cfg.lto && cfg.remarks_file.empty()) cmd.push_back("-flto");
+        for (auto& f : cpu_flags(cfg, false)) cmd.push_back(f);
+
+        if (!cfg.remarks_file.empty()) {
+            if (cc.find("clang") != string::npos) {
+                cmd.push_back("-fsave-optimization-record=yaml");
+                cmd.push_back("-foptimization-record-file=" + cfg.remarks_file);
+                cmd.push_back("-foptimization-record-passes=inline|loop-vectorize|slp-vectorizer");
+            }
+            else cmd.push_back("-fopt-info-vec-inline-optimized-missed=" + cfg.remarks_file);
+        }
+
+        // clang takes @vectorize per loop via its pragma; GCC has no per-loop
+        // switch, so turn its vectorizer fully on for the file instead.
+        if (cfg.vectorize_hints && cc.find("clang") == string::npos) {
+            cmd.push_back("-ftree-loop-vectorize");
+            cmd.push_back("-fvect-cost-model=dynamic");
+        }
+
+        if (!cfg.target.empty()) {
+            cmd.push_back("-target");
+            cmd.push_back(cfg.target);
+        }
+
+        if (cfg.hardline) cmd.push_back("-DCS_HARDLINE=1");
+        // Training build. Sampled training keeps calls out of line so samples
+        // land on the function they belong to rather than its caller.
+        if (defineProfile) cmd.push_back(cfg.profile_sample ? "-fno-inline" : "-DCS_PROFILE_BUILD=1");
+
+        for (auto& d : cfg.defines) { cmd.push_back("-D" + d); }
+        for (auto& p : cfg.incs) { cmd.push_back("-I" + p); }
+
+        cmd.push_back(cpath);
+        cmd.push_back("-o");
+        cmd.push_back(out);
+
+        for (auto& lp : cfg.libpaths) { cmd.push_back("-L" + lp); }
+        for (auto& l : cfg.links) { cmd.push_back("-l" + l); }
+        if (cfg.modules.count("threads") || cfg.modules.count("sample") || cfg.modules.count("trace")) cmd.push_back("-pthread");
+
+        // Size build: one section per function/object so the linker can drop
+        // unreferenced ones and fold identical bodies.
+        if (is_size_opt(cfg)) {
+            cmd.push_back("-ffunction-sections");
+            cmd.push_back("-fdata-sections");
+#if defined(__APPLE__)
+            cmd.push_back("-Wl,-dead_strip");
+#else
+            cmd.push_back("-Wl,--gc-sections");
+            string ld = pick_icf_linker(cc);
+            if (!ld.empty()) {
+                cmd.push_back("-fuse-ld=" + ld);
+                cmd.push_back("-Wl,--icf=all");
+            }
+#endif
+        }
+    }
+
+    // Join
+    string full;
+    for (size_t i = 0; i < cmd.size(); ++i) {
+        if (i) full += ' ';
+        bool needQ = cmd[i].find_first_of(" |&;<>") != string::npos;
+        if (needQ) full.push_back('"');
+        full += cmd[i];
+        if (needQ) full.push_back('"');
+    }
+    return full;
+}
+
+static int run_cmd(const string& cmd, bool echo = false) {
+    if (echo) std::cerr << "CC: " << cmd << "\n";
+    return system(cmd.c_str());
+}
+
+// Run cmd and collect its stdout; returns the exit status (-1 if it couldn't start).
+static int capture_cmd(const string& cmd, string& out) {
+#if defined(_WIN32)
+    FILE* p = _popen(cmd.c_str(), "r");
+#else
+    FILE* p = popen(cmd.c_str(), "r");
+#endif
+    if (!p) return -1;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof buf, p)) > 0) out.append(buf, n);
+#if defined(_WIN32)
+    return _pclose(p);
+#else
+    return pclose(p);
+#endif
+}
+
+//============================= Size report =============================
+// --size-report: .text broken down by function, from `nm -S` over the final
+// binary (llvm-nm as fallback). Needs a symbol table, so it reads the binary
+// before any stripping would happen.
+static void print_size_report(const string& exe, size_t top = 40) {
+    string listing;
+    string q = "\"" + exe + "\"";
+    int rc = capture_cmd("nm -S --size-sort -t d " + q + " 2>/dev/null", listing);
+    if (rc != 0 || listing.empty()) { listing.clear(); rc = capture_cmd("llvm-nm -S --size-sort -t d " + q + " 2>/dev/null", listing); }
+    if (rc != 0 || listing.empty()) {
+        std::cerr << "size report: no symbols available for " << exe << " (needs nm or llvm-nm)\n";
+        return;
+    }
+    vector<pair<unsigned long long, string>> fns;
+    unsigned long long total = 0;
+    std::istringstream ls(listing);
+    string line;
+    while (std::getline(ls, line)) {
+        std::istringstream w(line);
+        string addr, size, type, name;
+        if (!(w >> addr >> size >> type >> name)) continue;
+        if (type != "t" && type != "T" && type != "W" && type != "w") continue;
+        unsigned long long n = std::strtoull(size.c_str(), nullptr, 10);
+        total += n;
+        fns.push_back({ n, name });
+    }
+    std::sort(fns.begin(), fns.end(), [](auto& a, auto& b) { return a.first > b.first; });
+
+    std::error_code ec;
+    auto fileBytes = std::filesystem::file_size(exe, ec);
+    std::cerr << "size report: " << exe << " (" << (ec ? 0 : fileBytes) << " bytes on disk, "
+        << total << " bytes of code in " << fns.size() << " functions)\n";
+    std::cerr << "  " << std::left << std::setw(48) << "function" << std::right << std::setw(10) << "bytes" << std::setw(8) << "%" << "\n";
+    for (size_t i = 0; i < fns.size() && i < top; ++i) {
+        double pct = total ? 100.0 * static_cast<double>(fns[i].first) / static_cast<double>(total) : 0.0;
+        std::cerr << "  " << std::left << std::setw(48) << fns[i].second << std::right << std::setw(10) << fns[i].first
+            << std::setw(7) << std::fixed << std::setprecision(1) << pct << "%\n";
+    }
+    if (fns.size() > top) std::cerr << "  ... " << fns.size() - top << " smaller functions\n";
+}
+
+//============================= Optimisation remarks =============================
+// --remarks: the final build asks the compiler for inliner and vectorizer
+// remarks (gcc -fopt-info text, clang/in-proc YAML optimization records).
+// The lowered body starts with #line 1 "file.csc", so remark locations are
+// already .csc lines; remarks in the prelude are dropped. With a PGO profile
+// only the hot functions are shown.
+struct Remark {
+    string file;
+    int line = 0, col = 0;
+    string kind;      // optimized | missed | analysis
+    string fn;
+    string msg;
+};
+
+static vector<Remark> parse_gcc_opt_info(const string& text) {
+    vector<Remark> out;
+    std::regex lineRe(R"(^(.*):(\d+):(\d+): (optimized|missed): +(.*)$)");
+    std::regex inlRe(R"(Inlining \S+ into ([A-Za-z_]\w*))");
+    std::istringstream in(text);
+    string l;
+    while (std::getline(in, l)) {
+        std::smatch m;
+        if (!std::regex_match(l, m, lineRe)) continue;
+        Remark r;
+        r.file = m[1].str();
+        r.line = std::stoi(m[2].str());
+        r.col = std::stoi(m[3].str());
+        r.kind = m[4].str();
+        r.msg = m[5].str();
+        std::smatch im;
+        if (std::regex_search(r.msg, im, inlRe)) r.fn = im[1].str();
+        out.push_back(r);
+    }
+    return out;
+}
+
+// Just enough YAML for LLVM optimization records: one document per remark,
+// top-level Pass/Function/DebugLoc, and the Args list joined into the message.
+static vector<Remark> parse_opt_record_yaml(const string& text) {
+    vector<Remark> out;
+    auto unquote = [](string v) {
+        v = trim(v);
+        if (v.size() >= 2 && v.front() == '\'' && v.back() == '\'') {
+            v = v.substr(1, v.size() - 2);
+            for (size_t p = v.find("''"); p != string::npos; p = v.find("''", p + 1)) v.erase(p, 1);
+        }
+        return v;
+    };
+    std::regex locRe(R"(File:\s*'?([^,']*)'?,\s*Line:\s*(\d+),\s*Column:\s*(\d+))");
+    std::istringstream in(text);
+    string l;
+    Remark* cur = nullptr;
+    bool inArgs = false;
+    while (std::getline(in, l)) {
+        if (starts_with(l, "--- !")) {
+            string k = trim(l.substr(5));
+            out.push_back({});
+            cur = &out.back();
+            cur->kind = k == "Passed" ? "optimized" : k == "Missed" ? "missed" : "analysis";
+            inArgs = false;
+            continue;
+        }
+        if (!cur) continue;
+        if (starts_with(l, "Args:")) { inArgs = true; continue; }
+        if (!l.empty() && l[0] != ' ') inArgs = false;
+        if (starts_with(l, "Function:")) cur->fn = unquote(l.substr(9));
+        else if (starts_with(l, "DebugLoc:")) {
+            std::smatch m;
+            if (std::regex_search(l, m, locRe)) {
+                cur->file = m[1].str();
+                cur->line = std::stoi(m[2].str());
+                cur->col = std::stoi(m[3].str());
+            }
+        }
+        else if (inArgs) {
+            string t = trim(l);
+            if (starts_with(t, "- ")) t = t.substr(2);
+            size_t colon = t.find(':');
+            if (colon == string::npos || starts_with(t, "DebugLoc")) continue;
+            cur->msg += unquote(t.substr(colon + 1));
+        }
+    }
+    return out;
+}
+
+static void print_remarks(const string& recordPath, const string& csc, const string& lowered, const set<string>& hot) {
+    string text;
+    try { text = read_file(recordPath); }
+    catch (const CompilerError&) { std::cerr << "remarks: the compiler wrote no optimization record\n"; return; }
+    vector<Remark> all = starts_with(text, "--- !") ? parse_opt_record_yaml(text) : parse_gcc_opt_info(text);
+
+    // gcc doesn't name the function for loop remarks; take the definition around the line.
+    vector<pair<int, int>> spans;   // [first,last] line per function
+    auto fns = toplevel_function_bodies(lowered);
+    for (auto& f : fns)
+        spans.push_back({ line_col_at(lowered, f.header).first, line_col_at(lowered, f.close).first });
+
+    vector<Remark> keep;
+    set<string> seen;
+    for (auto& r : all) {
+        if (r.file != csc) continue;
+        if (r.fn.empty())
+            for (size_t i = 0; i < fns.size(); ++i)
+                if (r.line >= spans[i].first && r.line <= spans[i].second) { r.fn = fns[i].name; break; }
+        if (!hot.empty() && !hot.count(r.fn)) continue;
+        string key = std::to_string(r.line) + ":" + std::to_string(r.col) + r.kind + r.msg;
+        if (seen.insert(key).second) keep.push_back(r);
+    }
+    std::stable_sort(keep.begin(), keep.end(), [](auto& a, auto& b) { return a.line != b.line ? a.line < b.line : a.col < b.col; });
+
+    std::cerr << "remarks: " << keep.size() << " for " << csc;
+    if (hot.empty()) std::cerr << " (all functions; build with @profile on to focus on hot ones)\n";
+    else {
+        std::cerr << " (hot:";
+        for (auto& h : hot) std::cerr << " " << h;
+        std::cerr << ")\n";
+    }
+    for (auto& r : keep)
+        std::cerr << "  " << r.file << ":" << r.line << ":" << r.col << ": " << r.kind << ": "
+            << (r.fn.empty() ? "" : "[" + r.fn + "] ") << r.msg << "\n";
+}
+
+//============================= Benchmarks =============================
+// `cscriptc bench`: runs the harness build, echoes its JSON (optionally saved
+// with --json) and compares medians against a --baseline file. A bench counts
+// as a regression when its median is more than --threshold percent slower and
+// the gap exceeds 3 MADs of the noisier run, so jitter alone doesn't fail CI.
+struct BenchStat { double median = 0, mad = 0; };
+
+static map<string, BenchStat> parse_bench_json(const string& json) {
+    map<string, BenchStat> m;
+    std::regex r(R"re("name":\s*"((?:[^"\\]|\\.)*)"[^}]*?"median_ns":\s*([-0-9.eE+]+),\s*"mad_ns":\s*([-0-9.eE+]+))re");
+    for (std::sregex_iterator it(json.begin(), json.end(), r), e; it != e; ++it)
+        m[(*it)[1].str()] = { atof((*it)[2].str().c_str()), atof((*it)[3].str().c_str()) };
+    return m;
+}
+
+// Read before anything is built, so a bad --baseline path fails fast.
+static map<string, BenchStat> load_bench_baseline(const string& path) {
+    std::ifstream bf(path, std::ios::binary);
+    if (!bf) throw CompilerError("cannot read baseline " + path);
+    std::stringstream ss;
+    ss << bf.rdbuf();
+    map<string, BenchStat> base = parse_bench_json(ss.str());
+    if (base.empty()) throw CompilerError("baseline " + path + " holds no bench results");
+    return base;
+}
+
+static int run_benchmarks(const Config& cfg, const map<string, BenchStat>& base) {
+    string cmd = "\"" + cfg.out + "\"";
+    if (!cfg.bench_filter.empty()) cmd += " --filter \"" + cfg.bench_filter + "\"";
+    if (cfg.bench_counters) cmd += " --counters";
+    string json;
+    int rc = capture_cmd(cmd, json);
+    rm_file(cfg.out);
+    if (rc != 0) throw CompilerError("bench run failed (exit status " + std::to_string(rc) + ")");
+    std::cout << json;
+    if (!cfg.bench_json.empty()) {
+        std::ofstream f(cfg.bench_json, std::ios::binary);
+        f << json;
+        if (!f) throw CompilerError("cannot write " + cfg.bench_json);
+    }
+    if (cfg.bench_baseline.empty()) return 0;
+
+    map<string, BenchStat> cur = parse_bench_json(json);
+
+    int regressions = 0;
+    std::cerr << "vs " << cfg.bench_baseline << " (threshold " << cfg.bench_threshold << "%):\n";
+    for (auto& kv : cur) {
+        char line[512];
+        auto it = base.find(kv.first);
+        if (it == base.end()) {
+            snprintf(line, sizeof line, "  %-24s %12s    %12.3f ns  (new)\n", kv.first.c_str(), "", kv.second.median);
+            std::cerr << line;
+            continue;
+        }
+        const BenchStat& was = it->second;
+        const BenchStat& now = kv.second;
+        double pct = was.median > 0 ? (now.median - was.median) / was.median * 100.0 : 0.0;
+        bool slower = pct > cfg.bench_threshold && now.median - was.median > 3.0 * std::max(now.mad, was.mad);
+        if (slower) ++regressions;
+        snprintf(line, sizeof line, "  %-24s %12.3f -> %12.3f ns  %+7.1f%%%s\n", kv.first.c_str(), was.median, now.median, pct,
+            slower ? "  REGRESSION" : "");
+        std::cerr << line;
+    }
+    if (regressions) std::cerr << regressions << " bench(es) regressed\n";
+    return regressions ? 1 : 0;
+}
+
+//============================= PGO helper =============================
+// Reads either the instrumented pass's "name count" lines or @sample's folded
+// stacks ("main;solve;dot 812"). A stack credits its leaf, i.e. self time;
+// compiler clone suffixes (dot.constprop.0, dot.lto_priv.0) fold into the
+// source name and unsymbolized frames are skipped.
+static map<string, unsigned long long> read_profile_counts(const string& path) {
+    map<string, unsigned long long> m;
+    std::ifstream f(path);
+    string name; unsigned long long cnt = 0ULL;
+    while (f >> name >> cnt) {
+        size_t semi = name.rfind(';');
+        if (semi != string::npos) name.erase(0, semi + 1);
+        size_t dot = name.find('.');
+        if (dot != string::npos) name.erase(dot);
+        if (name.empty() || name[0] == '[') continue;
+        m[name] += cnt;
+    }
+    return m;
+}
+
+static set<string> select_hot_functions(const map<string, unsigned long long>& m, size_t topN = 16) {
+    vector<pair<string, unsigned long long>> v(m.begin(), m.end());
+    std::sort(v.begin(), v.end(), [](auto& a, auto& b) { return a.second > b.second; });
+    set<string> hot;
+    for (size_t i = 0; i < v.size() && i < topN; ++i) {
+        if (v[i].second > 0) hot.insert(v[i].first);
+    }
+    return hot;
+}
+
+//============================= Auto-fix builds =============================
+// --auto-fix: when the C compiler rejects the generated C, look at what it
+// said and retry only the repairs that address it: -lm for unresolved math
+// symbols, UTF-8 charset flags (then an ASCII-sanitized source) for encoding
+// errors, semicolon/brace repair for syntax errors. Any other failure (a type
+// error, say) is reported straight away from the first build. The candidate
+// repairs are independent and are compiled concurrently; the least invasive
+// one that builds wins, and is remembered per generated source so the next
+// build of the same source goes to it directly.
+namespace build_autofix {
+
+    // Repairs, as bits; a strategy is the set applied to one attempt.
+    enum : unsigned { UTF8 = 1, LIBM = 2, ASCII = 4, REPAIR = 8 };
+
+    static bool is_msvc(const std::string& cc) {
+        return (cc == "cl" || cc == "clang-cl");
+    }
+
+    static std::string ascii_sanitize(const std::string& s) {
+        std::string out; out.reserve(s.size());
+        for (unsigned char c : s) {
+            out.push_back((c >= 32 && c < 127) || c == '\n' || c == '\t' ? char(c) : '?');
+        }
+        return out;
+    }
+
+    static std::string light_repair_c(const std::string& src) {
+        std::istringstream in(src);
+        std::string line, out;
+        out.reserve(src.size() + src.size() / 32);
+
+        auto rtrim = [](std::string s) {
+            while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r')) s.pop_back();
+            return s;
+            };
+
+        size_t openBr = 0, closeBr = 0;
+        while (std::getline(in, line)) {
+            std::string raw = line;
+            std::string stripped = rtrim(line);
+            size_t i = 0; while (i < stripped.size() && (stripped[i] == ' ' || stripped[i] == '\t')) ++i;
+            stripped.erase(0, i);
+
+            if (!stripped.empty() && stripped[0] == '#') {
+                out += raw + "\n";
+            }
+            else {
+                for (char c : stripped) {
+                    if (c == '{') ++openBr;
+                    else if (c == '}') ++closeBr;
+                }
+                bool endsWithBrace = !stripped.empty() && (stripped.back() == '{' || stripped.back() == '}');
+                bool endsWithSemi = !stripped.empty() && stripped.back() == ';';
+                bool looksStmt =
+                    (!stripped.empty() &&
+                        stripped.rfind("if", 0) == 0 ? false :
+                        stripped.rfind("for", 0) == 0 ? false :
+                        stripped.rfind("while", 0) == 0 ? false :
+                        stripped.rfind("switch", 0) == 0 ? false :
+                        stripped.back() == ')' || stripped.find('=') != std::string::npos ||
+                        stripped.rfind("return", 0) == 0);
+                if (!endsWithBrace && !endsWithSemi && looksStmt) out += raw + ";\n";
+                else out += raw + "\n";
+            }
+        }
+        while (openBr > closeBr) { out += "}\n"; ++closeBr; }
+        return out;
+    }
+
+    static std::string inject_flag(const std::string& cmd, const std::string& flag) {
+        if (cmd.find(flag) != std::string::npos) return cmd;
+        std::string out = cmd; out.push_back(' '); out += flag; return out;
+    }
 
-    if (msvc) {
-        cmd.push_back("/nologo");
-        if (cfg.opt == "O0") cmd.push_back("/Od");
-        else if (cfg.opt == "O1") cmd.push_back("/O1");
-        else if (cfg.opt == "O2") cmd.push_back("/O2");
-        else if (cfg.opt == "O3" || cfg.opt == "max") cmd.push_back("/O2");
-        else if (cfg.opt == "size") cmd.push_back("/Os");
+    static std::string ensure_link_lib(const std::string& cmd, const std::string& libFlag) {
+        return (cmd.find(libFlag) != std::string::npos) ? cmd : inject_flag(cmd, libFlag);
+    }
 
-        if (cfg.debug) cmd.push_back("/Zi");
-        if (cfg.hardline || cfg.strict) { cmd.push_back("/Wall"); cmd.push_back("/WX"); }
-        if (cfg.lto) cmd.push_back("/GL");
-        if (cfg.hardline) cmd.push_back("/DCS_HARDLINE=1");
-        if (defineProfile) cmd.push_back("/DCS_PROFILE_BUILD=1");
+    static std::string describe(unsigned strategy) {
+        std::string d;
+        auto add = [&](const char* s) { if (!d.empty()) d += " + "; d += s; };
+        if (strategy & UTF8) add("UTF-8 charset flags");
+        if (strategy & LIBM) add("-lm");
+        if (strategy & ASCII) add("ASCII-sanitized source");
+        if (strategy & REPAIR) add("semicolon/brace repair");
+        return d.empty() ? "vanilla build" : d;
+    }
 
-        for (auto& d : cfg.defines) cmd.push_back("/D" + d);
-        for (auto& p : cfg.incs)    cmd.push_back("/I" + p);
+    //---- Diagnosis ----
+    // Compiler and linker messages quote names as `x', 'x', "x" or, in a UTF-8
+    // locale, with curly quotes; skip_quote steps over whichever opens the name at i.
+    static size_t skip_quote(const std::string& s, size_t i) {
+        if (i < s.size() && (s[i] == '`' || s[i] == '\'' || s[i] == '"')) return i + 1;
+        if (s.compare(i, 3, "\xE2\x80\x98") == 0) return i + 3;
+        return i;
+    }
 
-        cmd.push_back(cpath);
-        cmd.push_back("/Fe:" + out);
+    static bool is_math_symbol(std::string name) {
+        static const set<string> libm = {
+            "sqrt", "cbrt", "hypot", "pow", "exp", "exp2", "expm1", "log", "log2", "log10", "log1p",
+            "sin", "cos", "tan", "asin", "acos", "atan", "atan2", "sinh", "cosh", "tanh",
+            "asinh", "acosh", "atanh", "floor", "ceil", "round", "lround", "llround", "trunc",
+            "rint", "lrint", "nearbyint", "fmod", "remainder", "fma", "fmin", "fmax", "fdim",
+            "ldexp", "frexp", "modf", "scalbn", "erf", "erfc", "tgamma", "lgamma", "copysign" };
+        if (libm.count(name)) return true;
+        if (name.size() > 1 && (name.back() == 'f' || name.back() == 'l')) name.pop_back();
+        return libm.count(name) > 0;
+    }
 
-        if (cfg.debug) cmd.push_back("/Fd:" + out + ".pdb");
+    struct Diagnosis {
+        bool libm = false;      // unresolved math-library symbols
+        bool encoding = false;  // bytes the compiler couldn't read as source text
+        bool syntax = false;    // missing ';' / '}' style errors
+    };
 
-        for (auto& lp : cfg.libpaths) cmd.push_back("/link /LIBPATH:\"" + lp + "\"");
-        for (auto& l : cfg.links) {
-            string lib = l;
-            if (lib.rfind(".lib") == string::npos) lib += ".lib";
-            cmd.push_back("/link " + lib);
+    static Diagnosis classify(const std::string& log) {
+        Diagnosis d;
+        std::istringstream in(log);
+        std::string ln;
+        auto has = [&](const char* needle) { return ln.find(needle) != std::string::npos; };
+        while (std::getline(in, ln)) {
+            // GNU ld: undefined reference to `sqrt'; lld: undefined symbol: sqrt;
+            // Apple ld: "_sqrt", referenced from ...
+            for (const char* tag : { "undefined reference to ", "undefined symbol: ", "Undefined symbols" }) {
+                size_t at = ln.find(tag);
+                if (at == std::string::npos) continue;
+                size_t i = skip_quote(ln, at + strlen(tag));
+                if (i < ln.size() && ln[i] == '_' && strcmp(tag, "undefined symbol: ") != 0) ++i;
+                size_t j = i;
+                while (j < ln.size() && (isalnum((unsigned char)ln[j]) || ln[j] == '_')) ++j;
+                if (j > i && is_math_symbol(ln.substr(i, j - i))) d.libm = true;
+            }
+            if (has("stray '\\") || has("stray \xE2\x80\x98\\") || has("multibyte") ||
+                has("execution character set") || has("illegal byte sequence") ||
+                has("invalid UTF-8") || has("C4819") || has("C2001"))
+                d.encoding = true;
+            if (has("at end of input") || has("C2143") || has("C1075")) d.syntax = true;
+            // expected ';' before ..., expected ',' or ';' before ..., expected '}' at end ...
+            size_t e = ln.find("expected ");
+            for (size_t i = e; e != std::string::npos && i < ln.size(); ++i) {
+                size_t j = skip_quote(ln, i);
+                if (j == i || j >= ln.size() || (ln[j] != ';' && ln[j] != '}')) continue;
+                if (ln.compare(j + 1, 1, "'") == 0 || ln.compare(j + 1, 3, "\xE2\x80\x99") == 0) { d.syntax = true; break; }
+            }
         }
+        return d;
     }
-    else {
-        cmd.push_back("-std=c11");
 
-        if (cfg.opt == "O0") cmd.push_back("-O0");
-        else if (cfg.opt == "O1") cmd.push_back("-O1");
-        else if (cfg.opt == "O2") cmd.push_back("-O2");
-        else if (cfg.opt == "O3") cmd.push_back("-O3");
-        else if (cfg.opt == "size") cmd.push_back("-Os");
-        else if (cfg.opt == "max") { cmd.push_back("-O3"); if (cfg.lto) cmd.push_back("-flto"); }
+    // Strategies worth trying for a diagnosis, least invasive first. A math
+    // link failure doesn't depend on the source, so -lm rides along with the
+    // other repairs rather than being a candidate of its own.
+    static vector<unsigned> candidates(const Diagnosis& d) {
+        unsigned base = d.libm ? LIBM : 0u;
+        vector<unsigned> v;
+        if (d.encoding) { v.push_back(base | UTF8); v.push_back(base | UTF8 | ASCII); }
+        if (d.syntax) v.push_back(base | REPAIR | (d.encoding ? UTF8 | ASCII : 0u));
+        if (v.empty() && base) v.push_back(base);
+        return v;
+    }
 
-        if (cfg.debug) cmd.push_back("-g");
+    //---- Strategy cache ----
+    // "<hash> <strategy>" lines in the temp dir, keyed by an FNV-1a hash of the
+    // compiler, the build kind and the generated C.
+    static uint64_t source_key(const std::string& cc, bool defineProfile, const vector<std::string_view>& pieces) {
+        uint64_t h = 1469598103934665603ull;
+        auto mix = [&](std::string_view s) {
+            for (unsigned char c : s) { h ^= c; h *= 1099511628211ull; }
+            h ^= 0xff; h *= 1099511628211ull;
+            };
+        mix(cc);
+        mix(defineProfile ? "profile" : "final");
+        for (auto p : pieces) mix(p);
+        return h;
+    }
 
-        if (cfg.hardline) {
-            cmd.push_back("-Wall");
-            cmd.push_back("-Wextra");
-            if (cfg.warn_as_error) cmd.push_back("-Werror");
-            cmd.push_back("-Wconversion");
-            cmd.push_back("-Wsign-conversion");
-        }
+    static std::string cache_path() { return get_temp_dir() + "cscript_autofix.cache"; }
 
-        if (cfg.lto) cmd.push_back("-flto");
+    static vector<pair<uint64_t, unsigned>> cache_read() {
+        vector<pair<uint64_t, unsigned>> v;
+        std::ifstream in(cache_path());
+        unsigned long long k; unsigned s;
+        while (in >> std::hex >> k >> std::dec >> s) v.push_back({ (uint64_t)k, s });
+        return v;
+    }
 
-        if (!cfg.target.empty()) {
-            cmd.push_back("-target");
-            cmd.push_back(cfg.target);
+    static bool cache_lookup(uint64_t key, unsigned& strategy) {
+        for (auto& e : cache_read())
+            if (e.first == key) { strategy = e.second; return true; }
+        return false;
+    }
+
+    // Most recent first, bounded; a strategy of 0 drops the entry.
+    static void cache_store(uint64_t key, unsigned strategy) {
+        auto v = cache_read();
+        v.erase(std::remove_if(v.begin(), v.end(), [&](auto& e) { return e.first == key; }), v.end());
+        if (strategy) v.insert(v.begin(), { key, strategy });
+        if (v.size() > 256) v.resize(256);
+        std::string tmp = cache_path() + ".tmp";
+        {
+            std::ofstream o(tmp, std::ios::trunc);
+            for (auto& e : v) o << std::hex << e.first << ' ' << std::dec << e.second << '\n';
+            if (!o) return;
         }
+        std::error_code ec;
+        std::filesystem::rename(tmp, cache_path(), ec);
+        if (ec) rm_file(tmp);
+    }
 
-        if (cfg.hardline) cmd.push_back("-DCS_HARDLINE=1");
-        if (defineProfile) cmd.push_back("-DCS_PROFILE_BUILD=1");
+    //---- Attempts ----
+    struct Attempt {
+        unsigned strategy = 0;
+        std::string cpath, out, cmd, log;
+        int rc = -1;
+    };
 
-        for (auto& d : cfg.defines) { cmd.push_back("-D" + d); }
-        for (auto& p : cfg.incs) { cmd.push_back("-I" + p); }
+    // Write the attempt's source and command line. Runs on the driver thread;
+    // only run() below happens concurrently.
+    static Attempt prepare(const Config& cfg, const std::string& cc, const vector<std::string_view>& pieces,
+        const std::string& out, bool defineProfile, unsigned strategy) {
+        Attempt a;
+        a.strategy = strategy;
+        a.out = out;
+        std::string base = std::string("cscript_") + std::to_string(uintptr_t(&cfg)) + "_fix" + std::to_string(strategy) + ".c";
+        if (strategy & (ASCII | REPAIR)) {
+            std::string src;
+            for (auto p : pieces) src.append(p.data(), p.size());
+            if (strategy & ASCII) src = ascii_sanitize(src);
+            if (strategy & REPAIR) src = light_repair_c(src);
+            a.cpath = write_temp(base, src);
+        }
+        else a.cpath = write_temp_pieces(base, pieces);
 
-        cmd.push_back(cpath);
-        cmd.push_back("-o");
-        cmd.push_back(out);
+        a.cmd = build_cmd(cfg, cc, a.cpath, out, defineProfile);
+        if (strategy & UTF8) {
+            if (is_msvc(cc)) a.cmd = inject_flag(a.cmd, "/utf-8");
+            else {
+                a.cmd = inject_flag(a.cmd, "-finput-charset=UTF-8");
+                a.cmd = inject_flag(a.cmd, "-fexec-charset=UTF-8");
+            }
+        }
+#if !defined(_WIN32)
+        if (strategy & LIBM) a.cmd = ensure_link_lib(a.cmd, "-lm");
+#endif
+        if (cfg.verbose) std::cerr << "[auto-fix] " << describe(strategy) << "\nCC: " << a.cmd << "\n";
+        return a;
+    }
 
-        for (auto& lp : cfg.libpaths) { cmd.push_back("-L" + lp); }
-        for (auto& l : cfg.links) { cmd.push_back("-l" + l); }
+    static void run(Attempt& a) {
+        a.rc = capture_cmd(a.cmd + " 2>&1", a.log);
     }
 
-    // Join
-    string full;
-    for (size_t i = 0; i < cmd.size(); ++i) {
-        if (i) full += ' ';
-        bool needQ = cmd[i].find(' ') != string::npos;
-        if (needQ) full.push_back('"');
-        full += cmd[i];
-        if (needQ) full.push_back('"');
+    static void finish(const Config& cfg, const Attempt& a) {
+        if (!cfg.show_c) rm_file(a.cpath);
     }
-    return full;
-}
 
-static int run_cmd(const string& cmd, bool echo = false) {
-    if (echo) std::cerr << "CC: " << cmd << "\n";
-    return system(cmd.c_str());
-}
+    static int build(const Config& cfg,
+        const std::string& cc,
+        const vector<std::string_view>& pieces,
+        const std::string& out,
+        bool defineProfile) {
+        const uint64_t key = source_key(cc, defineProfile, pieces);
+
+        // A strategy that fixed this source before goes first, alone.
+        unsigned known = 0;
+        if (cache_lookup(key, known)) {
+            Attempt a = prepare(cfg, cc, pieces, out, defineProfile, known);
+            run(a); finish(cfg, a);
+            std::cerr << a.log;
+            if (a.rc == 0) {
+                std::cerr << "auto-fix: built with " << describe(known) << " (cached)\n";
+                return 0;
+            }
+            cache_store(key, 0);    // stale: diagnose afresh
+        }
 
-//============================= PGO helper =============================
-static map<string, unsigned long long> read_profile_counts(const string& path) {
-    map<string, unsigned long long> m;
-    std::ifstream f(path);
-    string name; unsigned long long cnt = 0ULL;
-    while (f >> name >> cnt) { m[name] += cnt; }
-    return m;
-}
+        Attempt first = prepare(cfg, cc, pieces, out, defineProfile, 0);
+        run(first); finish(cfg, first);
+        if (first.rc == 0) {
+            std::cerr << first.log;
+            return 0;
+        }
 
-static set<string> select_hot_functions(const map<string, unsigned long long>& m, size_t topN = 16) {
-    vector<pair<string, unsigned long long>> v(m.begin(), m.end());
-    std::sort(v.begin(), v.end(), [](auto& a, auto& b) { return a.second > b.second; });
-    set<string> hot;
-    for (size_t i = 0; i < v.size() && i < topN; ++i) {
-        if (v[i].second > 0) hot.insert(v[i].first);
+        // A repair can uncover the next problem (a syntax error stops the
+        // build before the link would have reported missing -lm), so failed
+        // candidates are diagnosed again, building on what they applied.
+        set<unsigned> tried = { 0u };
+        vector<unsigned> next;
+        auto expand = [&](const Attempt& a) {
+            for (unsigned s : candidates(classify(a.log)))
+                if (tried.insert(s | a.strategy).second) next.push_back(s | a.strategy);
+            };
+        expand(first);
+        for (int round = 0; round < 3 && !next.empty(); ++round) {
+            // Each candidate links its own executable next to the real one;
+            // the winner is renamed into place.
+            vector<Attempt> at;
+            for (unsigned s : next) {
+                string candOut = out + ".fix" + std::to_string(s);
+#if defined(_WIN32)
+                candOut += ".exe";
+#endif
+                at.push_back(prepare(cfg, cc, pieces, candOut, defineProfile, s));
+            }
+            {
+                vector<std::thread> workers;
+                for (size_t i = 1; i < at.size(); ++i) workers.emplace_back(run, std::ref(at[i]));
+                run(at[0]);
+                for (auto& w : workers) w.join();
+            }
+
+            const Attempt* win = nullptr;
+            for (auto& a : at) {
+                finish(cfg, a);
+                if (a.rc == 0 && !win) win = &a;
+                else rm_file(a.out);
+            }
+            if (win) {
+                std::error_code ec;
+                std::filesystem::rename(win->out, out, ec);
+                if (ec) {
+                    std::filesystem::copy_file(win->out, out, std::filesystem::copy_options::overwrite_existing, ec);
+                    rm_file(win->out);
+                }
+                if (!ec) {
+                    std::cerr << win->log << "auto-fix: built with " << describe(win->strategy) << "\n";
+                    cache_store(key, win->strategy);
+                    return 0;
+                }
+            }
+            next.clear();
+            for (auto& a : at) expand(a);
+        }
+        // Nothing helped: the original diagnostics are the ones worth reading.
+        std::cerr << first.log;
+        if (cfg.verbose && tried.size() > 1) std::cerr << "[auto-fix] no repair succeeded\n";
+        return first.rc;
     }
-    return hot;
-}
+} // namespace build_autofix
 
 //============================= MAIN =============================
 int main(int argc, char** argv) {
@@ -833,9 +5755,11 @@ int main(int argc, char** argv) {
     if (argc < 2) {
         std::cerr << "C-Script Compiler v" << CSCRIPT_VERSION << " (" << CSCRIPT_BUILD_DATE << ")\n"
             << "Usage: cscriptc [options] file.csc\n"
+            << "       cscriptc bench [options] file.csc [--filter <text>] [--json <file>]\n"
+            << "                      [--baseline <file>] [--threshold <percent>] [--counters]\n"
             << "Options:\n"
             << "  -o <file>       Output file name\n"
-            << "  -O<level>       Optimization level (0,1,2,3,size,max)\n"
+            << "  -O<level>       Optimization level (0,1,2,3,s,z,max)\n"
             << "  --no-lto        Disable link-time optimization\n"
             << "  --strict        Enable strict error checking\n"
             << "  --relaxed       More permissive behavior\n"
@@ -844,8 +5768,15 @@ int main(int argc, char** argv) {
             << "  --cc <compiler> Specify C compiler\n"
             << "  --debug         Include debug information\n"
             << "  --target <triple> Set compilation target\n"
-            << "  --capsule       Generate capsule.h and enable runtime safety\n"
-            << "  --trace-lib     Trace library calls with symbolic overlays\n";
+            << "  --cpu <spec>    Target CPU: native, a CPU name, and/or +feat,-feat\n"
+            << "  --capsule       Count CS_MUT_* mutations (per-thread counters, cs_mutation_count())\n"
+            << "  --trace-lib     Trace fn/@trace functions into a Chrome trace (cs_trace.json)\n"
+            << "  --memstats      Count CS_MALLOC/CS_FREE traffic and report at exit\n"
+            << "  --sample        Sample call stacks while running; folded stacks at exit\n"
+            << "  --profile-use <file> Pick hot functions from an earlier profile or --sample run\n"
+            << "  --size-report   Print the binary's code size per function after the build\n"
+            << "  --remarks       Report inlining/vectorization decisions against .csc lines\n"
+            << "  --auto-fix      Retry a failed C build with the repairs its errors call for\n";
         return 1;
     }
 
@@ -854,10 +5785,22 @@ int main(int argc, char** argv) {
         string inpath;
         vector<string> args; args.reserve(argc);
         for (int i = 1; i < argc; i++) args.push_back(argv[i]);
+        if (!args.empty() && args[0] == "bench") {
+            cfg.bench = true;
+            cfg.modules.insert("bench");
+            args.erase(args.begin());
+        }
         for (size_t i = 0; i < args.size(); ++i) {
             string a = args[i];
+            if (cfg.bench) {
+                if (a == "--filter" && i + 1 < args.size()) { cfg.bench_filter = args[++i]; continue; }
+                if (a == "--json" && i + 1 < args.size()) { cfg.bench_json = args[++i]; continue; }
+                if (a == "--baseline" && i + 1 < args.size()) { cfg.bench_baseline = args[++i]; continue; }
+                if (a == "--threshold" && i + 1 < args.size()) { cfg.bench_threshold = atof(args[++i].c_str()); continue; }
+                if (a == "--counters") { cfg.bench_counters = true; continue; }
+            }
             if (a == "-o" && i + 1 < args.size()) { cfg.out = args[++i]; }
-            else if (starts_with(a, "-O")) { cfg.opt = a.substr(1); }
+            else if (starts_with(a, "-O")) { cfg.opt = normalize_opt(a.substr(1)); }
             else if (a == "--no-lto") { cfg.lto = false; }
             else if (a == "--strict") { cfg.strict = true; cfg.hardline = true; }
             else if (a == "--relaxed") { cfg.relaxed = true; }
@@ -866,19 +5809,30 @@ int main(int argc, char** argv) {
             else if (a == "--debug") { cfg.debug = true; }
             else if (a == "--cc" && i + 1 < args.size()) { cfg.cc_prefer = args[++i]; }
             else if (a == "--target" && i + 1 < args.size()) { cfg.target = args[++i]; }
+            else if (a == "--cpu" && i + 1 < args.size()) { cfg.cpu = args[++i]; }
+            else if (starts_with(a, "--cpu=")) { cfg.cpu = a.substr(6); }
             else if (a == "--warn-as-error") { cfg.warn_as_error = true; }
             else if (a == "--capsule") { cfg.defines.push_back("CS_CAPSULE=1"); }
-            else if (a == "--trace-lib") { cfg.defines.push_back("CS_TRACE_LIB=1"); }
+            else if (a == "--trace-lib") { cfg.modules.insert("trace"); }
+            else if (a == "--memstats") { cfg.modules.insert("memstats"); }
+            else if (a == "--sample") { cfg.modules.insert("sample"); }
+            else if (a == "--profile-use" && i + 1 < args.size()) { cfg.profile_use = args[++i]; }
+            else if (a == "--size-report") { cfg.size_report = true; }
+            else if (a == "--remarks") { cfg.remarks = true; }
+            else if (a == "--auto-fix") { cfg.auto_fix = true; }
             else if (!a.empty() && a[0] != '-') { inpath = a; }
         }
         if (inpath.empty()) { throw CompilerError("Missing input .csc file"); }
+        map<string, BenchStat> benchBaseline;
+        if (cfg.bench && !cfg.bench_baseline.empty()) benchBaseline = load_bench_baseline(cfg.bench_baseline);
 
         // Show compilation info if verbose
         if (cfg.verbose) {
             std::cerr << "C-Script Compiler v" << CSCRIPT_VERSION << "\n"
                 << "Input: " << inpath << "\n"
                 << "Output: " << cfg.out << "\n"
-                << "Optimization: " << cfg.opt << (cfg.lto ? " with LTO" : "") << "\n";
+                << "Optimization: " << cfg.opt << (cfg.lto ? " with LTO" : "") << "\n"
+                << "CPU: " << (cfg.cpu.empty() ? "generic" : cfg.cpu) << "\n";
         }
 
         // Auto-set output name if not specified
@@ -897,22 +5851,31 @@ int main(int argc, char** argv) {
 #endif
         }
 
+        // Bench builds are throwaway: run from a temp file, removed after the run
+        if (cfg.bench) {
+#if defined(_WIN32)
+            cfg.out = write_temp("cscript_bench.exe", "");
+#else
+            cfg.out = write_temp("cscript_bench.out", "");
+#endif
+            rm_file(cfg.out);
+        }
+
         auto start_time = std::chrono::high_resolution_clock::now();
 
         // Read & split into directives + body
-        string srcAll = read_file(inpath);
-        vector<string> bodyLines;
-        parse_directives_and_collect(srcAll, cfg, bodyLines);
         string body;
-        body.reserve(srcAll.size());
-        for (auto& l : bodyLines) { body += l; body.push_back('\n'); }
+        {
+            MappedFile srcAll(inpath);
+            parse_directives_and_collect(srcAll.view(), cfg, body);
+        }
 
         // 1) Analyze enum! and emit typedefs + helpers; collect enum members
         if (cfg.verbose) {
             std::cerr << "Processing enum! declarations...\n";
         }
         map<string, EnumInfo> enums;
-        string enumLowered = lower_enum_bang_and_collect(body, enums);
+        string enumLowered = lower_soa_structs(lower_enum_bang_and_collect(body, enums));
         if (cfg.verbose) {
             std::cerr << "Found " << enums.size() << " enum types\n";
         }
@@ -920,19 +5883,38 @@ int main(int argc, char** argv) {
         // 2) Compile-time switch exhaustiveness checks against enum!
         check_exhaustiveness_or_die(body, enums); // analyze original macros in 'body'
 
-        // 3) Lower @unsafe blocks
-        string unsafeLowered = lower_unsafe_blocks(enumLowered);
+        // 3) Lower @trace marks, bench blocks, @unsafe/@arena blocks, spawn/join/parallel_for and chan[T] onto their runtimes
+        string unsafeLowered = lower_spawn_join(lower_arena_blocks(lower_unsafe_blocks(lower_bench_blocks(lower_trace_marks(enumLowered, cfg), cfg)), cfg), cfg);
+        int switchIds = 0;
+        unsafeLowered = lower_stmt_annotations(lower_string_switch(unsafeLowered, switchIds), cfg);
+        unsafeLowered = lower_struct_attrs(unsafeLowered, cfg, enums);
+        unsafeLowered = lower_result_types(lower_view_types(lower_chan_types(unsafeLowered, cfg)));
+        unsafeLowered = lower_defer(unsafeLowered);
 
         // 4) PGO two-pass (optional)
         set<string> hotFns; // selected after pass 1
         string cc = pick_cc(cfg.cc_prefer);
 
-        auto build_once = [&](const string& c_src, const string& out, bool profileBuild) -> int {
-            string cpath = write_temp(string("cscript_") + std::to_string(uintptr_t(&cfg)) + ".c", c_src);
-            string cmd = build_cmd(cfg, cc, cpath, out, profileBuild);
+        // The translation unit is prelude + modules + lowered body; the pieces
+        // are written to the compiler's input file one after another. The
+        // prelude is its own virtual file and the body starts at line 1 of the
+        // .csc (see "Source lines"), so diagnostics, debug info and perf point
+        // at C-Script source.
+        const string preludeLine = "#line 1 \"<cscript-prelude>\"\n";
+        // A bench build swaps the program's main for the harness.
+        const string bodyLine = "\n#define CS__SRC " + c_quote(inpath) + (cfg.bench ? "\n#define main cs__user_main" : "") +
+            "\n#line 1 CS__SRC\n";
+        const string benchMain = !cfg.bench ? "" :
+            "\n#line 1 \"<cscript-generated>\"\n#undef main\nint main(int argc, char** argv) { return cs_bench_main(argc, argv); }\n";
+        auto build_once = [&](const vector<std::string_view>& c_src, const string& out, bool profileBuild) -> int {
             if (cfg.show_c) {
-                std::cerr << "--- Generated C ---\n" << c_src << "\n--- End ---\n";
+                std::cerr << "--- Generated C ---\n";
+                for (auto p : c_src) std::cerr << p;
+                std::cerr << "\n--- End ---\n";
             }
+            if (cfg.auto_fix) return build_autofix::build(cfg, cc, c_src, out, profileBuild);
+            string cpath = write_temp_pieces(string("cscript_") + std::to_string(uintptr_t(&cfg)) + ".c", c_src);
+            string cmd = build_cmd(cfg, cc, cpath, out, profileBuild);
             if (cfg.verbose) {
                 std::cerr << "Building with command:\n" << cmd << "\n";
             }
@@ -941,14 +5923,27 @@ int main(int argc, char** argv) {
             return rc;
             };
 
-        if (cfg.profile) {
-            // First pass: instrument softline fns and build temp exe
-            string s1 = prelude(cfg.hardline);
-            string inst = softline_lower(unsafeLowered, cfg.softline, /*hot*/{}, /*instrument*/true);
-            s1 += "\n"; s1 += inst;
+        if (!cfg.profile_use.empty()) {
+            // Profile from an earlier run (instrumented counts or @sample stacks)
+            auto counts = read_profile_counts(cfg.profile_use);
+            if (counts.empty()) std::cerr << "warning: no profile data in " << cfg.profile_use << "\n";
+            hotFns = select_hot_functions(counts, 16);
+            if (cfg.verbose) {
+                std::cerr << "Selected " << hotFns.size() << " hot functions from " << cfg.profile_use << "\n";
+            }
+        }
+        else if (cfg.profile) {
+            // First pass: instrument softline fns (or, for @profile sample, build
+            // with the sampler) and build temp exe
+            bool hadSample = cfg.modules.count("sample") > 0;
+            if (cfg.profile_sample) cfg.modules.insert("sample");
+            string pre = prelude(cfg.hardline), mods = prelude_modules(cfg);
+            string inst = softline_lower(unsafeLowered, cfg.softline, /*hot*/{}, /*instrument*/!cfg.profile_sample,
+                cfg.modules.count("trace") > 0);
 
             if (cfg.verbose) {
-                std::cerr << "Building instrumented version for profile-guided optimization...\n";
+                std::cerr << (cfg.profile_sample ? "Building sampling version" : "Building instrumented version")
+                    << " for profile-guided optimization...\n";
             }
 
             string tempExeProfile;
@@ -959,7 +5954,9 @@ int main(int argc, char** argv) {
             tempExeProfile = write_temp("cscript_prof.out", "");
             rm_file(tempExeProfile);
 #endif
-            if (build_once(s1, tempExeProfile, /*defineProfile*/true) != 0) {
+            int rcProf = build_once({ preludeLine, pre, mods, bodyLine, inst, benchMain }, tempExeProfile, /*defineProfile*/true);
+            if (!hadSample) cfg.modules.erase("sample");
+            if (rcProf != 0) {
                 throw CompilerError("Build failed (instrumented pass)");
             }
 
@@ -970,13 +5967,15 @@ int main(int argc, char** argv) {
 
             string profPath = write_temp("cscript_profile.txt", "");
             rm_file(profPath);
-            int rcRun = run_exe_with_env(tempExeProfile, "CS_PROFILE_OUT", profPath);
+            int rcRun = run_exe_with_env(tempExeProfile, cfg.profile_sample ? "CS_SAMPLE_OUT" : "CS_PROFILE_OUT", profPath);
             if (rcRun != 0) {
                 std::cerr << "warning: instrumented run returned " << rcRun << "; proceeding\n";
             }
 
             // Read profile and select hot functions
             auto counts = read_profile_counts(profPath);
+            if (counts.empty() && cfg.profile_sample)
+                std::cerr << "warning: the training run finished before any samples were taken\n";
             hotFns = select_hot_functions(counts, 16);
 
             if (cfg.verbose) {
@@ -988,18 +5987,27 @@ int main(int argc, char** argv) {
         }
 
         // 5) Final lowering with hot attributes, no instrumentation
-        string csrc = prelude(cfg.hardline);
-        string lowered = softline_lower(unsafeLowered, cfg.softline, hotFns, /*instrument*/false);
-        csrc += "\n"; csrc += lowered;
+        string pre = prelude(cfg.hardline), mods = prelude_modules(cfg);
+        string lowered = softline_lower(unsafeLowered, cfg.softline, hotFns, /*instrument*/false, cfg.modules.count("trace") > 0);
+        unsafeLowered = string();   // last use; release before the C compiler runs
 
         // 6) Final build to single exe
         if (cfg.verbose) {
             std::cerr << "Building final executable...\n";
         }
 
-        if (build_once(csrc, cfg.out, /*defineProfile*/false) != 0) {
+        if (cfg.remarks) {
+            cfg.remarks_file = write_temp("cscript_remarks.txt", "");
+            rm_file(cfg.remarks_file);
+        }
+        if (build_once({ preludeLine, pre, mods, bodyLine, lowered, benchMain }, cfg.out, /*defineProfile*/false) != 0) {
+            if (cfg.remarks) rm_file(cfg.remarks_file);
             throw CompilerError("Build failed");
         }
+        if (cfg.remarks) {
+            print_remarks(cfg.remarks_file, inpath, lowered, hotFns);
+            rm_file(cfg.remarks_file);
+        }
 
         auto end_time = std::chrono::high_resolution_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
@@ -1007,6 +6015,8 @@ int main(int argc, char** argv) {
         if (cfg.verbose) {
             std::cerr << "Build completed in " << duration << "ms\n";
         }
+        if (cfg.size_report) print_size_report(cfg.out);
+        if (cfg.bench) return run_benchmarks(cfg, benchBaseline);
 
         std::cout << cfg.out << "\n";
         return 0;
@@ -1098,17 +6108,53 @@ static std::string cs_write_temp_file(const std::string& base, llvm::StringRef d
 
 static void cs_rm(const std::string& p) { std::remove(p.c_str()); }
 
+// ---- Resolve @cpu / --cpu to an LLVM CPU name + feature string
+static void cs_resolve_cpu(const Config& cfg, std::string& cpu, std::string& features) {
+    cpu = "generic";
+    features.clear();
+    if (cfg.cpu.empty()) return;
+    CpuSpec c = parse_cpu_spec(cfg.cpu);
+    std::vector<std::string> feats;
+    if (c.name == "native") {
+        cpu = llvm::sys::getHostCPUName().str();
+        llvm::StringMap<bool> host;
+        if (llvm::sys::getHostCPUFeatures(host))
+            for (auto& kv : host) feats.push_back((kv.second ? "+" : "-") + kv.first().str());
+    }
+    else if (!c.name.empty()) cpu = c.name;
+    for (auto& f : c.features) feats.push_back(f);   // explicit toggles override host detection
+    for (auto& f : feats) { if (!features.empty()) features += ','; features += f; }
+}
+
 // ---- Map @opt to Clang codegen levels
 static void cs_apply_codegen_opts(clang::CodeGenOptions& CGO, const Config& cfg) {
     if (cfg.opt == "O0") CGO.OptimizationLevel = 0;
     else if (cfg.opt == "O1") CGO.OptimizationLevel = 1;
     else if (cfg.opt == "O2") CGO.OptimizationLevel = 2;
-    else /*O3/max/size*/   CGO.OptimizationLevel = 3;
+    else if (is_size_opt(cfg)) {
+        // clang's -Os/-Oz: O2 pipeline, functions tagged optsize (+ minsize for Oz)
+        CGO.OptimizationLevel = 2;
+        CGO.OptimizeSize = cfg.opt == "Oz" ? 2 : 1;
+    }
+    else /*O3/max*/ CGO.OptimizationLevel = 3;
+
+    if (is_size_opt(cfg)) {
+        CGO.FunctionSections = 1;
+        CGO.DataSections = 1;
+    }
+
+    if (!cfg.remarks_file.empty()) {
+        CGO.OptRecordFile = cfg.remarks_file;
+        CGO.OptRecordFormat = "yaml";
+        CGO.OptRecordPasses = "inline|loop-vectorize|slp-vectorizer";
+    }
 
     if (cfg.debug) {
         CGO.setDebugInfo(clang::codegenoptions::FullDebugInfo);
     }
 
+    if (cfg.modules.count("sample")) CGO.setFramePointer(clang::CodeGenOptions::FramePointerKind::All);
+
     if (cfg.lto) {
         CGO.EmitLLVMUsableTypeMetadata = 1;
     }
@@ -1151,11 +6197,18 @@ cs_compile_c_to_obj_inproc(const std::string& c_source,
     // Target triple: host or specified
     auto targetOpts = std::make_shared<clang::TargetOptions>();
     targetOpts->Triple = cfg.target.empty() ? llvm::sys::getDefaultTargetTriple() : cfg.target;
+    {
+        std::string cpu, feats;
+        cs_resolve_cpu(cfg, cpu, feats);
+        targetOpts->CPU = cpu;
+        for (auto& f : split(feats, ',')) if (!f.empty()) targetOpts->FeaturesAsWritten.push_back(f);
+    }
     Inv->setTargetOpts(*targetOpts);
 
     // Header search / preprocessor
     PreprocessorOptions& PP = Inv->getPreprocessorOpts();
     for (auto& d : cfg.defines) PP.addMacroDef(d);
+    if (cfg.modules.count("sample") || cfg.modules.count("bench") || cfg.modules.count("trace")) PP.addMacroDef("_GNU_SOURCE");
     HeaderSearchOptions& HS = Inv->getHeaderSearchOpts();
     for (auto& p : cfg.incs) HS.AddPath(p, frontend::Angled, false, false);
 
@@ -1236,6 +6289,7 @@ static int cs_link_with_lld(const Config& cfg,
 
     hold.push_back("/defaultlib:msvcrt");
     args.push_back(hold.back().c_str());
+    if (is_size_opt(cfg)) { args.push_back("/OPT:REF"); args.push_back("/OPT:ICF"); }
 
     if (lld::coff::link(args, /*canExitEarly*/ false, llvm::outs(), llvm::errs()))
         rc = 0;
@@ -1263,6 +6317,7 @@ static int cs_link_with_lld(const Config& cfg,
     }
 
     args.push_back("-lSystem");
+    if (is_size_opt(cfg)) args.push_back("-dead_strip");
 
     if (lld::macho::link(args, /*canExitEarly*/ false, llvm::outs(), llvm::errs()))
         rc = 0;
@@ -1303,7 +6358,9 @@ static int cs_link_with_lld(const Config& cfg,
             break;
         }
     }
+    if (cfg.modules.count("threads") || cfg.modules.count("sample") || cfg.modules.count("trace")) { hold.push_back("-lpthread"); args.push_back(hold.back().c_str()); }
     hold.push_back("-lc"); args.push_back(hold.back().c_str());
+    if (is_size_opt(cfg)) { args.push_back("--gc-sections"); args.push_back("--icf=all"); }
 
     if (lld::elf::link(args, /*canExitEarly*/ false, llvm::outs(), llvm::errs()))
         rc = 0;
@@ -1353,10 +6410,17 @@ static int build_once_llvm_inproc(const Config& cfg,
 
     auto targetOpts2 = std::make_shared<TargetOptions>();
     targetOpts2->Triple = sys::getDefaultTargetTriple();
+    {
+        std::string cpu, feats;
+        cs_resolve_cpu(cfg, cpu, feats);
+        targetOpts2->CPU = cpu;
+        for (auto& f : split(feats, ',')) if (!f.empty()) targetOpts2->FeaturesAsWritten.push_back(f);
+    }
     Inv->setTargetOpts(*targetOpts2);
 
     PreprocessorOptions& PP = Inv->getPreprocessorOpts();
     for (auto& d : cfg.defines) PP.addMacroDef(d);
+    if (cfg.modules.count("sample") || cfg.modules.count("bench") || cfg.modules.count("trace")) PP.addMacroDef("_GNU_SOURCE");
     HeaderSearchOptions& HS = Inv->getHeaderSearchOpts();
     for (auto& p : incs) HS.AddPath(p, frontend::Angled, false, false);
 
@@ -1393,9 +6457,19 @@ static int build_once_llvm_inproc(const Config& cfg,
 }
 
 // ---- Utility: run our pass + a standard O-level pipeline before codegen
-static void cs_run_ir_pipeline(llvm::Module& M, int optLevel) {
+// sizeLevel 1/2 selects the Os/Oz pipeline and tags every definition optsize
+// (+ minsize), which is what steers inlining and codegen towards small code.
+static void cs_run_ir_pipeline(llvm::Module& M, int optLevel, int sizeLevel = 0) {
     using namespace llvm;
 
+    if (sizeLevel > 0) {
+        for (Function& F : M) {
+            if (F.isDeclaration()) continue;
+            F.addFnAttr(Attribute::OptimizeForSize);
+            if (sizeLevel > 1) F.addFnAttr(Attribute::MinSize);
+        }
+    }
+
     PassBuilder PB;
     LoopAnalysisManager     LAM;
     FunctionAnalysisManager FAM;
@@ -1418,6 +6492,7 @@ static void cs_run_ir_pipeline(llvm::Module& M, int optLevel) {
     case 2: O = OptimizationLevel::O2; break;
     case 3: default: O = OptimizationLevel::O3; break;
     }
+    if (sizeLevel > 0) O = sizeLevel > 1 ? OptimizationLevel::Oz : OptimizationLevel::Os;
     MPM.addPass(PB.buildPerModuleDefaultPipeline(O));
 
     MPM.run(M, MAM);
@@ -1436,14 +6511,17 @@ cs_emit_obj_from_module(llvm::Module& M, const Config& cfg) {
     if (!T) throw std::runtime_error("Target lookup failed: " + Error);
 
     TargetOptions Opts;
+    Opts.FunctionSections = Opts.DataSections = is_size_opt(cfg);
     CodeGenOpt::Level CGO = CodeGenOpt::Default;
     if (cfg.opt == "O0") CGO = CodeGenOpt::None;
     else if (cfg.opt == "O1") CGO = CodeGenOpt::Less;
-    else if (cfg.opt == "O2") CGO = CodeGenOpt::Default;
+    else if (cfg.opt == "O2" || is_size_opt(cfg)) CGO = CodeGenOpt::Default;
     else                    CGO = CodeGenOpt::Aggressive;
 
+    std::string CPU, Features;
+    cs_resolve_cpu(cfg, CPU, Features);
     std::unique_ptr<TargetMachine> TM(
-        T->createTargetMachine(Triple, "generic", "", Opts, std::nullopt, std::nullopt, CGO));
+        T->createTargetMachine(Triple, CPU, Features, Opts, std::nullopt, std::nullopt, CGO));
     M.setDataLayout(TM->createDataLayout());
 
     if (verifyModule(M, &errs())) {
@@ -1481,7 +6559,7 @@ static int cs_build_once_embed_profile_irpass(const Config& cfg,
         else if (cfg.opt == "O2") oLvl = 2;
         else                    oLvl = 3;
 
-        cs_run_ir_pipeline(*Mod, oLvl);
+        cs_run_ir_pipeline(*Mod, oLvl, cfg.opt == "Oz" ? 2 : is_size_opt(cfg) ? 1 : 0);
 
         auto ObjBuf = cs_emit_obj_from_module(*Mod, cfg);
 
@@ -1796,136 +6874,3 @@ static string predict_code_completion(const string& incomplete_code, const map<s
     return result;
 }
 
-// ============================================================================
-// ==============  Build Auto-Fix Shim (compiler+linker tandem) ===============
-// ============================================================================
-
-namespace build_autofix {
-
-    static bool is_msvc(const std::string& cc) {
-        return (cc == "cl" || cc == "clang-cl");
-    }
-
-    static std::string ascii_sanitize(const std::string& s) {
-        std::string out; out.reserve(s.size());
-        for (unsigned char c : s) {
-            out.push_back((c >= 32 && c < 127) || c == '\n' || c == '\t' ? char(c) : '?');
-        }
-        return out;
-    }
-
-    static std::string light_repair_c(const std::string& src) {
-        std::istringstream in(src);
-        std::string line, out;
-        out.reserve(src.size() + src.size() / 32);
-
-        auto rtrim = [](std::string s) {
-            while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r')) s.pop_back();
-            return s;
-            };
-
-        size_t openBr = 0, closeBr = 0;
-        while (std::getline(in, line)) {
-            std::string raw = line;
-            std::string stripped = rtrim(line);
-            size_t i = 0; while (i < stripped.size() && (stripped[i] == ' ' || stripped[i] == '\t')) ++i;
-            stripped.erase(0, i);
-
-            if (!stripped.empty() && stripped[0] == '#') {
-                out += raw + "\n";
-            }
-            else {
-                for (char c : stripped) {
-                    if (c == '{') ++openBr;
-                    else if (c == '}') ++closeBr;
-                }
-                bool endsWithBrace = !stripped.empty() && (stripped.back() == '{' || stripped.back() == '}');
-                bool endsWithSemi = !stripped.empty() && stripped.back() == ';';
-                bool looksStmt =
-                    (!stripped.empty() &&
-                        stripped.rfind("if", 0) == 0 ? false :
-                        stripped.rfind("for", 0) == 0 ? false :
-                        stripped.rfind("while", 0) == 0 ? false :
-                        stripped.rfind("switch", 0) == 0 ? false :
-                        stripped.back() == ')' || stripped.find('=') != std::string::npos ||
-                        stripped.rfind("return", 0) == 0);
-                if (!endsWithBrace && !endsWithSemi && looksStmt) out += raw + ";\n";
-                else out += raw + "\n";
-            }
-        }
-        while (openBr > closeBr) { out += "}\n"; ++closeBr; }
-        return out;
-    }
-
-    static std::string inject_flag(const std::string& cmd, const std::string& flag) {
-        if (cmd.find(flag) != std::string::npos) return cmd;
-        std::string out = cmd; out.push_back(' '); out += flag; return out;
-    }
-
-    static std::string ensure_link_lib(const std::string& cmd, const std::string& libFlag) {
-        return (cmd.find(libFlag) != std::string::npos) ? cmd : inject_flag(cmd, libFlag);
-    }
-
-    static int compile_attempt(const Config& cfg,
-        const std::string& cc,
-        const std::string& c_src,
-        const std::string& out,
-        bool defineProfile,
-        const char* note,
-        int mutKind /*0=none,1=encode,2=addlm*/) {
-        std::string cpath = write_temp(std::string("cscript_") + std::to_string(uintptr_t(&cfg)) + ".c", c_src);
-        std::string cmd = build_cmd(const_cast<Config&>(cfg), cc, cpath, out, defineProfile);
-
-        if (mutKind == 1) {
-            if (is_msvc(cc)) cmd = inject_flag(cmd, "/utf-8");
-            else {
-                cmd = inject_flag(cmd, "-finput-charset=UTF-8");
-                cmd = inject_flag(cmd, "-fexec-charset=UTF-8");
-            }
-        }
-        else if (mutKind == 2) {
-#if !defined(_WIN32)
-            cmd = ensure_link_lib(cmd, "-lm");
-#endif
-        }
-
-        if (cfg.verbose) std::cerr << "[auto-fix] " << note << "\nCC: " << cmd << "\n";
-        int rc = run_cmd(cmd, false);
-        if (!cfg.show_c) rm_file(cpath);
-        return rc;
-    }
-
-    static int run_cmd_with_attempts(const Config& cfg,
-        const std::string& cc,
-        const std::string& c_src,
-        const std::string& out,
-        bool defineProfile) {
-        if (compile_attempt(cfg, cc, c_src, out, defineProfile, "Attempt 1: vanilla build", 0) == 0) return 0;
-        if (compile_attempt(cfg, cc, c_src, out, defineProfile, "Attempt 2: add UTF-8 encoding flags", 1) == 0) return 0;
-        if (compile_attempt(cfg, cc, c_src, out, defineProfile, "Attempt 3: ensure -lm (POSIX)", 2) == 0) return 0;
-
-        std::string asciiC = ascii_sanitize(c_src);
-        if (compile_attempt(cfg, cc, asciiC, out, defineProfile, "Attempt 4: ASCII-sanitize generated C", 1) == 0) return 0;
-
-        std::string repaired = light_repair_c(asciiC);
-        if (compile_attempt(cfg, cc, repaired, out, defineProfile, "Attempt 5: semicolon/brace repair", 1) == 0) return 0;
-
-        return 1;
-    }
-} // namespace build_autofix
-
-// Public shim to replace build_once(...) calls in main()
-static int build_once_autofix(const Config& cfg,
-    const std::string& cc,
-    const std::string& c_src,
-    const std::string& out,
-    bool defineProfile) {
-    if (cfg.show_c) {
-        std::cerr << "--- Generated C (pre-auto-fix) ---\n" << c_src << "\n--- End ---\n";
-    }
-    if (cfg.verbose) {
-        std::cerr << "Building (auto-fix enabled)...\n";
-    }
-    return build_autofix::run_cmd_with_attempts(cfg, cc, c_src, out, defineProfile);
-}
-